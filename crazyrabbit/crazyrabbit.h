@@ -23,17 +23,49 @@
 
 #include <string>
 #include <vector>
+#include <array>
+#include <utility>
+#include <tuple>
+#include <algorithm>
+#include <cmath>
 #include <random>
 #include <limits>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <optional>
 #include "surge/position.h"
 #include "surge/tables.h"
 #include "surge/types.h"
 #include "utils.h"
+#include "instrumentation.h"
 #include "cppflow/cppflow.h"
 
+#ifdef CRAZYRABBIT_AOT
+// generated by tfcompile from the targets in training/aot/BUILD
+#include "aot/crazyrabbit_b1.h"
+#include "aot/crazyrabbit_b8.h"
+#include "aot/crazyrabbit_b32.h"
+#include "aot/crazyrabbit_b64.h"
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #define NNET_MODEL_PATH "./model"
-#define OPENINGS_PATH "./openings.txt"
+#define OPENINGS_PATH "./openings.bin"
+#define OPENINGS_TEXT_PATH "./openings.txt"
 
 namespace crazyrabbit
 {
@@ -41,6 +73,17 @@ namespace crazyrabbit
     ////////////////////////////////// MAIN CLASSES //////////////////////////////////
     //////////////////////////////////////////////////////////////////////////////////
 
+    //Per-position data used to test whether moves give check or fork without playing them.
+    struct CheckInfo
+    {
+        Color us = WHITE;
+        Square their_king = NO_SQUARE;
+        Bitboard occupied = 0ULL;
+        Bitboard their_pieces = 0ULL;
+        Bitboard check_squares[NPIECE_TYPES] = {};  // squares from which a piece of each type attacks the enemy king
+        Bitboard discoverers = 0ULL;                 // own pieces that are the only blocker between an own slider and the enemy king
+    };
+
     //Main representation of the game board.
     class Board
     {
@@ -48,7 +91,7 @@ namespace crazyrabbit
         std::string starting_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] w KQkq - 0 1";
     public:
         Position p;
-        std::string hash;
+        uint64_t hash;
 
         Board()
         {
@@ -64,56 +107,338 @@ namespace crazyrabbit
         inline void push(Move& move);
         inline void push_encoded(const int move);
         inline void pop(Move& move);
-        inline move_vector<Move> legal_moves(bool filter = false, Color side = WHITE);
+        inline move_vector<Move> legal_moves(bool filter = false, Color side = WHITE, const std::atomic<bool>* cancelled = nullptr);
         inline double end_score(const Color c);
-        inline cppflow::tensor input_representation();
+        inline std::vector<cppflow::tensor> input_representation();
+        inline void input_planes(float* spatial, float* scalars);
         inline std::string san(Move& move);
         inline bool gives_check(Move& move);
         inline bool gives_fork(Move& move);
+        inline CheckInfo check_info();
+        inline bool gives_check(Move& move, const CheckInfo& ci);
+        inline bool gives_fork(Move& move, const CheckInfo& ci);
         inline double eval_drop(Move& move);
+        inline Move mate_in_one();
 
     private:
         inline void calc_hash();
+        inline std::string check_suffix(Move& move);
+    };
+
+    //Interface of a neural network evaluation backend.
+    class NNetBackend
+    {
+    public:
+        virtual ~NNetBackend() = default;
+
+        //Returns the policy and value prediction of the given board's position.
+        virtual std::pair<std::vector<float>, float> predict(Board& board) = 0;
+
+        //Returns the predictions of all the given boards' positions. Backends that can evaluate several positions at once override this.
+        virtual std::vector<std::pair<std::vector<float>, float>> predict_batch(std::vector<Board*>& boards)
+        {
+            std::vector<std::pair<std::vector<float>, float>> predictions;
+            predictions.reserve(boards.size());
+            for (Board* board : boards)
+                predictions.push_back(predict(*board));
+            return predictions;
+        }
+    };
+
+    //Evaluation backend that runs the saved TensorFlow model.
+    class TFBackend : public NNetBackend
+    {
+    public:
+        cppflow::model* model;
+        bool owns_model;
+
+        TFBackend(cppflow::model* nnet_model, bool owns) : model(nnet_model), owns_model(owns) {}
+
+        ~TFBackend()
+        {
+            if (owns_model && model != nullptr)
+                delete model;
+        }
+
+        std::pair<std::vector<float>, float> predict(Board& board) override
+        {
+            std::vector<cppflow::tensor> input = board.input_representation();
+            std::vector<cppflow::tensor> output;
+            {
+                CRAZYRABBIT_ZONE(SessionRun);
+                output = (model->operator())({ {"serving_default_spatial:0", input[0]}, {"serving_default_scalars:0", input[1]} }, { "StatefulPartitionedCall:0", "StatefulPartitionedCall:1" });
+            }
+            std::pair<std::vector<float>, float> prediction(output[0].get_data<float>(), output[1].get_data<float>()[0]);
+            return prediction;
+        }
+
+        std::vector<std::pair<std::vector<float>, float>> predict_batch(std::vector<Board*>& boards) override
+        {
+            int64_t batch_size = static_cast<int64_t>(boards.size());
+            std::vector<float> spatial(boards.size() * SPATIAL_INPUT_SIZE);
+            std::vector<float> scalars(boards.size() * SCALAR_INPUT_SIZE);
+            for (size_t i = 0; i < boards.size(); i++)
+                boards[i]->input_planes(spatial.data() + i * SPATIAL_INPUT_SIZE, scalars.data() + i * SCALAR_INPUT_SIZE);
+
+            cppflow::tensor spatial_input(spatial, { batch_size, SPATIAL_PLANES, 64 });
+            cppflow::tensor scalar_input(scalars, { batch_size, SCALAR_INPUT_SIZE });
+            std::vector<cppflow::tensor> output;
+            {
+                CRAZYRABBIT_ZONE(SessionRun);
+                output = (model->operator())({ {"serving_default_spatial:0", spatial_input}, {"serving_default_scalars:0", scalar_input} }, { "StatefulPartitionedCall:0", "StatefulPartitionedCall:1" });
+            }
+            std::vector<float> policies = output[0].get_data<float>();
+            std::vector<float> values = output[1].get_data<float>();
+
+            std::vector<std::pair<std::vector<float>, float>> predictions(boards.size());
+            for (size_t i = 0; i < boards.size(); i++)
+            {
+                predictions[i].first.assign(policies.begin() + i * ACTION_SIZE, policies.begin() + (i + 1) * ACTION_SIZE);
+                predictions[i].second = values[i];
+            }
+            return predictions;
+        }
+    };
+
+#ifdef CRAZYRABBIT_AOT
+    //Evaluation backend that runs the ahead-of-time compiled model, without a TensorFlow session.
+    //The model is compiled for batches of 1, 8, 32 and 64 boards (one tf_library target each in training/aot/BUILD), smaller batches are
+    //padded to the nearest one.
+    class AOTBackend : public NNetBackend
+    {
+    public:
+        aot::NNetB1 b1;
+        aot::NNetB8 b8;
+        aot::NNetB32 b32;
+        aot::NNetB64 b64;
+
+        std::pair<std::vector<float>, float> predict(Board& board) override
+        {
+            std::fill_n(b1.arg_spatial_data(), SPATIAL_INPUT_SIZE, 0.0f);
+            std::fill_n(b1.arg_scalars_data(), SCALAR_INPUT_SIZE, 0.0f);
+            board.input_planes(b1.arg_spatial_data(), b1.arg_scalars_data());
+
+            bool ok;
+            {
+                CRAZYRABBIT_ZONE(SessionRun);
+                ok = b1.Run();
+            }
+            if (!ok)
+                throw std::runtime_error(std::string("NNET ERROR: ") + b1.error_msg());
+
+            std::pair<std::vector<float>, float> prediction(std::vector<float>(b1.result_pi_data(), b1.result_pi_data() + ACTION_SIZE), b1.result_v_data()[0]);
+            return prediction;
+        }
+
+        std::vector<std::pair<std::vector<float>, float>> predict_batch(std::vector<Board*>& boards) override
+        {
+            std::vector<std::pair<std::vector<float>, float>> predictions(boards.size());
+
+            size_t offset = 0;
+            while (offset < boards.size())
+            {
+                size_t remaining = boards.size() - offset;
+                if (remaining > 32)
+                    offset += run(b64, 64, boards, offset, predictions);
+                else if (remaining > 8)
+                    offset += run(b32, 32, boards, offset, predictions);
+                else if (remaining > 1)
+                    offset += run(b8, 8, boards, offset, predictions);
+                else
+                    offset += run(b1, 1, boards, offset, predictions);
+            }
+
+            return predictions;
+        }
+
+    private:
+        //Runs the compiled function on up to batch_size boards starting at offset and returns the number of boards evaluated.
+        template <class Compiled>
+        size_t run(Compiled& fn, size_t batch_size, std::vector<Board*>& boards, size_t offset, std::vector<std::pair<std::vector<float>, float>>& predictions)
+        {
+            size_t count = std::min(batch_size, boards.size() - offset);
+
+            // the unused slots stay zeroed as padding
+            std::fill_n(fn.arg_spatial_data(), batch_size * SPATIAL_INPUT_SIZE, 0.0f);
+            std::fill_n(fn.arg_scalars_data(), batch_size * SCALAR_INPUT_SIZE, 0.0f);
+            for (size_t i = 0; i < count; i++)
+                boards[offset + i]->input_planes(fn.arg_spatial_data() + i * SPATIAL_INPUT_SIZE, fn.arg_scalars_data() + i * SCALAR_INPUT_SIZE);
+
+            bool ok;
+            {
+                CRAZYRABBIT_ZONE(SessionRun);
+                ok = fn.Run();
+            }
+            if (!ok)
+                throw std::runtime_error(std::string("NNET ERROR: ") + fn.error_msg());
+
+            for (size_t i = 0; i < count; i++)
+            {
+                predictions[offset + i].first.assign(fn.result_pi_data() + i * ACTION_SIZE, fn.result_pi_data() + (i + 1) * ACTION_SIZE);
+                predictions[offset + i].second = fn.result_v_data()[i];
+            }
+
+            return count;
+        }
+    };
+#endif
+
+    //Deterministic evaluation backend that derives priors and values from the position hash instead of running a model.
+    //Used to benchmark and test the tree search on its own.
+    class SyntheticBackend : public NNetBackend
+    {
+    public:
+        long long latency;
+
+        SyntheticBackend(long long latency_us) : latency(latency_us) {}
+
+        std::pair<std::vector<float>, float> predict(Board& board) override
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            std::pair<std::vector<float>, float> prediction = synthesize(board);
+
+            // emulate the inference time by keeping the thread busy
+            while (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() < latency);
+
+            return prediction;
+        }
+
+        //A batch takes the inference time of a single position, like on a GPU.
+        std::vector<std::pair<std::vector<float>, float>> predict_batch(std::vector<Board*>& boards) override
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            std::vector<std::pair<std::vector<float>, float>> predictions;
+            predictions.reserve(boards.size());
+            for (Board* board : boards)
+                predictions.push_back(synthesize(*board));
+
+            while (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() < latency);
+
+            return predictions;
+        }
+
+    private:
+        inline std::pair<std::vector<float>, float> synthesize(Board& board)
+        {
+            // the position hash only covers the pieces, so mix in the pockets and the side to move
+            uint64_t key = board.p.get_hash() ^ (board.p.turn() == WHITE ? 0ULL : synthetic_side_key);
+            for (int piece = PAWN; piece <= QUEEN; piece++)
+            {
+                key = mix_hash(key ^ static_cast<uint64_t>(board.p.pocket_count(WHITE, static_cast<PieceType>(piece))));
+                key = mix_hash(key ^ static_cast<uint64_t>(board.p.pocket_count(BLACK, static_cast<PieceType>(piece))));
+            }
+
+            std::pair<std::vector<float>, float> prediction;
+            prediction.first.resize(ACTION_SIZE);
+            for (int action = 0; action < ACTION_SIZE; action++)
+                prediction.first[action] = static_cast<float>((mix_hash(key + static_cast<uint64_t>(action)) >> 40) + 1ULL) / 16777216.0f;
+            prediction.second = static_cast<float>(synthetic_value_range * (2.0 * static_cast<double>(mix_hash(key) >> 11) / 9007199254740992.0 - 1.0));
+            return prediction;
+        }
     };
 
     //Neural network implementation.
     class NNet
     {
     public:
-        cppflow::model* model = nullptr;
+        NNetBackend* backend = nullptr;
+        NNetBackendType backend_type = NNetBackendType::TensorFlow;
+        long long latency = synthetic_latency;
 
         NNet() = default;
 
         ~NNet()
         {
-            if (model != nullptr)
-                delete model;
+            if (backend != nullptr)
+                delete backend;
         }
 
-        //Initializes the neural network from a file.
-        inline void init() { model = new cppflow::model(NNET_MODEL_PATH); }
+        //Initializes the configured evaluation backend. The TensorFlow model is loaded from a file.
+        inline void init()
+        {
+            if (backend != nullptr)
+                delete backend;
 
-        //Returns the neural network prediction of the given board's position.
-        std::pair<std::vector<float>, float> predict(Board& board)
+            switch (backend_type)
+            {
+            case NNetBackendType::Synthetic:
+                backend = new SyntheticBackend(latency);
+                break;
+            case NNetBackendType::TensorFlow:
+                backend = new TFBackend(new cppflow::model(NNET_MODEL_PATH), true);
+                break;
+            case NNetBackendType::AOT:
+#ifdef CRAZYRABBIT_AOT
+                backend = new AOTBackend();
+                break;
+#else
+                throw std::runtime_error("NNET ERROR: the program was built without the AOT compiled model (CRAZYRABBIT_AOT).");
+#endif
+            default:
+                throw std::runtime_error("NNET ERROR: NNetBackend is of unknown type.");
+            }
+        }
+
+        //Initializes the neural network with an already loaded model, which stays owned by the caller.
+        inline void init(cppflow::model* nnet_model)
         {
-            cppflow::tensor input = board.input_representation();
-            auto output = (model->operator())({ {"serving_default_input_1:0", input} }, { "StatefulPartitionedCall:0", "StatefulPartitionedCall:1" });
-            std::pair<std::vector<float>, float> prediction(output[0].get_data<float>(), output[1].get_data<float>()[0]);
-            return prediction;
+            if (backend != nullptr)
+                delete backend;
+
+            backend = new TFBackend(nnet_model, false);
         }
+
+        //Returns the neural network prediction of the given board's position.
+        inline std::pair<std::vector<float>, float> predict(Board& board) { return backend->predict(board); }
+
+        //Returns the neural network predictions of all the given boards' positions.
+        inline std::vector<std::pair<std::vector<float>, float>> predict_batch(std::vector<Board*>& boards) { return backend->predict_batch(boards); }
+    };
+
+    //Fixed-size cache of the pawn structure and king shelter scores, indexed by the pawn hash of the position.
+    class PawnCache
+    {
+    public:
+        struct Entry
+        {
+            uint64_t key = 0ULL;
+            bool filled = false;
+            double pawn_structure = 0.0;
+            double king_shelter = 0.0;
+        };
+
+        long long probes = 0LL;
+        long long hits = 0LL;
+
+        PawnCache() : entries(pawn_cache_size) {}
+
+        inline Entry& entry(uint64_t key) { return entries[key & (pawn_cache_size - 1)]; }
+        inline double hit_rate() const { return (probes) ? static_cast<double>(hits) / static_cast<double>(probes) : 0.0; }
+        inline void reset_stats() { probes = hits = 0LL; }
+
+    private:
+        std::vector<Entry> entries;
     };
 
     //Evaluation function implementation.
     class Evaluator
     {
     private:
-        AttackInfo WT[NSQUARES];
-        AttackInfo BT[NSQUARES];
+        AttackMap WT;
+        AttackMap BT;
+
+        inline double calc_pawn_structure(Board& board);
+        inline double calc_king_shelter(Board& board);
+        inline PawnCache::Entry& probe_pawn_cache(Board& board);
+
+        template <EvalMask Mask> inline double eval_impl(Board& board);
+        template <size_t... I> static constexpr auto make_eval_kernels(std::index_sequence<I...>);
 
     public:
         EvalMask eval_types;
+        PawnCache pawn_cache;
 
-        constexpr Evaluator() : eval_types(0U), WT{}, BT{} {}
+        Evaluator() : WT{}, BT{}, eval_types(0U) {}
         ~Evaluator() = default;
 
         inline int q_to_cp(double q);
@@ -130,61 +455,49 @@ namespace crazyrabbit
         inline double eval(Board& board);
     };
 
-    //Holds information about opening moves.
-    class Openings
+    //Read-only view of a whole file mapped into memory.
+    class MappedFile
     {
-        robin_hood::unordered_map<std::string, std::vector<Move>> opening_moves;
-
     public:
-        inline void init()
-        {
-            std::ifstream file(OPENINGS_PATH);
-
-            if (file.is_open())
-            {
-                std::string line;
-                while (file)
-                {
-                    std::getline(file, line);
-                    
-                    size_t split_point = line.find(";");
-                    std::string board_hash = line.substr(0, split_point);
-                    std::string moves = line.substr(split_point + 1);
-
-                    std::vector<Move> o_moves;
-                    while (true)
-                    {
-                        split_point = moves.find(",");
-                        o_moves.emplace_back(moves.substr(0, split_point));
-
-                        if (split_point == std::string::npos)
-                            break;
-                        else
-                            moves = moves.substr(split_point + 1);
-                    }
-
-                    opening_moves[board_hash] = o_moves;
-                }
-            }
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { close(); }
 
-            file.close();
-        }
-
-        inline Move get_move(std::string board_hash)
-        {
-            auto found_moves = opening_moves.find(board_hash);
-            if (found_moves == opening_moves.cend())
-                return Move();
+        inline bool open(const char* path);
+        inline void close();
+        inline const char* data() const { return view; }
+        inline size_t size() const { return length; }
 
-            std::vector<Move>& moves = (*found_moves).second;
+    private:
+        const char* view = nullptr;
+        size_t length = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+    };
 
-            if (moves.size() == 1)
-                return moves.front();
+    //Holds information about opening moves. The book is memory mapped, so opening it does not depend on its size.
+    //A book in the old text format is read into memory instead.
+    class Openings
+    {
+        MappedFile file;
+        std::vector<BookEntry> text_entries;
+        const BookEntry* entries = nullptr;
+        size_t num_entries = 0;
+        std::mt19937_64 rng;
 
-            srand(time(NULL));
-            int index = rand() % moves.size();
-            return moves[index];
-        }
+    public:
+        Openings() : rng(book_seed) {}
+
+        inline void init();
+        inline void init(const char* path);
+        inline void init_text(const char* path);
+        inline static long read_text(std::istream& in, std::vector<BookEntry>& book, long& errors);
+        inline void seed(const uint64_t seed) { rng.seed(seed); }
+        inline size_t size() const { return num_entries; }
+        inline Move get_move(Board& board);
     };
 
     //Depth-first mate search implementation.
@@ -196,12 +509,19 @@ namespace crazyrabbit
         //Recursive DFS implementation.
         inline bool find_mate(Board board, Move move, const int depth)
         {
+            if (is_cancelled())
+                return false;
+
             board.push(move);
             double es = board.end_score(player);
 
             if (depth == max_depth || es != 0.0)
                 return (es > 0.5);
 
+            //Only the player can deliver mate on the last ply.
+            if (depth + 1 == max_depth)
+                return board.p.turn() == player && board.mate_in_one().from() != NO_SQUARE;
+
             for (Move& move : board.legal_moves())
             {
                 if (find_mate(board, move, depth + 1))
@@ -211,6 +531,8 @@ namespace crazyrabbit
             return false;
         }
 
+        inline bool is_cancelled() const { return cancelled && cancelled->load(std::memory_order_relaxed); }
+
         inline bool find_opponent_mate(Board board, Move move, const int depth)
         {
             board.push(move);
@@ -219,28 +541,36 @@ namespace crazyrabbit
             if (depth == 2 || es != 0.0)
                 return (es < -0.5);
 
-            for (Move& move : board.legal_moves())
-            {
-                if (find_opponent_mate(board, move, depth + 1))
-                    return true;
-            }
-            return false;
+            return board.mate_in_one().from() != NO_SQUARE;
         }
 
     public:
         int max_depth;
 
+        //Set when the search must return as soon as possible. Moves found until then are still valid.
+        const std::atomic<bool>* cancelled = nullptr;
+
         MateSearch() : player(NO_COLOR), max_depth(default_max_depth) {};
         ~MateSearch() = default;
 
         //Returns the move that leads to a direct mate. If no move is found, an empty move is returned.
         inline Move mate_move(Board& board)
         {
+            CRAZYRABBIT_ZONE(MateSearch);
             player = board.p.turn();
+
+            //Direct mates are found without searching.
+            Move mate = board.mate_in_one();
+            if (mate.from() != NO_SQUARE || max_depth <= 1)
+                return mate;
+
             for (Move& move : board.legal_moves())
             {
                 if (find_mate(board, move, 1))
                     return move;
+
+                if (is_cancelled())
+                    break;
             }
 
             return Move();
@@ -258,6 +588,97 @@ namespace crazyrabbit
         }
     };
 
+    //Counts the leaves of the legal move tree up to a given depth, used to validate and measure the move generator.
+    class Perft
+    {
+    public:
+        //Lockless table entry: the key is stored xored with the data, so an entry torn by another thread never matches.
+        struct Entry
+        {
+            std::atomic<uint64_t> key = 0ULL;
+            std::atomic<uint64_t> data = 0ULL;    // number of leaves in the upper 56 bits, depth in the lower 8 bits
+        };
+
+        //Counts the moves of the last ply instead of playing them.
+        bool bulk = true;
+
+        Perft() = default;
+        ~Perft() = default;
+
+        inline void set_hash_size(const size_t megabytes);
+        inline uint64_t count(Position& p, const int depth);
+        inline std::vector<std::pair<Move, uint64_t>> divide(Position& p, const int depth, const int threads);
+
+    private:
+        std::vector<Entry> table;
+
+        template <Color Us> inline uint64_t count_impl(Position& p, const int depth, Move* list);
+        inline bool probe(const uint64_t key, const int depth, uint64_t& nodes);
+        inline void store(const uint64_t key, const int depth, const uint64_t nodes);
+    };
+
+    //Calls a function on a separate thread when a deadline passes, unless it is disarmed before.
+    class Watchdog
+    {
+    public:
+        Watchdog() = default;
+        ~Watchdog() { disarm(); }
+
+        inline void arm(const long long milliseconds, std::function<void()> on_expire);
+        inline void disarm();
+
+    private:
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool armed = false;
+    };
+
+    //Splits the remaining time between moves and decides when the search for a move can stop.
+    class TimeManager
+    {
+    public:
+        long long remaining_time = -1LL;
+        long long increment = 0LL;
+        int moves_to_go = 0;
+
+        //Measured simulations per second and time saved by earlier moves, in milliseconds.
+        double nps = 0.0;
+        long long saved_time = 0LL;
+
+        //Time planned for the current move, the limit it can be extended to, the current budget and the hard deadline, in milliseconds.
+        long long optimum_time = 0LL;
+        long long maximum_time = 0LL;
+        long long budget = 0LL;
+        long long deadline = 0LL;
+
+        inline bool active() const { return remaining_time >= 0LL; }
+        inline void set_clock(const long long time, const long long inc, const int to_go);
+        inline void reset();
+        inline void start(const int ply);
+        inline long long elapsed() const;
+        inline bool should_stop(move_vector<Move>& moves, const long simulations);
+        inline void finish(const long simulations);
+
+    private:
+        std::chrono::steady_clock::time_point start_time;
+        Move best_move;
+        long long best_move_change = 0LL;
+        double budget_q = 0.0;
+        bool has_budget_q = false;
+    };
+
+    //State of a simulation between the selection of its leaf and the backpropagation of its value, so that the leaves of several
+    //simulations can be evaluated together.
+    struct SearchPath
+    {
+        std::vector<std::pair<move_vector<Move>*, Move*>> stack;    // chosen moves from the root to the leaf
+        move_vector<Move>* leaf = nullptr;                          // new node waiting for its evaluation
+        move_vector<Move>* child = nullptr;                         // node whose value is backed up, used by graph search
+        std::optional<Board> board;                                 // position of the leaf
+        double v = 0.0;
+    };
+
     //Monte-Carlo tree search implementation.
     class MCTS
     {
@@ -271,6 +692,9 @@ namespace crazyrabbit
         bool use_openings;
         bool use_mate_search;
         bool filter_moves;
+        bool progressive_widening;
+        bool hierarchical_drops;
+        bool graph_search;
 
         ModMask config;
         Color player;
@@ -279,9 +703,8 @@ namespace crazyrabbit
         bool time_control;
         int num_sims;
         long long time_per_move;
-        long long original_time;
-        bool time_saving_mode;
         long long time_simulating;
+        TimeManager time_manager;
         int executed_moves;
         int explored_nodes;
         int best_move_cp;
@@ -290,12 +713,27 @@ namespace crazyrabbit
 
         double eval_fac;
 
-        long long nnet_time = 0LL;
-        long long vc_time = 0LL;
-        long long pe_time = 0LL;
+        size_t tree_bytes = 0;
+        size_t max_tree_bytes = default_hash_size << 20;
+        long simulation = 0L;
+
+        //Hard deadline of a move searched with a fixed time in milliseconds, -1 if there is none.
+        long long move_deadline = -1LL;
+
+        //Set by the watchdog when the hard deadline passes. Long operations check it and return as soon as possible.
+        std::atomic<bool> cancelled = false;
 
-        MCTS() : initialized(false), time_control(true), num_sims(100), player(NO_COLOR), use_openings(false), use_mate_search(false), filter_moves(false), time_per_move(-1LL),
-                 original_time(-1LL), time_saving_mode(false), time_simulating(0LL), executed_moves(0), explored_nodes(0), best_move_cp(0), mode_switch(false), eval_fac(eval_factor), stop_simulating(false)
+        //Called from the watchdog thread with the fallback move when the hard deadline passes before the search returns.
+        std::function<void(Move)> on_deadline;
+
+        //Statistics of how much the moves overshot their planned time, in milliseconds.
+        long deadline_moves = 0L;
+        long deadline_misses = 0L;
+        long long total_overshoot = 0LL;
+        long long max_overshoot = 0LL;
+
+        MCTS() : initialized(false), time_control(true), num_sims(100), player(NO_COLOR), use_openings(false), use_mate_search(false), filter_moves(false), progressive_widening(false), hierarchical_drops(false), graph_search(false), time_per_move(-1LL),
+                 time_simulating(0LL), executed_moves(0), explored_nodes(0), best_move_cp(0), mode_switch(false), eval_fac(eval_factor), stop_simulating(false)
         {
             // initialize playing strategies
             set_best_move_strategy(BestMoveStrat::Default);
@@ -303,18 +741,21 @@ namespace crazyrabbit
             set_backprop_strategy(BackpropStrat::Default);
 
             add_policy_enhancement_strategy(PolicyEnhancementStrat::Dirichlet);
+
+            mate_search.cancelled = &cancelled;
         }
 
         ~MCTS() = default;
 
         inline void init(Board& board);
         inline void init(cppflow::model* nnet_model);
-        inline void init_time(const int available_time, const int increment);
-        inline void update_time(const int remaining_time);
+        inline void init_time(const int available_time, const int increment, const int moves_to_go);
+        inline void init_move_time(const long long move_time);
         //inline void update_config();
         inline void reset();
         //inline void soft_reset();
         inline void set_config(const ModMask conf);
+        inline void set_nnet_backend(const NNetBackendType backend_type, const long long latency);
         inline void set_best_move_strategy(const BestMoveStrat best_move_type);
         inline void set_node_expansion_strategy(const NodeExpansionStrat expansion_type);
         inline void set_backprop_strategy(const BackpropStrat backprop_type);
@@ -322,18 +763,47 @@ namespace crazyrabbit
         inline void remove_policy_enhancement_strategies();
 
         inline Move best_move(Board& board);
+        inline Move fallback_move();
         inline void search(Board board);
+        inline bool select_leaf(Board board, SearchPath& path);
+        inline void expand_leaf(SearchPath& path, std::pair<std::vector<float>, float>& prediction);
+        inline void backup(Board& root, SearchPath& path);
+        inline uint64_t node_key(Board& board);
+        inline void set_hash_size(const size_t megabytes) { max_tree_bytes = megabytes << 20; }
+        inline void prune_tree(Board board);
 
         inline move_vector<Move> eval_moves(Board& board);
 
     private:
+        Watchdog watchdog;
+        std::mutex fallback_mutex;
+        Move fallback;
+
+        inline Move find_best_move(Board& board);
+        inline void set_fallback(const Move& move);
         inline void on_mode_switch(bool state);
+        inline size_t node_bytes(const move_vector<Move>& moves);
 
         // ----------------------- STRATEGY INSTANCES ------------------------
         Move& (*best_move_strat)(move_vector<Move>&);
-        std::vector<void (*)(Board&, move_vector<Move>&)> policy_strats;
-        Move& (*expansion_strat)(move_vector<Move>&);
-        double (*backprop_strat)(const Move&, const double&);
+        NodeExpansionStrat expansion_strat = NodeExpansionStrat::Default;
+        BackpropStrat backprop_strat = BackpropStrat::Default;
+        PolicyMask policy_strats = 0U;
+        bool dirichlet_strat = false;
+
+        // ------------------------- SEARCH KERNELS --------------------------
+        // the selection and the backpropagation of search() are specialized at compile time for every combination of strategies
+        typedef bool (MCTS::*SelectKernel)(Board&, SearchPath&);
+        typedef void (MCTS::*BackupKernel)(SearchPath&);
+        SelectKernel select_kernel;
+        BackupKernel backup_kernel;
+
+        template <NodeExpansionStrat Expansion, PolicyMask Policy, bool Dirichlet>
+        inline bool select_impl(Board& board, SearchPath& path);
+        template <BackpropStrat Backprop>
+        inline void backup_impl(SearchPath& path);
+        template <size_t... I> static constexpr auto make_select_kernels(std::index_sequence<I...>);
+        inline void select_search_kernel();
     };
 
     //////////////////////////////////////////////////////////////////////////////////
@@ -347,6 +817,8 @@ namespace crazyrabbit
     //Strategy to choose the next move to expand during a MCTS simulation.
     inline Move& move_to_expand_default(move_vector<Move>& moves);
     inline Move& move_to_expand_inc(move_vector<Move>& moves);
+    template <NodeExpansionStrat Expansion> inline Move& move_to_expand_widened(move_vector<Move>& moves, const bool widen);
+    inline void order_children(move_vector<Move>& moves, const bool group_drops);
 
     //Strategy to calculate Q-values during backpropagation.
     inline double backprop_nvisits_qvalue(const Move& move, const double& v);
@@ -354,12 +826,8 @@ namespace crazyrabbit
 
     //Strategy for enhancing the prior probability of legal moves returned by the neural network.
     inline void enhance_policy_dirichlet(Board& board, move_vector<Move>& moves);
-    inline void enhance_policy_checking_moves(Board& board, move_vector<Move>& moves);
-    inline void enhance_policy_forking_moves(Board& board, move_vector<Move>& moves);
-    inline void enhance_policy_dropping_moves(Board& board, move_vector<Move>& moves);
-    inline void enhance_policy_capturing_moves(Board& board, move_vector<Move>& moves);
+    template <PolicyMask Policy> inline void enhance_policy(Board& board, move_vector<Move>& moves);
 
-    inline bool filter_next_move(Position p, Move move);
     inline int filter_move(Position p, Move move);
 
     //////////////////////////////////////////////////////////////////////////////////
@@ -380,6 +848,8 @@ namespace crazyrabbit
     //Sets the board position to the one described by the given FEN string.
     inline void Board::set_fen(const std::string& fen)
     {
+        //Position::set() puts the pieces on top of the current ones and keeps the history, so it starts from an empty position.
+        p = Position();
         Position::set(fen, p);
         calc_hash();
     }
@@ -417,7 +887,8 @@ namespace crazyrabbit
         calc_hash();
     }
 
-    inline move_vector<Move> Board::legal_moves(bool filter, Color side) 
+    //Filtering stops when cancelled and the remaining moves are kept unfiltered.
+    inline move_vector<Move> Board::legal_moves(bool filter, Color side, const std::atomic<bool>* cancelled) 
     { 
         move_vector<Move> moves = (p.turn() == WHITE) ? p.generate_legals<WHITE>() : p.generate_legals<BLACK>();
         if (!filter || side != p.turn())
@@ -427,6 +898,12 @@ namespace crazyrabbit
         int move_score;
         for (Move& move : moves)
         {
+            if (cancelled && cancelled->load(std::memory_order_relaxed))
+            {
+                filtered_moves.push_back(move);
+                continue;
+            }
+
             move_score = filter_move(p, move);
             if (move_score == 1)
             {
@@ -462,15 +939,23 @@ namespace crazyrabbit
     }
 
     //Returns a representation of the current board position that can be used as an input to the neural network.
-    inline cppflow::tensor Board::input_representation()
+    //The planes that are constant across the board are passed as scalars and broadcast by the network itself.
+    inline std::vector<cppflow::tensor> Board::input_representation()
     {
-        int size = 34 * 64;
-        std::vector<float> input_rep(size);
+        std::vector<float> spatial(SPATIAL_INPUT_SIZE);
+        std::vector<float> scalars(SCALAR_INPUT_SIZE);
+        input_planes(spatial.data(), scalars.data());
+        return { cppflow::tensor(spatial, { 1, SPATIAL_PLANES, 64 }), cppflow::tensor(scalars, { 1, SCALAR_INPUT_SIZE }) };
+    }
 
+    //Writes the input representation of the current board position into the given zeroed buffers of SPATIAL_INPUT_SIZE and SCALAR_INPUT_SIZE floats.
+    inline void Board::input_planes(float* spatial, float* scalars)
+    {
+        CRAZYRABBIT_ZONE(Encode);
         int start_index = 0;
 
-        // pieces positions for each player (12 layers)
-        // white (6 layers)
+        // pieces positions for each player (12 planes)
+        // white (6 planes)
         for (int piece = PAWN; piece <= KING; piece++)
         {
             Bitboard squares = p.bitboard_of(WHITE, (PieceType)piece);
@@ -478,12 +963,12 @@ namespace crazyrabbit
             while (squares)
             {
                 s = pop_lsb(&squares);
-                input_rep[start_index + s] = 1.0f;
+                spatial[start_index + s] = 1.0f;
             }
             start_index += 64;
         }
 
-        // black (6 layers)
+        // black (6 planes)
         for (int piece = PAWN; piece <= KING; piece++)
         {
             Bitboard squares = p.bitboard_of(BLACK, (PieceType)piece);
@@ -491,43 +976,12 @@ namespace crazyrabbit
             while (squares)
             {
                 s = pop_lsb(&squares);
-                input_rep[start_index + s] = 1.0f;
-            }
-            start_index += 64;
-        }
-
-        // how often the board position has occured (2 layers)
-        float reps = static_cast<float>(p.repetitions[p.fen_board()]) / REPETITIONS_NORM;
-        for (int i = 0; i < 128; i++)
-        {
-            input_rep[start_index + i] = reps;
-        }
-        start_index += 128;
-
-        // pocket counts (10 layers)
-        // white (5 layers)
-        for (int piece = PAWN; piece <= QUEEN; piece++)
-        {
-            float count = static_cast<float>(p.pocket_count(WHITE, (PieceType)piece)) / POCKET_COUNT_NORM;
-            for (int i = 0; i < 64; i++)
-            {
-                input_rep[start_index + i] = count;
-            }
-            start_index += 64;
-        }
-
-        // black (5 layers)
-        for (int piece = PAWN; piece <= QUEEN; piece++)
-        {
-            float count = static_cast<float>(p.pocket_count(BLACK, (PieceType)piece)) / POCKET_COUNT_NORM;
-            for (int i = 0; i < 64; i++)
-            {
-                input_rep[start_index + i] = count;
+                spatial[start_index + s] = 1.0f;
             }
             start_index += 64;
         }
 
-        // promoted pieces (pawns) (2 layers)
+        // promoted pieces (pawns) (2 planes)
         Bitboard promoted_pawns = p.promoted;
         int black_start_index = start_index + 64;
         while (promoted_pawns)
@@ -536,69 +990,50 @@ namespace crazyrabbit
             Color piece = color_of(p.at((Square)square));
             if (piece == WHITE)
             {
-                input_rep[start_index + square] = 1.0f;
+                spatial[start_index + square] = 1.0f;
             } else
             {
-                input_rep[black_start_index + square] = 1.0f;
+                spatial[black_start_index + square] = 1.0f;
             }
         }
         start_index = black_start_index + 64;
 
-        // en-passant square (1 layer)
+        // en-passant square (1 plane)
         int en_pass = p.en_passant();
         if (en_pass != NO_SQUARE)
-            input_rep[start_index + en_pass] = 1.0f;
-        start_index += 64;
+            spatial[start_index + en_pass] = 1.0f;
 
-        // color (1 layer)
-        if (p.turn() == WHITE)
+        // how often the board position has occured (2 scalars)
+        float reps = static_cast<float>(p.repetition_count()) / REPETITIONS_NORM;
+        scalars[0] = reps;
+        scalars[1] = reps;
+
+        // pocket counts (10 scalars)
+        for (int piece = PAWN; piece <= QUEEN; piece++)
         {
-            for (int i = 0; i < 64; i++)
-                input_rep[start_index + i] = 1.0f;
+            scalars[2 + piece] = static_cast<float>(p.pocket_count(WHITE, (PieceType)piece)) / POCKET_COUNT_NORM;
+            scalars[7 + piece] = static_cast<float>(p.pocket_count(BLACK, (PieceType)piece)) / POCKET_COUNT_NORM;
         }
-        start_index += 64;
 
-        // total move count (1 layer)
-        float total_moves = static_cast<float>(p.fullmove_number()) / REPETITIONS_NORM;
-        for (int i = 0; i < 64; i++)
-            input_rep[start_index + i] = total_moves;
-        start_index += 64;
+        // color (1 scalar)
+        if (p.turn() == WHITE)
+            scalars[12] = 1.0f;
+
+        // total move count (1 scalar)
+        scalars[13] = static_cast<float>(p.fullmove_number()) / REPETITIONS_NORM;
 
-        // castling rights (4 layers)
-        // white (2 layers)
+        // castling rights (4 scalars)
         if (p.has_kingside_castling_rights(WHITE))
-        {
-            for (int i = 0; i < 64; i++)
-                input_rep[start_index + i] = 1.0f;
-        }
-        start_index += 64;
+            scalars[14] = 1.0f;
         if (p.has_queenside_castling_rights(WHITE))
-        {
-            for (int i = 0; i < 64; i++)
-                input_rep[start_index + i] = 1.0f;
-        }
-        start_index += 64;
-
-        // black (2 layers)
+            scalars[15] = 1.0f;
         if (p.has_kingside_castling_rights(BLACK))
-        {
-            for (int i = 0; i < 64; i++)
-                input_rep[start_index + i] = 1.0f;
-        }
-        start_index += 64;
+            scalars[16] = 1.0f;
         if (p.has_queenside_castling_rights(BLACK))
-        {
-            for (int i = 0; i < 64; i++)
-                input_rep[start_index + i] = 1.0f;
-        }
-        start_index += 64;
-
-        // no-progress count (halfmove count) (1 layer)
-        float half_moves = static_cast<float>(p.halfmove_clock()) / HALFMOVES_NORM;
-        for (int i = 0; i < 64; i++)
-            input_rep[start_index + i] = half_moves;
+            scalars[17] = 1.0f;
 
-        return cppflow::tensor(input_rep, { 1, 34, 64 });
+        // no-progress count (halfmove count) (1 scalar)
+        scalars[18] = static_cast<float>(p.halfmove_clock()) / HALFMOVES_NORM;
     }
 
     //Returns the given move represented in the SAN notation.
@@ -609,11 +1044,11 @@ namespace crazyrabbit
         if (flag == OO)
         {
             os << "O-O";
-            return os.str();
+            return os.str() + check_suffix(move);
         } else if (flag == OOO)
         {
             os << "O-O-O";
-            return os.str();
+            return os.str() + check_suffix(move);
         } else if (flag >= DROP_PAWN && flag <= DROP_QUEEN)
         {
             // encode drop
@@ -638,13 +1073,15 @@ namespace crazyrabbit
                 os << "Unknown drop";
                 break;
             }
-            return os.str();
+            return os.str() + check_suffix(move);
         }
 
+        //Only other pieces of the same type that can move to the same square make the move ambiguous.
+        PieceType piece = type_of(p.at(move.from()));
         bool multiple = false, same_rank = false, same_file = false;
         for (const Move& legal_m : legal_moves())
         {
-            if (legal_m.from() != legal_m.to() && legal_m.to() == move.to() && legal_m.from() != move.from())
+            if (legal_m.flags() < DROP_PAWN && legal_m.to() == move.to() && legal_m.from() != move.from() && type_of(p.at(legal_m.from())) == piece)
             {
                 if (rank_of(legal_m.from()) == rank_of(move.from()))
                     same_rank = true;
@@ -654,8 +1091,6 @@ namespace crazyrabbit
             }
         }
 
-        PieceType piece = type_of(p.at(move.from()));
-
         switch (flag)
         {
         case CAPTURE:
@@ -737,7 +1172,19 @@ namespace crazyrabbit
             os << SQSTR[move.to()];
             break;
         }
-        return os.str();
+        return os.str() + check_suffix(move);
+    }
+
+    //Returns the SAN suffix of the given move, "+" if it gives check and "#" if it mates.
+    inline std::string Board::check_suffix(Move& move)
+    {
+        if (!gives_check(move))
+            return "";
+
+        push(move);
+        bool mate = legal_moves().empty();
+        pop(move);
+        return mate ? "#" : "+";
     }
 
     //Returns true, if the given move results in a check.
@@ -795,16 +1242,108 @@ namespace crazyrabbit
         return fork;
     }
 
-    //Returns an evaluation of the given dropping move, used for the Dropping moves policy enhancement.
-    inline double Board::eval_drop(Move& move)
+    //Returns the check and discovered check data of the current position, used by the fast gives_check and gives_fork.
+    inline CheckInfo Board::check_info()
     {
-        Square w_king = bsf(p.bitboard_of(WHITE_KING));
-        Square b_king = bsf(p.bitboard_of(BLACK_KING));
-        //Bitboard w_all = p.all_pieces<WHITE>();
-        //Bitboard b_all = p.all_pieces<BLACK>();
-        double factor = 0.0;
+        CheckInfo ci;
+        ci.us = p.turn();
+        Color them = ~ci.us;
+        ci.their_king = bsf(p.bitboard_of(them, KING));
+        ci.occupied = p.all_pieces<WHITE>() | p.all_pieces<BLACK>();
+        ci.their_pieces = (them == WHITE) ? p.all_pieces<WHITE>() : p.all_pieces<BLACK>();
+        Bitboard our_pieces = ci.occupied & ~ci.their_pieces;
+
+        ci.check_squares[PAWN] = (ci.us == WHITE) ? pawn_attacks<BLACK>(ci.their_king) : pawn_attacks<WHITE>(ci.their_king);
+        ci.check_squares[KNIGHT] = attacks<KNIGHT>(ci.their_king, ci.occupied);
+        ci.check_squares[BISHOP] = attacks<BISHOP>(ci.their_king, ci.occupied);
+        ci.check_squares[ROOK] = attacks<ROOK>(ci.their_king, ci.occupied);
+        ci.check_squares[QUEEN] = ci.check_squares[BISHOP] | ci.check_squares[ROOK];
+        ci.check_squares[KING] = 0ULL;
+
+        Bitboard diagonal = (ci.us == WHITE) ? p.diagonal_sliders<WHITE>() : p.diagonal_sliders<BLACK>();
+        Bitboard orthogonal = (ci.us == WHITE) ? p.orthogonal_sliders<WHITE>() : p.orthogonal_sliders<BLACK>();
+        Bitboard snipers = (attacks<BISHOP>(ci.their_king, 0ULL) & diagonal) | (attacks<ROOK>(ci.their_king, 0ULL) & orthogonal);
+        while (snipers)
+        {
+            Bitboard blockers = SQUARES_BETWEEN_BB[ci.their_king][pop_lsb(&snipers)] & ci.occupied;
+            if (sparse_pop_count(blockers) == 1)
+                ci.discoverers |= blockers & our_pieces;
+        }
+
+        return ci;
+    }
 
-        // all drops should defend own king
+    //Returns the piece type that stands on the destination square after the given move.
+    inline PieceType moved_piece_type(Position& p, Move& move)
+    {
+        MoveFlags flags = move.flags();
+        if (flags >= DROP_PAWN && flags <= DROP_QUEEN)
+            return static_cast<PieceType>(PAWN + (flags - DROP_PAWN));
+        if (flags >= PR_KNIGHT && flags <= PR_QUEEN)
+            return static_cast<PieceType>(KNIGHT + (flags - PR_KNIGHT));
+        if (flags >= PC_KNIGHT && flags <= PC_QUEEN)
+            return static_cast<PieceType>(KNIGHT + (flags - PC_KNIGHT));
+        return type_of(p.at(move.from()));
+    }
+
+    //Returns true, if the given move results in a check. Only castling and en passant are played on the board.
+    inline bool Board::gives_check(Move& move, const CheckInfo& ci)
+    {
+        MoveFlags flags = move.flags();
+        if (flags == OO || flags == OOO || flags == EN_PASSANT)
+            return gives_check(move);
+
+        PieceType pt = moved_piece_type(p, move);
+        bool drop = flags >= DROP_PAWN && flags <= DROP_QUEEN;
+
+        // direct check
+        if (flags >= PR_KNIGHT && flags <= PC_QUEEN)
+        {
+            // the promoting pawn may have been blocking the line to the king
+            Bitboard occ = (ci.occupied & ~SQUARE_BB[move.from()]) | SQUARE_BB[move.to()];
+            if (attacks(pt, move.to(), occ) & SQUARE_BB[ci.their_king])
+                return true;
+        }
+        else if (ci.check_squares[pt] & SQUARE_BB[move.to()])
+        {
+            return true;
+        }
+
+        // discovered check
+        return !drop && (ci.discoverers & SQUARE_BB[move.from()]) && !(LINE[move.from()][ci.their_king] & SQUARE_BB[move.to()]);
+    }
+
+    //Returns true, if the given move results in a fork. Only castling and en passant are played on the board.
+    inline bool Board::gives_fork(Move& move, const CheckInfo& ci)
+    {
+        MoveFlags flags = move.flags();
+        if (flags == OO || flags == OOO || flags == EN_PASSANT)
+            return gives_fork(move);
+
+        PieceType pt = moved_piece_type(p, move);
+        bool drop = flags >= DROP_PAWN && flags <= DROP_QUEEN;
+
+        Bitboard occ = ci.occupied | SQUARE_BB[move.to()];
+        if (!drop)
+            occ &= ~SQUARE_BB[move.from()];
+
+        Bitboard b = attacks(pt, move.to(), occ) & ci.their_pieces & ~SQUARE_BB[move.to()];
+        return pop_count(b) >= 2;
+    }
+
+    //Returns a move that checkmates the opponent, or an empty move if there is none.
+    inline Move Board::mate_in_one() { return (p.turn() == WHITE) ? p.mate_in_one<WHITE>() : p.mate_in_one<BLACK>(); }
+
+    //Returns an evaluation of the given dropping move, used for the Dropping moves policy enhancement.
+    inline double Board::eval_drop(Move& move)
+    {
+        Square w_king = bsf(p.bitboard_of(WHITE_KING));
+        Square b_king = bsf(p.bitboard_of(BLACK_KING));
+        //Bitboard w_all = p.all_pieces<WHITE>();
+        //Bitboard b_all = p.all_pieces<BLACK>();
+        double factor = 0.0;
+
+        // all drops should defend own king
         if (p.turn() == WHITE && attacks<KING>(w_king, 0ULL) & SQUARE_BB[move.to()])
             factor += drop_king_def_bonus;
         else if (p.turn() == BLACK && attacks<KING>(b_king, 0ULL) & SQUARE_BB[move.to()])
@@ -857,18 +1396,496 @@ namespace crazyrabbit
 
     inline void Board::calc_hash()
     {
-        /*
-        const int p = 31;
-        const int m = 1e9 + 9;
-        this->hash = 0LL;
-        long long p_pow = 1LL;
-        for (char c : this->p.fen())
+        this->hash = p.full_hash();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////
+    //////////////////////////// OPENINGS CLASS MEMBERS //////////////////////////////
+    //////////////////////////////////////////////////////////////////////////////////
+
+    //Maps the file at the given path into memory. Returns false if it cannot be opened or is empty.
+    inline bool MappedFile::open(const char* path)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
         {
-            this->hash = (this->hash + (c - 'a' + 1) * p_pow) % m;
-            p_pow = (p_pow * p) % m;
+            close();
+            return false;
         }
-        */
-        this->hash = p.fen();
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        view = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if (!view)
+        {
+            close();
+            return false;
+        }
+        length = static_cast<size_t>(file_size.QuadPart);
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void* mapped = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+
+        view = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(file_stat.st_size);
+#endif
+        return true;
+    }
+
+    //Unmaps the file.
+    inline void MappedFile::close()
+    {
+#ifdef _WIN32
+        if (view)
+            UnmapViewOfFile(view);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (view)
+            munmap(const_cast<char*>(view), length);
+#endif
+        view = nullptr;
+        length = 0;
+    }
+
+    //Opens the default opening book. Without a valid binary book, the book in the old text format is read, if there is one.
+    inline void Openings::init()
+    {
+        init(OPENINGS_PATH);
+        if (!num_entries)
+            init_text(OPENINGS_TEXT_PATH);
+    }
+
+    //Opens the opening book at the given path. A missing or invalid book leaves the book empty.
+    inline void Openings::init(const char* path)
+    {
+        entries = nullptr;
+        num_entries = 0;
+        text_entries.clear();
+
+        if (!file.open(path))
+            return;
+
+        if (file.size() < sizeof(BookHeader))
+        {
+            file.close();
+            return;
+        }
+
+        const BookHeader* header = reinterpret_cast<const BookHeader*>(file.data());
+        if (!std::equal(header->magic, header->magic + 4, book_magic) || header->version != book_version
+            || header->num_entries > (file.size() - sizeof(BookHeader)) / sizeof(BookEntry))
+        {
+            file.close();
+            return;
+        }
+
+        entries = reinterpret_cast<const BookEntry*>(file.data() + sizeof(BookHeader));
+        num_entries = static_cast<size_t>(header->num_entries);
+    }
+
+    //Reads the opening book in the old text format at the given path. A missing book leaves the book empty.
+    inline void Openings::init_text(const char* path)
+    {
+        file.close();
+        entries = nullptr;
+        num_entries = 0;
+        text_entries.clear();
+
+        std::ifstream in(path);
+        if (!in.is_open())
+            return;
+
+        long errors = 0;
+        read_text(in, text_entries, errors);
+        std::sort(text_entries.begin(), text_entries.end(), [](const BookEntry& a, const BookEntry& b) { return a.key < b.key; });
+
+        entries = text_entries.data();
+        num_entries = text_entries.size();
+    }
+
+    //Reads a book in the old text format, one position per line, given as a FEN, followed by a semicolon and a comma separated list of
+    //moves in UCI notation. Every legal move is added with a weight of 1, the others are counted as errors. Returns the number of positions read.
+    inline long Openings::read_text(std::istream& in, std::vector<BookEntry>& book, long& errors)
+    {
+        Board board;
+        std::string line;
+        long positions = 0;
+
+        while (std::getline(in, line))
+        {
+            size_t split_point = line.find(';');
+            if (split_point == std::string::npos)
+                continue;
+
+            board.set_fen(line.substr(0, split_point));
+            move_vector<Move> legal_moves = board.legal_moves();
+
+            std::string moves = line.substr(split_point + 1);
+            size_t begin = 0;
+            while (begin < moves.size())
+            {
+                size_t end = moves.find(',', begin);
+                if (end == std::string::npos)
+                    end = moves.size();
+
+                uint16_t code = Move(moves.substr(begin, end - begin)).hash();
+                if (std::any_of(legal_moves.begin(), legal_moves.end(), [code](Move& move) { return move.hash() == code; }))
+                    book.push_back(BookEntry{ board.p.full_hash(), 1U, code, 0 });
+                else
+                    errors++;
+
+                begin = end + 1;
+            }
+
+            positions++;
+        }
+
+        return positions;
+    }
+
+    //Returns a book move for the given position, chosen at random with the probability proportional to its weight.
+    //If the position is not in the book, an empty move is returned.
+    inline Move Openings::get_move(Board& board)
+    {
+        if (!num_entries)
+            return Move();
+
+        const uint64_t key = board.p.full_hash();
+        const BookEntry* first = std::lower_bound(entries, entries + num_entries, key, [](const BookEntry& entry, const uint64_t key) { return entry.key < key; });
+
+        const BookEntry* last = first;
+        uint64_t total_weight = 0ULL;
+        while (last != entries + num_entries && last->key == key)
+            total_weight += (last++)->weight;
+
+        if (!total_weight)
+            return Move();
+
+        uint64_t choice = std::uniform_int_distribution<uint64_t>(0ULL, total_weight - 1ULL)(rng);
+        for (const BookEntry* entry = first; entry != last; entry++)
+        {
+            if (choice < entry->weight)
+            {
+                //The book stores only the encoded move, so it is matched against the legal moves.
+                for (Move& move : board.legal_moves())
+                {
+                    if (move.hash() == entry->move)
+                        return move;
+                }
+                return Move();
+            }
+            choice -= entry->weight;
+        }
+
+        return Move();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////// PERFT CLASS MEMBERS ///////////////////////////////
+    //////////////////////////////////////////////////////////////////////////////////
+
+    //Allocates the largest power of two number of entries that fits into the given number of MB. Zero disables the table.
+    inline void Perft::set_hash_size(const size_t megabytes)
+    {
+        size_t entries = 0;
+        if (megabytes > 0)
+        {
+            entries = 1;
+            while (entries * 2 * sizeof(Entry) <= (megabytes << 20))
+                entries *= 2;
+        }
+
+        table = std::vector<Entry>(entries);
+    }
+
+    //Returns the number of leaves of the legal move tree of the given depth.
+    inline uint64_t Perft::count(Position& p, const int depth)
+    {
+        if (depth <= 0)
+            return 1ULL;
+
+        //Every ply generates its moves behind the ones of its parent.
+        std::vector<Move> stack(static_cast<size_t>(depth) * MAX_MOVES);
+        return (p.turn() == WHITE) ? count_impl<WHITE>(p, depth, stack.data()) : count_impl<BLACK>(p, depth, stack.data());
+    }
+
+    //Returns the number of leaves under every legal move of the position. The moves are shared out between the threads,
+    //each playing them on its own copy of the position, while the table is shared by all of them.
+    inline std::vector<std::pair<Move, uint64_t>> Perft::divide(Position& p, const int depth, const int threads)
+    {
+        Move list[MAX_MOVES];
+        Move* last = (p.turn() == WHITE) ? p.generate_legals<WHITE>(list) : p.generate_legals<BLACK>(list);
+
+        std::vector<std::pair<Move, uint64_t>> counts;
+        for (Move* move = list; move != last; ++move)
+            counts.emplace_back(*move, 0ULL);
+
+        std::atomic<size_t> next = 0;
+        auto work = [&]()
+        {
+            Position position = p;
+            for (size_t i = next++; i < counts.size(); i = next++)
+            {
+                Move& move = counts[i].first;
+                if (position.turn() == WHITE)
+                {
+                    position.play<WHITE, false>(move);
+                    counts[i].second = count(position, depth - 1);
+                    position.undo<WHITE, false>(move);
+                } else
+                {
+                    position.play<BLACK, false>(move);
+                    counts[i].second = count(position, depth - 1);
+                    position.undo<BLACK, false>(move);
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < std::min(threads, static_cast<int>(counts.size())); t++)
+            workers.emplace_back(work);
+        work();
+
+        for (std::thread& worker : workers)
+            worker.join();
+
+        return counts;
+    }
+
+    template <Color Us>
+    inline uint64_t Perft::count_impl(Position& p, const int depth, Move* list)
+    {
+        if (depth == 0)
+            return 1ULL;
+
+        //The leaves one ply deeper are the legal moves, so they do not need to be played.
+        if (bulk && depth == 1)
+            return static_cast<uint64_t>(p.generate_legals<Us>(list) - list);
+
+        const bool hashed = !table.empty() && depth > 1;
+        uint64_t key = 0ULL;
+        uint64_t nodes = 0ULL;
+        if (hashed)
+        {
+            key = p.full_hash();
+            if (probe(key, depth, nodes))
+                return nodes;
+        }
+
+        Move* last = p.generate_legals<Us>(list);
+        for (Move* move = list; move != last; ++move)
+        {
+            p.play<Us, false>(*move);
+            nodes += count_impl<~Us>(p, depth - 1, last);
+            p.undo<Us, false>(*move);
+        }
+
+        if (hashed)
+            store(key, depth, nodes);
+        return nodes;
+    }
+
+    //Looks up the number of leaves of the position at the given depth.
+    inline bool Perft::probe(const uint64_t key, const int depth, uint64_t& nodes)
+    {
+        Entry& entry = table[key & (table.size() - 1)];
+        uint64_t data = entry.data.load(std::memory_order_relaxed);
+        if ((entry.key.load(std::memory_order_relaxed) ^ data) != key || static_cast<int>(data & 0xFF) != depth)
+            return false;
+
+        nodes = data >> 8;
+        return true;
+    }
+
+    //Stores the number of leaves of the position at the given depth, always replacing the previous entry.
+    inline void Perft::store(const uint64_t key, const int depth, const uint64_t nodes)
+    {
+        Entry& entry = table[key & (table.size() - 1)];
+        uint64_t data = (nodes << 8) | static_cast<uint64_t>(depth & 0xFF);
+        entry.key.store(key ^ data, std::memory_order_relaxed);
+        entry.data.store(data, std::memory_order_relaxed);
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////// WATCHDOG CLASS MEMBERS /////////////////////////////
+    //////////////////////////////////////////////////////////////////////////////////
+
+    //Starts waiting for the given number of milliseconds. The function is called on the watchdog thread.
+    inline void Watchdog::arm(const long long milliseconds, std::function<void()> on_expire)
+    {
+        disarm();
+
+        armed = true;
+        thread = std::thread([this, milliseconds, on_expire]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!condition.wait_for(lock, std::chrono::milliseconds(milliseconds), [this]() { return !armed; }))
+            {
+                lock.unlock();
+                on_expire();
+            }
+        });
+    }
+
+    //Stops waiting and waits for the function to finish, if it was already called.
+    inline void Watchdog::disarm()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            armed = false;
+        }
+        condition.notify_all();
+
+        if (thread.joinable())
+            thread.join();
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////
+    /////////////////////////// TIME MANAGER CLASS MEMBERS ///////////////////////////
+    //////////////////////////////////////////////////////////////////////////////////
+
+    //Sets the remaining time and increment in milliseconds and the number of moves until the next time control (0 if there is none).
+    inline void TimeManager::set_clock(const long long time, const long long inc, const int to_go)
+    {
+        remaining_time = time;
+        increment = inc;
+        moves_to_go = to_go;
+    }
+
+    //Forgets the clock and the statistics of the previous game.
+    inline void TimeManager::reset()
+    {
+        remaining_time = -1LL;
+        increment = 0LL;
+        moves_to_go = 0;
+        nps = 0.0;
+        saved_time = 0LL;
+    }
+
+    //Plans the time for the move at the given ply and starts measuring it.
+    inline void TimeManager::start(const int ply)
+    {
+        start_time = std::chrono::steady_clock::now();
+        best_move = Move();
+        best_move_change = 0LL;
+        has_budget_q = false;
+
+        //The time is planned for fewer moves as the game goes on, unless the number of moves until the next time control is known.
+        double moves_left = (moves_to_go > 0) ? static_cast<double>(moves_to_go) : std::max(static_cast<double>(min_moves_left), static_cast<double>(moves_per_game) - moves_left_per_ply * static_cast<double>(ply));
+
+        //A single move never uses more than a fraction of the remaining time, unless it is the last move before the time control.
+        //The search itself stops a margin before that, so that the watchdog only has to step in when something takes too long.
+        deadline = std::max(static_cast<long long>(static_cast<double>(remaining_time) * std::max(max_time_fraction, 1.0 / moves_left)) - move_overhead, 0LL);
+        long long limit = std::max(deadline - deadline_margin, 0LL);
+
+        optimum_time = std::min(static_cast<long long>(static_cast<double>(remaining_time) / moves_left + static_cast<double>(increment) * increment_amount), limit);
+        maximum_time = std::min(static_cast<long long>(static_cast<double>(optimum_time) * max_time_factor + static_cast<double>(saved_time) * saved_time_share), limit);
+        budget = optimum_time;
+    }
+
+    //Returns the time spent on the current move in milliseconds.
+    inline long long TimeManager::elapsed() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    //Returns true, if the search of the given root moves should stop after the given number of simulations.
+    //Stops early when the best move cannot be overtaken anymore and extends the budget when the best move is still unclear.
+    inline bool TimeManager::should_stop(move_vector<Move>& moves, const long simulations)
+    {
+        CRAZYRABBIT_ZONE(TimeCheck);
+        long long time = elapsed();
+        if (time >= maximum_time || moves.size() < 2)
+            return true;
+
+        //Find the two most visited moves.
+        Move* best = &moves[0];
+        Move* second = &moves[1];
+        if (second->n_visits > best->n_visits)
+            std::swap(best, second);
+
+        for (size_t i = 2; i < moves.size(); i++)
+        {
+            if (moves[i].n_visits > best->n_visits)
+            {
+                second = best;
+                best = &moves[i];
+            } else if (moves[i].n_visits > second->n_visits)
+            {
+                second = &moves[i];
+            }
+        }
+
+        if (*best != best_move)
+        {
+            best_move = *best;
+            best_move_change = time;
+        }
+
+        if (time >= budget)
+        {
+            //The move is critical, if the best move changed recently or its value is dropping. Spend some of the saved time on it.
+            bool unstable = time - best_move_change < static_cast<long long>(static_cast<double>(budget) * best_move_change_window);
+            bool dropping = has_budget_q && budget_q - best->Q_value > q_drop_thresh;
+            if ((unstable || dropping) && budget < maximum_time)
+            {
+                budget_q = best->Q_value;
+                has_budget_q = true;
+                budget = std::min(budget + static_cast<long long>(static_cast<double>(optimum_time) * time_extension), maximum_time);
+                return false;
+            }
+            return true;
+        }
+
+        //Remember the value of the best move halfway through the budget to see if it drops.
+        if (!has_budget_q && 2LL * time >= budget)
+        {
+            budget_q = best->Q_value;
+            has_budget_q = true;
+        }
+
+        //Estimate how many simulations are left in the budget. The rate of the current move is only trusted after a while.
+        double rate = (time >= nps_min_time || nps == 0.0) ? static_cast<double>(simulations) * 1000.0 / static_cast<double>(std::max(time, 1LL)) : nps;
+        double simulations_left = rate * static_cast<double>(budget - time) / 1000.0;
+
+        return static_cast<double>(best->n_visits - second->n_visits) > simulations_left;
+    }
+
+    //Updates the measured simulation rate and the saved time after the search for a move is done.
+    inline void TimeManager::finish(const long simulations)
+    {
+        long long time = elapsed();
+        if (time >= nps_min_time)
+        {
+            double rate = static_cast<double>(simulations) * 1000.0 / static_cast<double>(time);
+            nps = (nps == 0.0) ? rate : (1.0 - nps_smoothing) * nps + nps_smoothing * rate;
+        }
+
+        //The saved time is already part of the remaining time, so only as much is kept as one move could use.
+        saved_time = std::clamp(saved_time + optimum_time - time, 0LL, maximum_time);
     }
 
     //////////////////////////////////////////////////////////////////////////////////
@@ -892,26 +1909,24 @@ namespace crazyrabbit
         if (!initialized)
         {
             openings.init();
-            nnet.model = nnet_model;
+            nnet.init(nnet_model);
             initialized = true;
         }
     }
 
-    //Initializes the time control system.
-    inline void MCTS::init_time(const int available_time, const int increment)
+    //Passes the state of the clock to the time control system. Called before every move.
+    inline void MCTS::init_time(const int available_time, const int increment, const int moves_to_go)
     {
-        time_per_move = static_cast<long long>(available_time / moves_per_game) + static_cast<long long>(increment * increment_amount);
-        original_time = time_per_move;
+        time_manager.set_clock(available_time, increment, moves_to_go);
+        move_deadline = -1LL;
     }
 
-    //Updates the time control system.
-    inline void MCTS::update_time(const int remaining_time)
+    //Sets a fixed time in milliseconds for the next move.
+    inline void MCTS::init_move_time(const long long move_time)
     {
-        if (!time_saving_mode && executed_moves >= move_thresh)
-            time_saving_mode = true;
-
-        if (time_saving_mode)
-            time_per_move = static_cast<long long>(static_cast<double>(remaining_time) * time_proportion);
+        time_manager.set_clock(-1LL, 0LL, 0);
+        move_deadline = std::max(move_time - move_overhead, 0LL);
+        time_per_move = std::max(move_deadline - deadline_margin, 0LL);
     }
 
     //Switches the MCTS modification configuration. Called when entering/leaving the time saving mode.
@@ -939,6 +1954,22 @@ namespace crazyrabbit
         */
     }
 
+    //Sets the evaluation backend and the latency of the synthetic backend. Once the network is initialized, a changed backend is
+    //built right away and the tree is cleared, because its values come from the old backend.
+    inline void MCTS::set_nnet_backend(const NNetBackendType backend_type, const long long latency)
+    {
+        bool changed = (backend_type != nnet.backend_type) || (backend_type == NNetBackendType::Synthetic && latency != nnet.latency);
+        nnet.backend_type = backend_type;
+        nnet.latency = latency;
+
+        if (initialized && changed)
+        {
+            nnet.init();
+            move_data.clear();
+            tree_bytes = 0;
+        }
+    }
+
     //Sets the which modifications need to be used when searching.
     inline void MCTS::set_config(const ModMask conf)
     {
@@ -981,14 +2012,13 @@ namespace crazyrabbit
         switch (expansion_type)
         {
         case NodeExpansionStrat::Exploration:
-            expansion_strat = &move_to_expand_inc;
-            break;
         case NodeExpansionStrat::Default:
-            expansion_strat = &move_to_expand_default;
+            expansion_strat = expansion_type;
             break;
         default:
             throw std::runtime_error("MCTS ERROR: NodeExpansionStrategy is of unknown type.");
         }
+        select_search_kernel();
     }
 
     //Sets the backpropagation function to use.
@@ -997,14 +2027,13 @@ namespace crazyrabbit
         switch (backprop_type)
         {
         case BackpropStrat::SMA:
-            backprop_strat = &backprop_sma;
-            break;
         case BackpropStrat::Default:
-            backprop_strat = &backprop_nvisits_qvalue;
+            backprop_strat = backprop_type;
             break;
         default:
             throw std::runtime_error("MCTS ERROR: BackpropStrategy is of unknown type.");
         }
+        select_search_kernel();
     }
 
     //Adds a given policy enhancement modification to the configuration.
@@ -1013,38 +2042,69 @@ namespace crazyrabbit
         switch (policy_type)
         {
         case PolicyEnhancementStrat::Dirichlet:
-            policy_strats.push_back(&enhance_policy_dirichlet);
+            dirichlet_strat = true;
             break;
         case PolicyEnhancementStrat::CheckingMoves:
-            policy_strats.push_back(&enhance_policy_checking_moves);
+            policy_strats |= checking_moves_mask;
             break;
         case PolicyEnhancementStrat::ForkingMoves:
-            policy_strats.push_back(&enhance_policy_forking_moves);
+            policy_strats |= forking_moves_mask;
             break;
         case PolicyEnhancementStrat::DroppingMoves:
-            policy_strats.push_back(&enhance_policy_dropping_moves);
+            policy_strats |= dropping_moves_mask;
             break;
         case PolicyEnhancementStrat::CapturingMoves:
-            policy_strats.push_back(&enhance_policy_capturing_moves);
+            policy_strats |= capturing_moves_mask;
             break;
         default:
             throw std::runtime_error("MCTS ERROR: PolicyEnhancementStrategy is of unknown type.");
         }
+        select_search_kernel();
+    }
+
+    //Removes all policy enhancement strategies.
+    inline void MCTS::remove_policy_enhancement_strategies()
+    {
+        policy_strats = 0U;
+        dirichlet_strat = false;
+        select_search_kernel();
     }
 
-    //Removes all function pointers to policy enhancement strategies.
-    inline void MCTS::remove_policy_enhancement_strategies() { policy_strats.clear(); }
+    //Builds the table of selection kernels, one for each combination of strategies.
+    template <size_t... I>
+    constexpr auto MCTS::make_select_kernels(std::index_sequence<I...>)
+    {
+        constexpr size_t num_policies = all_policy_masks + 1;
+        return std::array<SelectKernel, sizeof...(I)>{ &MCTS::select_impl<
+            static_cast<NodeExpansionStrat>(I / (2 * num_policies)),
+            static_cast<PolicyMask>((I / 2) % num_policies),
+            (I % 2) == 1>... };
+    }
+
+    //Selects the search kernels that match the current strategies. Called whenever a strategy changes.
+    inline void MCTS::select_search_kernel()
+    {
+        constexpr size_t num_policies = all_policy_masks + 1;
+        constexpr size_t num_kernels = static_cast<size_t>(NodeExpansionStrat::NUM) * num_policies * 2;
+        static constexpr auto kernels = make_select_kernels(std::make_index_sequence<num_kernels>());
+
+        size_t index = (static_cast<size_t>(expansion_strat) * num_policies + (policy_strats & all_policy_masks)) * 2 + (dirichlet_strat ? 1 : 0);
+        select_kernel = kernels[index];
+        backup_kernel = (backprop_strat == BackpropStrat::SMA) ? &MCTS::backup_impl<BackpropStrat::SMA> : &MCTS::backup_impl<BackpropStrat::Default>;
+    }
 
     //Resets and gets ready for a new game.
     inline void MCTS::reset()
     {
         move_data.clear();
+        tree_bytes = 0;
+        simulation = 0L;
 
         player = NO_COLOR;
         time_per_move = -1LL;
-        original_time = -1LL;
-        time_saving_mode = false;
         time_simulating = 0LL;
+        time_manager.reset();
+        move_deadline = -1LL;
         executed_moves = 0;
         explored_nodes = 0;
         best_move_cp = 0;
@@ -1052,15 +2112,80 @@ namespace crazyrabbit
     }
 
     //Returns the best move in the given board position.
+    //A watchdog answers with the fallback move if the search is still running when the hard deadline passes.
     inline Move MCTS::best_move(Board& board)
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        cancelled = false;
+
+        //Any legal move is better than losing on time.
+        move_vector<Move> moves = board.legal_moves();
+        set_fallback(moves.size() ? moves.front() : Move());
+
+        //With a running clock, the time manager plans the time of the move, including the preprocessing.
+        long long deadline = -1LL;
+        if (time_control && time_manager.active())
+        {
+            time_manager.start(board.p.game_ply_number());
+            deadline = time_manager.deadline;
+        } else if (time_control)
+        {
+            deadline = move_deadline;
+        }
+
+        if (deadline >= 0LL)
+        {
+            watchdog.arm(deadline, [this]()
+            {
+                cancelled = true;
+                if (on_deadline)
+                    on_deadline(fallback_move());
+            });
+        }
+
+        Move move = find_best_move(board);
+        watchdog.disarm();
+
+        if (deadline >= 0LL)
+        {
+            long long used = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+            long long overshoot = std::max(used - (time_manager.active() ? time_manager.budget : time_per_move), 0LL);
+
+            deadline_moves++;
+            total_overshoot += overshoot;
+            max_overshoot = std::max(max_overshoot, overshoot);
+            if (cancelled)
+                deadline_misses++;
+        }
+
+        return move;
+    }
+
+    //Returns the move to play if the search does not finish in time.
+    inline Move MCTS::fallback_move()
+    {
+        std::lock_guard<std::mutex> lock(fallback_mutex);
+        return fallback;
+    }
+
+    //Replaces the move to play if the search does not finish in time.
+    inline void MCTS::set_fallback(const Move& move)
+    {
+        std::lock_guard<std::mutex> lock(fallback_mutex);
+        fallback = move;
+    }
+
+    //Searches for the best move within the planned time.
+    inline Move MCTS::find_best_move(Board& board)
     {
         long long sim_time = time_per_move;
         std::chrono::steady_clock::time_point begin_preproc = std::chrono::steady_clock::now();
+        bool managed_time = time_control && time_manager.active();
 
         //Use an opening move if available.
         if (use_openings)
         {
-            Move opening_move = openings.get_move(board.hash);
+            Move opening_move = openings.get_move(board);
             if (opening_move.from() != NO_SQUARE)
                 return opening_move;
         }
@@ -1073,27 +2198,70 @@ namespace crazyrabbit
                 return best_move;
         }
 
+        if (cancelled)
+            return fallback_move();
+
         std::chrono::steady_clock::time_point end_preproc = std::chrono::steady_clock::now();
         sim_time -= std::chrono::duration_cast<std::chrono::milliseconds>(end_preproc - begin_preproc).count();
 
         //Perform simulations.
         explored_nodes = 0;
-        if (time_control)
+        eval.pawn_cache.reset_stats();
+        if (managed_time)
         {
-            while (sim_time > 0LL)
+            std::chrono::steady_clock::time_point begin_sim = std::chrono::steady_clock::now();
+            while (true)
             {
-                std::chrono::steady_clock::time_point begin_sim = std::chrono::steady_clock::now();
                 search(board);
+                move_vector<Move>& moves = move_data[node_key(board)];
                 if (explored_nodes == 0)
                 {
                     //If only one move is available, choose it.
-                    move_vector<Move>& moves = move_data[board.hash];
                     if (moves.size() == 1)
                         return moves.front();
                 }
-                std::chrono::steady_clock::time_point end_sim = std::chrono::steady_clock::now();
-                sim_time -= std::chrono::duration_cast<std::chrono::milliseconds>(end_sim - begin_sim).count();
                 explored_nodes++;
+
+                if (stop_simulating)
+                {
+                    stop_simulating = false;
+                    break;
+                }
+
+                if (explored_nodes == 1 || explored_nodes % fallback_interval == 0)
+                    set_fallback((*best_move_strat)(moves));
+
+                if (cancelled || time_manager.should_stop(moves, explored_nodes))
+                    break;
+            }
+            std::chrono::steady_clock::time_point end_sim = std::chrono::steady_clock::now();
+
+            time_simulating = std::chrono::duration_cast<std::chrono::milliseconds>(end_sim - begin_sim).count();
+            time_manager.finish(explored_nodes);
+        } else if (time_control)
+        {
+            //The time is measured from the start of the simulations, so that rounding does not add up over many short simulations.
+            std::chrono::steady_clock::time_point begin_sim = std::chrono::steady_clock::now();
+            long long sim_budget = sim_time;
+            while (sim_time > 0LL && !cancelled)
+            {
+                search(board);
+                move_vector<Move>& moves = move_data[node_key(board)];
+                if (explored_nodes == 0)
+                {
+                    //If only one move is available, choose it.
+                    if (moves.size() == 1)
+                        return moves.front();
+                }
+                {
+                    CRAZYRABBIT_ZONE(TimeCheck);
+                    std::chrono::steady_clock::time_point end_sim = std::chrono::steady_clock::now();
+                    sim_time = sim_budget - std::chrono::duration_cast<std::chrono::milliseconds>(end_sim - begin_sim).count();
+                }
+                explored_nodes++;
+
+                if (explored_nodes == 1 || explored_nodes % fallback_interval == 0)
+                    set_fallback((*best_move_strat)(moves));
                    
                 if (stop_simulating)
                 {
@@ -1111,7 +2279,7 @@ namespace crazyrabbit
                 if (explored_nodes == 0)
                 {
                     //If only one move is available, choose it.
-                    move_vector<Move>& moves = move_data[board.hash];
+                    move_vector<Move>& moves = move_data[node_key(board)];
                     if (moves.size() == 1)
                         return moves.front();
                 }
@@ -1125,24 +2293,171 @@ namespace crazyrabbit
             }
         }
 
+        //Without a single simulation the root has no statistics, so the fallback move is played.
+        if (explored_nodes == 0)
+            return fallback_move();
+
         executed_moves++;
 
         //Choose best move.
-        Move& best_move = (*best_move_strat)(move_data[board.hash]);
+        Move& best_move = (*best_move_strat)(move_data[node_key(board)]);
         best_move_cp = eval.q_to_cp(best_move.Q_value);
         return best_move;
     }
 
-    //Performs a simulation/rollout.
+    //Returns the key of the board's node in the move data, the zobrist hash of the position. Positions that occurred before get the
+    //repetition count mixed in, so that nodes which can end in a repetition draw are not shared with ones that cannot and the
+    //moves of a repetition do not lead back to the same node.
+    inline uint64_t MCTS::node_key(Board& board)
+    {
+        int repetitions = board.p.repetition_count();
+        return (repetitions > 0) ? mix_hash(board.hash ^ static_cast<uint64_t>(repetitions)) : board.hash;
+    }
+
+    //Performs a simulation and prunes the tree if it grew over the memory budget.
     inline void MCTS::search(Board board)
     {
-        std::vector<std::pair<move_vector<Move>&, Move&>> state_stack;
-        double v = 0.0;
+        CRAZYRABBIT_ZONE(Simulation);
+        SearchPath path;
+        if (select_leaf(board, path))
+        {
+            //Predict policy and value with nnet.
+            std::pair<std::vector<float>, float> prediction;
+            {
+                CRAZYRABBIT_ZONE(NNet);
+                prediction = nnet.predict(*path.board);
+            }
+
+            expand_leaf(path, prediction);
+        }
+
+        backup(board, path);
+    }
+
+    //Starts a simulation from the given position and descends to a leaf. Returns true if the leaf was added to the tree and needs to be evaluated
+    //with expand_leaf() before the simulation is backed up. Otherwise the simulation ended in a terminal node or at a transposition and its value is known.
+    inline bool MCTS::select_leaf(Board board, SearchPath& path)
+    {
+        CRAZYRABBIT_ZONE(Select);
+        simulation++;
+        return (this->*select_kernel)(board, path);
+    }
+
+    //Stores the policy and value predicted for the leaf of the simulation.
+    inline void MCTS::expand_leaf(SearchPath& path, std::pair<std::vector<float>, float>& prediction)
+    {
+        CRAZYRABBIT_ZONE(Expand);
+        auto& [policy, value] = prediction;
+        move_vector<Move>& moves = *path.leaf;
+
+        if (eval.eval_types)
+        {
+            CRAZYRABBIT_ZONE(ValueCorrection);
+            value = static_cast<float>(1.0 - eval_fac) * value + static_cast<float>(eval_fac * eval.eval(*path.board));
+        }
+
+        //Normalize and store policy of moves.
+        double sum_policy = 0.0;
+        for (Move& move : moves)
+        {
+            double p = static_cast<double>(policy[move.hash()]);
+            sum_policy += p;
+            move.policy = p;
+        }
+
+        for (Move& move : moves)
+            move.policy /= sum_policy;
+
+        moves.Q_value = static_cast<double>(value);
+        moves.value_visits = 1L;
+
+        path.v = static_cast<double>(-value);
+        path.child = &moves;
+        path.leaf = nullptr;
+        path.board.reset();
+    }
+
+    //Backpropagates the value of the simulation to the given root position and prunes the tree if it grew over the memory budget.
+    inline void MCTS::backup(Board& root, SearchPath& path)
+    {
+        {
+            CRAZYRABBIT_ZONE(Backprop);
+            (this->*backup_kernel)(path);
+        }
+
+        if (tree_bytes > max_tree_bytes)
+            prune_tree(root);
+    }
+
+    //Returns the estimated memory used by a node of the tree.
+    inline size_t MCTS::node_bytes(const move_vector<Move>& moves)
+    {
+        //Map entry with its bucket, the moves, the drop groups if the node has them and, with graph search, the shared children.
+        size_t bytes = sizeof(MD_t::value_type) + sizeof(void*) + 1 + moves.capacity() * sizeof(Move)
+            + moves.drop_groups.capacity() * sizeof(Move) + moves.drop_group_end.capacity() * sizeof(size_t);
+        if (graph_search)
+            bytes += moves.size() * sizeof(move_vector<Move>*);
+        return bytes;
+    }
+
+    //Evicts the least recently visited nodes, the ones with fewer visits first, until the tree fits into the pruning target.
+    //Nodes on the chosen line from the given root position are never evicted. Evicted nodes are expanded again when reached.
+    inline void MCTS::prune_tree(Board board)
+    {
+        //Follow the most visited moves from the root.
+        std::vector<const move_vector<Move>*> chosen_line;
+        while (true)
+        {
+            auto node = move_data.find(node_key(board));
+            if (node == move_data.end() || node->second.empty() || std::find(chosen_line.begin(), chosen_line.end(), &node->second) != chosen_line.end())
+                break;
+
+            chosen_line.push_back(&node->second);
+
+            Move& best = best_move_nvisits(node->second);
+            if (!best.n_visits)
+                break;
+            board.push(best);
+        }
+
+        std::vector<std::tuple<long, long, uint64_t>> candidates;
+        candidates.reserve(move_data.size());
+        for (const auto& [key, moves] : move_data)
+        {
+            if (std::find(chosen_line.begin(), chosen_line.end(), &moves) == chosen_line.end())
+                candidates.emplace_back(moves.last_visit, moves.n_visits, key);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        const size_t target_bytes = static_cast<size_t>(static_cast<double>(max_tree_bytes) * prune_target);
+        for (const auto& [last_visit, n_visits, key] : candidates)
+        {
+            if (tree_bytes <= target_bytes)
+                break;
+
+            auto node = move_data.find(key);
+            tree_bytes -= std::min(tree_bytes, node_bytes(node->second));
+            move_data.erase(node);
+        }
+
+        //Links to shared children may point to evicted nodes. They are restored when the children are reached again.
+        if (graph_search)
+        {
+            for (auto& [key, moves] : move_data)
+                std::fill(moves.children.begin(), moves.children.end(), nullptr);
+        }
+    }
+
+    //Descends from the given position to a leaf or terminal node, remembering the chosen moves in the path.
+    template <NodeExpansionStrat Expansion, PolicyMask Policy, bool Dirichlet>
+    inline bool MCTS::select_impl(Board& board, SearchPath& path)
+    {
+        auto& state_stack = path.stack;
 
         //Find a leaf or terminal node.
         while (true)
         {
-            std::string state = board.hash;
+            uint64_t state = node_key(board);
 
             if (!move_data.contains(state))
             {
@@ -1154,90 +2469,146 @@ namespace crazyrabbit
                     //Draws are not desired, but still worth if no better option exists.
                     if (es > 0.0 && es < 0.5)
                     {
-                        v = -es;
-                        break;
+                        path.v = -es;
+                        return false;
                     }
                     else if (es > 0.0)
                     {
                         stop_simulating = true;
                     }
 
-                    v = 1.0;
-                    break;
+                    path.v = 1.0;
+                    return false;
                 }
 
-                //Leaf node.
-                move_data[state] = board.legal_moves(filter_moves, player);
+                //Leaf node. It is evaluated before the simulation is backed up.
+                {
+                    CRAZYRABBIT_ZONE(Movegen);
+                    move_data[state] = board.legal_moves(filter_moves, player, &cancelled);
+                }
                 move_vector<Move>& moves = move_data[state];
+                moves.shrink_to_fit();
                 moves.end_score = es;
+                moves.last_visit = simulation;
+                tree_bytes += node_bytes(moves);
+
+                path.leaf = &moves;
+                path.board.emplace(std::move(board));
+                return true;
+            }
+
+            //Node was already visited. Choose move to expand.
+            move_vector<Move>& moves = move_data[state];
+            moves.last_visit = simulation;
+
+            if (graph_search && !state_stack.empty())
+            {
+                auto& [parent, edge] = state_stack.back();
+                parent->children[edge - parent->data()] = &moves;
 
-                //Predict policy and value with nnet.
-                std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-                auto [policy, value] = nnet.predict(board);
-                std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-                nnet_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-                if (eval.eval_types)
-                    value = static_cast<float>(1.0 - eval_fac) * value + static_cast<float>(eval_fac * eval.eval(board));
-
-                //Normalize and store policy of moves.
-                double sum_policy = 0.0;
-                for (Move& move : moves)
+                //The node was reached through other parents since this edge was last visited. Back up its value instead of searching deeper.
+                double target = -moves.Q_value;
+                if (moves.value_visits > edge->n_visits && (!edge->n_visits || std::abs(edge->Q_value - target) > transposition_q_delta))
                 {
-                    double p = static_cast<double>(policy[move.hash()]);
-                    sum_policy += p;
-                    move.policy = p;
+                    path.v = target;
+                    path.child = &moves;
+                    return false;
                 }
+            }
 
-                for (Move& move : moves)
-                    move.policy /= sum_policy;
+            //Enhance policy with additional strategies. Deferred until the second visit, since the priors are not needed before.
+            if (!moves.policy_enhanced)
+            {
+                if constexpr (Dirichlet || Policy != 0U)
+                {
+                    CRAZYRABBIT_ZONE(PolicyEnhancement);
+                    if constexpr (Dirichlet)
+                        enhance_policy_dirichlet(board, moves);
+                    if constexpr (Policy != 0U)
+                        enhance_policy<Policy>(board, moves);
+                }
 
-                //Enhance policy with additional strategies.
-                int pe_count = 0;
-                for (auto policy_strat : policy_strats)
+                //Order children by prior for progressive widening and hierarchical drop selection. The drop groups are allocated
+                //here, so they are added to the size of the tree.
+                if (progressive_widening || hierarchical_drops)
                 {
-                    if (pe_count > 0)
-                    {
-                        begin = std::chrono::steady_clock::now();
-                        (*policy_strat)(board, moves);
-                        end = std::chrono::steady_clock::now();
-                        pe_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-                    }
-                    else
-                    {
-                        (*policy_strat)(board, moves);
-                    }
-                    ++pe_count;
+                    size_t bytes = node_bytes(moves);
+                    order_children(moves, hierarchical_drops);
+                    tree_bytes += node_bytes(moves) - bytes;
                 }
 
-                v = static_cast<double>(-value);
-                break;
+                moves.policy_enhanced = true;
+            }
+
+            if (graph_search)
+            {
+                //Read up-to-date values of shared child nodes.
+                if (moves.children.size() != moves.size())
+                    moves.children.assign(moves.size(), nullptr);
+
+                for (size_t index = 0; index < moves.size(); index++)
+                {
+                    const move_vector<Move>* shared = moves.children[index];
+                    if (shared && shared->value_visits > moves[index].n_visits)
+                        moves[index].Q_value = -shared->Q_value;
+                }
             }
 
-            //Node was already visited. Choose move to expand.
-            move_vector<Move>& moves = move_data[state];
-            Move& move = (moves.size() == 1) ? moves.front() : (*expansion_strat)(moves);
+            Move& move = (moves.size() == 1) ? moves.front() : move_to_expand_widened<Expansion>(moves, progressive_widening);
 
             //Remember move choice in current state for backpropagation.
-            state_stack.push_back(std::pair<move_vector<Move>&, Move&>(moves, move));
+            state_stack.emplace_back(&moves, &move);
 
             //Expand move and descend into the next state.
             board.push(move);
         }
+    }
 
-        //Search is done. Now backpropagate and update Q values back to the root.
-        while (state_stack.size() > 0)
+    //Backpropagates the value of the simulation and updates Q values back to the root.
+    template <BackpropStrat Backprop>
+    inline void MCTS::backup_impl(SearchPath& path)
+    {
+        double v = path.v;
+        move_vector<Move>* child = path.child;
+
+        while (path.stack.size() > 0)
         {
-            auto [moves, move] = state_stack.back();
-            if (move.n_visits)
-                move.Q_value = (*backprop_strat)(move, v);
+            auto [moves, move] = path.stack.back();
+
+            //The child was also reached through other parents. Correct the backed up value, so that the edge agrees with the child's value.
+            if (graph_search && child && child->value_visits > move->n_visits)
+            {
+                double target = -child->Q_value;
+                v = std::clamp(static_cast<double>(move->n_visits) * (target - move->Q_value) + target, -1.0, 1.0);
+            }
+
+            if (moves->grouped_drops && move->flags() >= DROP_PAWN && move->flags() <= DROP_QUEEN)
+            {
+                Move& group = moves->drop_groups[move->flags() - DROP_PAWN];
+                if (group.n_visits)
+                    group.Q_value = (Backprop == BackpropStrat::SMA) ? backprop_sma(group, v) : backprop_nvisits_qvalue(group, v);
+                else
+                    group.Q_value = v;
+                group.n_visits++;
+            }
+
+            if (move->n_visits)
+                move->Q_value = (Backprop == BackpropStrat::SMA) ? backprop_sma(*move, v) : backprop_nvisits_qvalue(*move, v);
             else
-                move.Q_value = v;
+                move->Q_value = v;
+
+            move->n_visits++;
+            moves->n_visits++;
 
-            move.n_visits++;
-            moves.n_visits++;
+            if (graph_search)
+            {
+                moves->Q_value = (static_cast<double>(moves->value_visits) * moves->Q_value + v) / (static_cast<double>(moves->value_visits) + 1.0);
+                moves->value_visits++;
+                child = moves;
+            }
 
             v = -v;
-            state_stack.pop_back();
+            path.stack.pop_back();
         }
     }
 
@@ -1271,7 +2642,7 @@ namespace crazyrabbit
 
         executed_moves++;
 
-        return move_data[board.hash];
+        return move_data[node_key(board)];
     }
 
     //////////////////////////////////////////////////////////////////////////////////
@@ -1297,74 +2668,38 @@ namespace crazyrabbit
     inline void Evaluator::update_tables(Board& board)
     {
         // clear tables
-        long* PWB = (long*)WT;
-        long* PBB = (long*)BT;
-
-        PWB[0] = PWB[1] = PWB[2] = PWB[3] = PWB[4] = PWB[5] = PWB[6] = PWB[7] = PWB[8] = PWB[9] = PWB[10] = PWB[11] = PWB[12] = PWB[13] = PWB[14] = PWB[15]
-            = PWB[16] = PWB[17] = PWB[18] = PWB[19] = PWB[20] = PWB[21] = PWB[22] = PWB[23] = PWB[24] = PWB[25] = PWB[26] = PWB[27] = PWB[28] = PWB[29] = PWB[30] = PWB[31] = 0;
-        PBB[0] = PBB[1] = PBB[2] = PBB[3] = PBB[4] = PBB[5] = PBB[6] = PBB[7] = PBB[8] = PBB[9] = PBB[10] = PBB[11] = PBB[12] = PBB[13] = PBB[14] = PBB[15]
-            = PBB[16] = PBB[17] = PBB[18] = PBB[19] = PBB[20] = PBB[21] = PBB[22] = PBB[23] = PBB[24] = PBB[25] = PBB[26] = PBB[27] = PBB[28] = PBB[29] = PBB[30] = PBB[31] = 0;
+        WT.clear();
+        BT.clear();
 
         // recompute info about attacks and drops for each piece
         Bitboard all = board.p.all_pieces<WHITE>() | board.p.all_pieces<BLACK>();
         Bitboard empty = ~all;
-        Bitboard attack_squares, piece_squares;
+        Bitboard piece_squares;
+
+        // pawns attack in bulk, each diagonal shift covers any square at most once
+        WT.add(PAWN, shift<NORTH_WEST>(board.p.bitboard_of(WHITE_PAWN)));
+        WT.add(PAWN, shift<NORTH_EAST>(board.p.bitboard_of(WHITE_PAWN)));
+        BT.add(PAWN, shift<SOUTH_WEST>(board.p.bitboard_of(BLACK_PAWN)));
+        BT.add(PAWN, shift<SOUTH_EAST>(board.p.bitboard_of(BLACK_PAWN)));
 
-        for (int piece = 0; piece < NPIECE_TYPES; piece++)
+        for (size_t piece = KNIGHT; piece < NPIECE_TYPES; piece++)
         {
-            // first attacks ...
             // white side
             piece_squares = board.p.bitboard_of(make_piece(WHITE, static_cast<PieceType>(piece)));
             while (piece_squares)
-            {
-                Square piece_s = pop_lsb(&piece_squares);
-                attack_squares = (piece == PAWN) ? pawn_attacks<WHITE>(piece_s) : attacks(static_cast<PieceType>(piece), piece_s, all);
-
-                while (attack_squares)
-                {
-                    Square attack_s = pop_lsb(&attack_squares);
-                    add_attack_info(WT[attack_s], static_cast<PieceType>(piece));
-                }
-            }
+                WT.add(static_cast<PieceType>(piece), attacks(static_cast<PieceType>(piece), pop_lsb(&piece_squares), all));
 
             // black side
             piece_squares = board.p.bitboard_of(make_piece(BLACK, static_cast<PieceType>(piece)));
             while (piece_squares)
-            {
-                Square piece_s = pop_lsb(&piece_squares);
-                attack_squares = (piece == PAWN) ? pawn_attacks<BLACK>(piece_s) : attacks(static_cast<PieceType>(piece), piece_s, all);
-
-                while (attack_squares)
-                {
-                    Square attack_s = pop_lsb(&attack_squares);
-                    add_attack_info(BT[attack_s], static_cast<PieceType>(piece));
-                }
-            }
-
-            // ... then drops
-            // white side
-            int pocket_c = board.p.pocket_count(WHITE, static_cast<PieceType>(piece));
-            if (pocket_c)
-            {
-                while (empty)
-                {
-                    Square drop_s = pop_lsb(&empty);
-                    add_drop_info(WT[drop_s], static_cast<PieceType>(piece));
-                }
-            }
-            empty = ~all;
+                BT.add(static_cast<PieceType>(piece), attacks(static_cast<PieceType>(piece), pop_lsb(&piece_squares), all));
+        }
 
-            // black side
-            pocket_c = board.p.pocket_count(BLACK, static_cast<PieceType>(piece));
-            if (pocket_c)
-            {
-                while (empty)
-                {
-                    Square drop_s = pop_lsb(&empty);
-                    add_drop_info(BT[drop_s], static_cast<PieceType>(piece));
-                }
-            }
-            empty = ~all;
+        // drops are possible on every empty square for every piece in the pocket
+        for (int piece = PAWN; piece <= QUEEN; piece++)
+        {
+            WT.drops[piece] = (board.p.pocket_count(WHITE, static_cast<PieceType>(piece))) ? empty : 0ULL;
+            BT.drops[piece] = (board.p.pocket_count(BLACK, static_cast<PieceType>(piece))) ? empty : 0ULL;
         }
     }
 
@@ -1373,28 +2708,8 @@ namespace crazyrabbit
     {
         double eval = 0.0;
 
-        // eval pieces on board ...
-        eval += material_value[PAWN] * (static_cast<double>(pop_count(board.p.bitboard_of(WHITE_PAWN)))
-            - static_cast<double>(pop_count(board.p.bitboard_of(BLACK_PAWN))))
-            + material_value[KNIGHT] * (static_cast<double>(pop_count(board.p.bitboard_of(WHITE_KNIGHT)))
-                - static_cast<double>(pop_count(board.p.bitboard_of(BLACK_KNIGHT))))
-            + material_value[BISHOP] * (static_cast<double>(pop_count(board.p.bitboard_of(WHITE_BISHOP)))
-                - static_cast<double>(pop_count(board.p.bitboard_of(BLACK_BISHOP))))
-            + material_value[ROOK] * (static_cast<double>(pop_count(board.p.bitboard_of(WHITE_ROOK)))
-                - static_cast<double>(pop_count(board.p.bitboard_of(BLACK_ROOK))))
-            + material_value[QUEEN] * (static_cast<double>(pop_count(board.p.bitboard_of(WHITE_QUEEN)))
-                - static_cast<double>(pop_count(board.p.bitboard_of(BLACK_QUEEN))));
-        // ... and in the pocket
-        eval += material_value_hand[PAWN] * (static_cast<double>(board.p.pocket_count(WHITE, PAWN))
-            - static_cast<double>(board.p.pocket_count(BLACK, PAWN)))
-            + material_value_hand[KNIGHT] * (static_cast<double>(board.p.pocket_count(WHITE, KNIGHT))
-                - static_cast<double>(board.p.pocket_count(BLACK, KNIGHT)))
-            + material_value_hand[BISHOP] * (static_cast<double>(board.p.pocket_count(WHITE, BISHOP))
-                - static_cast<double>(board.p.pocket_count(BLACK, BISHOP)))
-            + material_value_hand[ROOK] * (static_cast<double>(board.p.pocket_count(WHITE, ROOK))
-                - static_cast<double>(board.p.pocket_count(BLACK, ROOK)))
-            + material_value_hand[QUEEN] * (static_cast<double>(board.p.pocket_count(WHITE, QUEEN))
-                - static_cast<double>(board.p.pocket_count(BLACK, QUEEN)));
+        // pieces on board and in the pocket, accumulated incrementally by the position
+        eval += static_cast<double>(board.p.material()) / incremental_eval_scale;
 
         // add bonuses
 
@@ -1427,6 +2742,13 @@ namespace crazyrabbit
 
     //Returns the Centipawn score computed using pawn structure.
     inline double Evaluator::pawn_structure(Board& board)
+    {
+        double eval = probe_pawn_cache(board).pawn_structure;
+        return (board.p.turn() == WHITE) ? eval : -eval;
+    }
+
+    //Returns the pawn structure score from white's perspective. Depends only on the pawns.
+    inline double Evaluator::calc_pawn_structure(Board& board)
     {
         double eval = 0.0;
 
@@ -1480,7 +2802,7 @@ namespace crazyrabbit
                 // we have a passed pawn, which is ...
                 int rank = rank_of(pawn_s) - 1;
                 double s_diff;
-                if (can_attack(WT[pawn_s], PAWN) && can_attack(WT[pawn_s + NORTH], PAWN))
+                if (WT.can_attack(pawn_s, PAWN) && WT.can_attack(pawn_s + NORTH, PAWN))
                 {
                     // ... supported
                     s_diff = (passed_pawn_hi_supp[rank] - passed_pawn_lo_supp[rank]) / 8.0;
@@ -1520,7 +2842,7 @@ namespace crazyrabbit
                 // we have a passed pawn, which is ...
                 int rank = relative_rank<BLACK>(rank_of(pawn_s)) - 1;
                 double s_diff;
-                if (can_attack(BT[pawn_s], PAWN) && can_attack(BT[pawn_s + SOUTH], PAWN))
+                if (BT.can_attack(pawn_s, PAWN) && BT.can_attack(pawn_s + SOUTH, PAWN))
                 {
                     // ... supported
                     s_diff = (passed_pawn_hi_supp[rank] - passed_pawn_lo_supp[rank]) / 8.0;
@@ -1585,11 +2907,11 @@ namespace crazyrabbit
             eval -= isolated_pawn_pen[supporting_pawns][is_stopped][half_open_file];
         }
 
-        return (board.p.turn() == WHITE) ? eval : -eval;
+        return eval;
     }
 
-    //Returns the Centipawn score computed using king safety.
-    inline double Evaluator::king_safety(Board& board)
+    //Returns the king location and pawn shelter score from white's perspective. Depends only on the pawns and kings.
+    inline double Evaluator::calc_king_shelter(Board& board)
     {
         double eval = 0.0;
 
@@ -1682,6 +3004,40 @@ namespace crazyrabbit
             eval += king_struct_vuln[s_w][s_b];
         }
 
+        return eval;
+    }
+
+    //Returns the cached pawn structure and king shelter scores of the given position, computing them on a miss.
+    inline PawnCache::Entry& Evaluator::probe_pawn_cache(Board& board)
+    {
+        uint64_t key = board.p.get_pawn_hash();
+        PawnCache::Entry& entry = pawn_cache.entry(key);
+
+        pawn_cache.probes++;
+        if (entry.key == key && entry.filled)
+        {
+            pawn_cache.hits++;
+            return entry;
+        }
+
+        entry.key = key;
+        entry.filled = true;
+        entry.pawn_structure = calc_pawn_structure(board);
+        entry.king_shelter = calc_king_shelter(board);
+        return entry;
+    }
+
+    //Returns the Centipawn score computed using king safety.
+    inline double Evaluator::king_safety(Board& board)
+    {
+        double eval = 0.0;
+
+        Square w_king = bsf(board.p.bitboard_of(WHITE_KING));
+        Square b_king = bsf(board.p.bitboard_of(BLACK_KING));
+
+        // king location and pawn shelter
+        eval += probe_pawn_cache(board).king_shelter;
+
         // king region attacks
         // - inspect the 8 squares around the king
         //      - penalty for empty squares
@@ -1699,20 +3055,20 @@ namespace crazyrabbit
         {
             s_d = pop_lsb(&defense);
 
-            int num_attacks = fmax(0, attacks_num(BT[s_d]) - attacks_num(WT[s_d]));
+            int num_attacks = fmax(0, BT.attacks_num(s_d) - WT.attacks_num(s_d));
             if (num_attacks)
             {
                 double attack_pen = 0.0;
                 for (int piece = PAWN; piece < KING; piece++)
                 {
-                    if (can_attack(BT[s_d], static_cast<PieceType>(piece)))
+                    if (BT.can_attack(s_d, static_cast<PieceType>(piece)))
                         attack_pen += material_value[piece];
                 }
                 eval -= num_attacks * attack_pen;
             }
         }
 
-        if (BT[w_king])
+        if (BT.attacked() & board.p.bitboard_of(WHITE_KING))
             eval -= check_pen;
 
         // black side
@@ -1725,20 +3081,20 @@ namespace crazyrabbit
         {
             s_d = pop_lsb(&defense);
 
-            int num_attacks = fmax(0, attacks_num(WT[s_d]) - attacks_num(BT[s_d]));
+            int num_attacks = fmax(0, WT.attacks_num(s_d) - BT.attacks_num(s_d));
             if (num_attacks)
             {
                 double attack_pen = 0.0;
                 for (int piece = PAWN; piece < KING; piece++)
                 {
-                    if (can_attack(WT[s_d], static_cast<PieceType>(piece)))
+                    if (WT.can_attack(s_d, static_cast<PieceType>(piece)))
                         attack_pen += material_value[piece];
                 }
                 eval += num_attacks * attack_pen;
             }
         }
 
-        if (WT[b_king])
+        if (WT.attacked() & board.p.bitboard_of(BLACK_KING))
             eval += check_pen;
 
         // castling rights
@@ -1777,37 +3133,24 @@ namespace crazyrabbit
         int w_king_zone = king_zone_w[bsf(board.p.bitboard_of(WHITE_KING))];
         int b_king_zone = king_zone_b[bsf(board.p.bitboard_of(BLACK_KING))];
 
-        // pawn
-        // 1. square score
-
-        // white side
-        pieces = board.p.bitboard_of(WHITE_PAWN);
-        while (pieces)
-        {
-            sq = pop_lsb(&pieces);
-            eval += pawn_square_score_w[sq];
-        }
+        // strong squares are on the enemy side and out of reach of enemy pawns
+        Bitboard strong_w = black_side & ~BT.by_type[PAWN];
+        Bitboard strong_b = white_side & ~WT.by_type[PAWN];
 
-        // black side
-        pieces = board.p.bitboard_of(BLACK_PAWN);
-        while (pieces)
-        {
-            sq = pop_lsb(&pieces);
-            eval -= pawn_square_score_b[sq];
-        }
+        // square scores of all pieces, accumulated incrementally by the position
+        eval += static_cast<double>(board.p.piece_square()) / incremental_eval_scale;
 
         // knight
-        // 1. square score
-        // 2. king distance score
-        // 3. bonus if on strong square, with higher bonus is the strong square is in the center
+        // 1. king distance score
+        // 2. bonus if on strong square, with higher bonus is the strong square is in the center
 
         // white side
         pieces = board.p.bitboard_of(WHITE_KNIGHT);
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval += knight_square_score_w[sq] + knight_distance_bonus[diamond_distance_b[b_king_zone][sq]];
-            eval += (SQUARE_BB[sq] & black_side && !can_attack(BT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval += knight_distance_bonus[diamond_distance_b[b_king_zone][sq]];
+            eval += (SQUARE_BB[sq] & strong_w) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
         }
 
         // black side
@@ -1815,15 +3158,14 @@ namespace crazyrabbit
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval -= knight_square_score_b[sq] + knight_distance_bonus[diamond_distance_w[w_king_zone][sq]];
-            eval -= (SQUARE_BB[sq] & white_side && !can_attack(WT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval -= knight_distance_bonus[diamond_distance_w[w_king_zone][sq]];
+            eval -= (SQUARE_BB[sq] & strong_b) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
         }
 
         // bishop
-        // 1. square score
-        // 2. penalty for being on the same diagonal as friendly blocked pawn
-        // 3. bonus for being on the same diagonal as a weak enemy pawn
-        // 4. same bonus for strong squares as knight
+        // 1. penalty for being on the same diagonal as friendly blocked pawn
+        // 2. bonus for being on the same diagonal as a weak enemy pawn
+        // 3. same bonus for strong squares as knight
 
         Bitboard attacked, friendly, enemy;
 
@@ -1832,8 +3174,7 @@ namespace crazyrabbit
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval += bishop_square_score_w[sq];
-            eval += (SQUARE_BB[sq] & black_side && !can_attack(BT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval += (SQUARE_BB[sq] & strong_w) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
 
             attacked = attacks<BISHOP>(sq, board.p.all_pieces<WHITE>() | board.p.all_pieces<BLACK>());
             friendly = attacked & board.p.bitboard_of(WHITE_PAWN);
@@ -1849,7 +3190,7 @@ namespace crazyrabbit
             while (enemy)
             {
                 sq = pop_lsb(&enemy);
-                if (attacks_num(BT[sq]) == 0)
+                if (!(BT.attacked() & SQUARE_BB[sq]))
                     eval += bishop_diag_bonus;
             }
         }
@@ -1859,8 +3200,7 @@ namespace crazyrabbit
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval -= bishop_square_score_b[sq];
-            eval -= (SQUARE_BB[sq] & white_side && !can_attack(WT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval -= (SQUARE_BB[sq] & strong_b) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
 
             attacked = attacks<BISHOP>(sq, board.p.all_pieces<WHITE>() | board.p.all_pieces<BLACK>());
             friendly = attacked & board.p.bitboard_of(BLACK_PAWN);
@@ -1876,25 +3216,24 @@ namespace crazyrabbit
             while (enemy)
             {
                 sq = pop_lsb(&enemy);
-                if (attacks_num(WT[sq]) == 0)
+                if (!(WT.attacked() & SQUARE_BB[sq]))
                     eval -= bishop_diag_bonus;
             }
         }
 
         // rook
-        // 1. square score
-        // 2. bonus for open or half-open files
-        // 3. bonus for files with weak enemy pawns
-        // 4. king distance score
-        // 5. bonus for strong squares, same as for knights
+        // 1. bonus for open or half-open files
+        // 2. bonus for files with weak enemy pawns
+        // 3. king distance score
+        // 4. bonus for strong squares, same as for knights
 
         // white side
         pieces = board.p.bitboard_of(WHITE_ROOK);
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval += rook_square_score_w[sq] + rook_distance_bonus[cross_distance_b[b_king_zone][sq]];
-            eval += (SQUARE_BB[sq] & black_side && !can_attack(BT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval += rook_distance_bonus[cross_distance_b[b_king_zone][sq]];
+            eval += (SQUARE_BB[sq] & strong_w) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
 
             enemy = MASK_FILE[file_of(sq)] & board.p.bitboard_of(BLACK_PAWN);
             friendly = MASK_FILE[file_of(sq)] & board.p.bitboard_of(WHITE_PAWN);
@@ -1902,13 +3241,13 @@ namespace crazyrabbit
             if (enemy && friendly)
             {
                 // closed file + check if enemy pawn is weak
-                if (attacks_num(BT[bsf(enemy)]) == 0)
+                if (!(BT.attacked() & SQUARE_BB[bsf(enemy)]))
                     eval += rook_weak_pawn_bonus;
             } else if (enemy)
             {
                 // half-open file + check if enemy pawn is weak
                 eval += rook_half_file_bonus;
-                if (attacks_num(BT[bsf(enemy)]) == 0)
+                if (!(BT.attacked() & SQUARE_BB[bsf(enemy)]))
                     eval += rook_weak_pawn_bonus;
             } else if (friendly)
             {
@@ -1926,8 +3265,8 @@ namespace crazyrabbit
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval -= rook_square_score_b[sq] + rook_distance_bonus[cross_distance_w[w_king_zone][sq]];
-            eval -= (SQUARE_BB[sq] & white_side && !can_attack(WT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval -= rook_distance_bonus[cross_distance_w[w_king_zone][sq]];
+            eval -= (SQUARE_BB[sq] & strong_b) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
 
             enemy = MASK_FILE[file_of(sq)] & board.p.bitboard_of(WHITE_PAWN);
             friendly = MASK_FILE[file_of(sq)] & board.p.bitboard_of(BLACK_PAWN);
@@ -1935,13 +3274,13 @@ namespace crazyrabbit
             if (enemy && friendly)
             {
                 // closed file + check if enemy pawn is weak
-                if (attacks_num(WT[bsf(enemy)]) == 0)
+                if (!(WT.attacked() & SQUARE_BB[bsf(enemy)]))
                     eval -= rook_weak_pawn_bonus;
             } else if (enemy)
             {
                 // half-open file + check if enemy pawn is weak
                 eval -= rook_half_file_bonus;
-                if (attacks_num(WT[bsf(enemy)]) == 0)
+                if (!(WT.attacked() & SQUARE_BB[bsf(enemy)]))
                     eval -= rook_weak_pawn_bonus;
             } else if (friendly)
             {
@@ -1955,17 +3294,16 @@ namespace crazyrabbit
         }
 
         // queen
-        // 1. square score
-        // 2. king distance score
-        // 3. strong square bonus, same as others
+        // 1. king distance score
+        // 2. strong square bonus, same as others
 
         // white side
         pieces = board.p.bitboard_of(WHITE_QUEEN);
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval += queen_square_score_w[sq] + queen_distance_bonus[diamond_distance_b[b_king_zone][sq]];
-            eval += (SQUARE_BB[sq] & black_side && !can_attack(BT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval += queen_distance_bonus[diamond_distance_b[b_king_zone][sq]];
+            eval += (SQUARE_BB[sq] & strong_w) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
         }
 
         // black side
@@ -1973,19 +3311,10 @@ namespace crazyrabbit
         while (pieces)
         {
             sq = pop_lsb(&pieces);
-            eval -= queen_square_score_b[sq] + queen_distance_bonus[diamond_distance_w[w_king_zone][sq]];
-            eval -= (SQUARE_BB[sq] & white_side && !can_attack(WT[sq], PAWN)) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
+            eval -= queen_distance_bonus[diamond_distance_w[w_king_zone][sq]];
+            eval -= (SQUARE_BB[sq] & strong_b) ? ((SQUARE_BB[sq] & center_squares) ? strong_cent_sq_bonus : strong_sq_bonus) : 0.0;
         }
 
-        // king
-        // 1. square score
-
-        // white side
-        eval += king_square_score_w[bsf(board.p.bitboard_of(WHITE_KING))];
-
-        // black side
-        eval -= king_square_score_b[bsf(board.p.bitboard_of(BLACK_KING))];
-
         return (board.p.turn() == WHITE) ? eval : -eval;
     }
 
@@ -2014,33 +3343,41 @@ namespace crazyrabbit
         }
 
         // estimate mobility by analysing the attack/move pressure each side has on the board
-        int num;
-        for (int i = 0; i < NSQUARES; i++)
-        {
-            if (num = attacks_num(WT[i]))
-                eval += static_cast<double>(num) / 100.0;
-            if (num = attacks_num(BT[i]))
-                eval -= static_cast<double>(num) / 100.0;
-        }
+        eval += static_cast<double>(WT.total - BT.total) / 100.0;
 
         return (board.p.turn() == WHITE) ? eval : -eval;
     }
 
+    //Builds the table of evaluation functions, one for each combination of features.
+    template <size_t... I>
+    constexpr auto Evaluator::make_eval_kernels(std::index_sequence<I...>)
+    {
+        return std::array<double (Evaluator::*)(Board&), sizeof...(I)>{ &Evaluator::eval_impl<static_cast<EvalMask>(I)>... };
+    }
+
     //Returns the Centipawn score computed by the configured evaluation function.
     inline double Evaluator::eval(Board& board)
+    {
+        static constexpr auto kernels = make_eval_kernels(std::make_index_sequence<all_eval_masks + 1>());
+        return (this->*kernels[eval_types & all_eval_masks])(board);
+    }
+
+    //Returns the Centipawn score computed using the given features.
+    template <EvalMask Mask>
+    inline double Evaluator::eval_impl(Board& board)
     {
         update_tables(board);
         double cp = 0.0;
 
-        if (has_eval(material_mask))
+        if constexpr (Mask & material_mask)
             cp += material(board);
-        if (has_eval(pawn_structure_mask))
+        if constexpr (Mask & pawn_structure_mask)
             cp += pawn_structure(board);
-        if (has_eval(king_safety_mask))
+        if constexpr (Mask & king_safety_mask)
             cp += king_safety(board);
-        if (has_eval(piece_placement_mask))
+        if constexpr (Mask & piece_placement_mask)
             cp += piece_placement(board);
-        if (has_eval(board_control_mask))
+        if constexpr (Mask & board_control_mask)
             cp += board_control(board);
 
         return cp_to_q(cp * 100.0);
@@ -2052,6 +3389,13 @@ namespace crazyrabbit
 
     //Strategy to choose the best move to make.
 
+    //Breaks ties between equally good moves. Seeded with the time, unless a run has to be reproducible.
+    inline std::mt19937& tie_break_rng()
+    {
+        static thread_local std::mt19937 rng(static_cast<std::mt19937::result_type>(std::chrono::system_clock::now().time_since_epoch().count()));
+        return rng;
+    }
+
     //Chooses move with the highest number of visits.
     inline Move& best_move_nvisits(move_vector<Move>& moves)
     {
@@ -2080,8 +3424,7 @@ namespace crazyrabbit
         else
         {
             // if multiple moves share same max value, pick a random move
-            srand(time(NULL));
-            int index = rand() % best_moves.size();
+            int index = static_cast<int>(tie_break_rng()() % best_moves.size());
             return moves[best_moves[index]];
         }
     }
@@ -2136,8 +3479,7 @@ namespace crazyrabbit
         } else
         {
             // if multiple moves share same max value, pick a random move
-            srand(time(NULL));
-            int index = rand() % best_moves.size();
+            int index = static_cast<int>(tie_break_rng()() % best_moves.size());
             return moves[best_moves[index]];
         }
     }
@@ -2146,69 +3488,182 @@ namespace crazyrabbit
 
     //Strategy to choose the next move to expand during a MCTS simulation.
 
-    //Chooses move according to the PUCT algorithm.
-    inline Move& move_to_expand_default(move_vector<Move>& moves)
+    //Computes U-values of the children of a node with the given number of visits.
+    template <NodeExpansionStrat Expansion>
+    class UValue
     {
-        // calculate U-values and select best move
-        int best_move = 0;
-        double best_U = -std::numeric_limits<double>::infinity();
-        double cpuct = log(static_cast<double>(moves.n_visits + cpuct_base + 1L) / static_cast<double>(cpuct_base)) + cpuct_init;
+    private:
+        double cpuct;
+        double sqrt_visits;
+        double sqrt_visits_eps = 0.0;
+        double u_divisor = 0.0;
 
-        int index = 0;
-        for (Move& move : moves)
+    public:
+        explicit UValue(const long n_visits)
+        {
+            cpuct = log(static_cast<double>(n_visits + cpuct_base + 1L) / static_cast<double>(cpuct_base)) + cpuct_init;
+            sqrt_visits = sqrt(static_cast<double>(n_visits));
+            if constexpr (Expansion == NodeExpansionStrat::Exploration)
+                u_divisor = u_min - exp(static_cast<double>(-n_visits) / static_cast<double>(u_base)) * (u_min - u_init);
+            else
+                sqrt_visits_eps = sqrt(static_cast<double>(n_visits) + EPS);
+        }
+
+        inline double operator()(const double Q_value, const double policy, const long n_visits) const
         {
-            double u;
-            if (move.n_visits)
+            if constexpr (Expansion == NodeExpansionStrat::Exploration)
             {
-                // move was already explored
-                u = move.Q_value + cpuct * move.policy * sqrt(static_cast<double>(moves.n_visits)) / (1.0 + static_cast<double>(move.n_visits));
-            } else
+                // as proposed in CrazyAra
+                return ((n_visits) ? Q_value : Q_init) + cpuct * policy * sqrt_visits / (u_divisor + static_cast<double>(n_visits));
+            }
+            else
             {
-                // move was not yet explored
-                u = Q_init + cpuct * move.policy * sqrt(static_cast<double>(moves.n_visits) + EPS);
+                // as proposed in AlphaZero
+                if (n_visits)
+                    return Q_value + cpuct * policy * sqrt_visits / (1.0 + static_cast<double>(n_visits));
+                return Q_init + cpuct * policy * sqrt_visits_eps;
             }
+        }
+    };
 
+    //Returns the index of the move in [begin, end) with the highest U-value. Priors are multiplied by policy_scale.
+    template <NodeExpansionStrat Expansion>
+    inline size_t best_child(const move_vector<Move>& moves, const size_t begin, const size_t end, const UValue<Expansion>& u_value, const double policy_scale, double& best_U)
+    {
+        size_t best_move = begin;
+        for (size_t index = begin; index < end; index++)
+        {
+            const Move& move = moves[index];
+            double u = u_value(move.Q_value, move.policy * policy_scale, move.n_visits);
             if (u > best_U)
             {
                 best_U = u;
                 best_move = index;
             }
-            index++;
         }
-        return moves[best_move];
+        return best_move;
+    }
+
+    //Chooses move according to the PUCT algorithm.
+    inline Move& move_to_expand_default(move_vector<Move>& moves)
+    {
+        double best_U = -std::numeric_limits<double>::infinity();
+        UValue<NodeExpansionStrat::Default> u_value(moves.n_visits);
+        return moves[best_child(moves, 0, moves.size(), u_value, 1.0, best_U)];
     }
 
     //Chooses move as proposed in CrazyAra. Encourages exploration. 
     inline Move& move_to_expand_inc(move_vector<Move>& moves)
     {
-        // calculate U-values and select best move
-        int best_move = 0;
         double best_U = -std::numeric_limits<double>::infinity();
-        double cpuct = log(static_cast<double>(moves.n_visits + cpuct_base + 1) / static_cast<double>(cpuct_base)) + cpuct_init;
-        double u_divisor = u_min - exp(static_cast<double>(-moves.n_visits) / static_cast<double>(u_base)) * (u_min - u_init);
+        UValue<NodeExpansionStrat::Exploration> u_value(moves.n_visits);
+        return moves[best_child(moves, 0, moves.size(), u_value, 1.0, best_U)];
+    }
 
-        int index = 0;
-        for (const Move& move : moves)
+    //Returns how many children, ordered by prior, are considered at a node with the given number of visits.
+    inline size_t widened_children(const long n_visits, const size_t num_moves)
+    {
+        size_t k = widening_min_children + static_cast<size_t>(widening_factor * sqrt(static_cast<double>(n_visits)));
+        return std::min(k, num_moves);
+    }
+
+    //Chooses move among the children ordered by order_children. With widening, only the top children by prior are considered,
+    //and their number grows with the square root of the node's visits. This changes the search and not just its speed: once every
+    //child inside the window has been visited, a hidden child is not chosen even if its U-value is higher, until the window grows
+    //to include it. Grouped drops are chosen by piece type first, then by square.
+    template <NodeExpansionStrat Expansion>
+    inline Move& move_to_expand_widened(move_vector<Move>& moves, const bool widen)
+    {
+        double best_U = -std::numeric_limits<double>::infinity();
+        UValue<Expansion> u_value(moves.n_visits);
+
+        if (!moves.grouped_drops)
         {
-            double u;
-            if (move.n_visits)
-            {
-                // move was already explored
-                u = move.Q_value + cpuct * move.policy * sqrt(static_cast<double>(moves.n_visits)) / (u_divisor + static_cast<double>(move.n_visits));
-            } else
+            size_t end = (widen) ? widened_children(moves.n_visits, moves.size()) : moves.size();
+            return moves[best_child(moves, 0, end, u_value, 1.0, best_U)];
+        }
+
+        // board moves and one aggregate node per piece type
+        size_t end = (widen) ? widened_children(moves.n_visits, moves.num_board_moves) : moves.num_board_moves;
+        size_t best_move = best_child(moves, 0, end, u_value, 1.0, best_U);
+
+        int best_group = -1;
+        size_t begin = moves.num_board_moves;
+        for (size_t type = 0; type < NDROP_TYPES; type++)
+        {
+            const Move& group = moves.drop_groups[type];
+            if (begin < moves.drop_group_end[type])
             {
-                // move was not yet explored
-                u = Q_init + cpuct * move.policy * sqrt(static_cast<double>(moves.n_visits)) / (u_divisor + static_cast<double>(move.n_visits));
+                double u = u_value(group.Q_value, group.policy, group.n_visits);
+                if (u > best_U)
+                {
+                    best_U = u;
+                    best_group = static_cast<int>(type);
+                }
             }
+            begin = moves.drop_group_end[type];
+        }
 
-            if (u > best_U)
+        if (best_group < 0)
+            return moves[best_move];
+
+        // drop squares of the chosen piece type, with priors conditioned on the group
+        const Move& group = moves.drop_groups[best_group];
+        begin = (best_group) ? moves.drop_group_end[best_group - 1] : moves.num_board_moves;
+        end = moves.drop_group_end[best_group];
+        if (widen)
+            end = begin + widened_children(group.n_visits, end - begin);
+
+        double policy_scale = (group.policy > 0.0) ? 1.0 / group.policy : 1.0;
+        best_U = -std::numeric_limits<double>::infinity();
+        return moves[best_child(moves, begin, end, UValue<Expansion>(group.n_visits), policy_scale, best_U)];
+    }
+
+    //Orders the moves of a node by descending prior. If group_drops is set, drops are placed after the board moves
+    //and grouped by piece type, each group summarized by an aggregate node.
+    inline void order_children(move_vector<Move>& moves, const bool group_drops)
+    {
+        auto drop_type = [](const Move& move) {
+            return (move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN) ? static_cast<int>(move.flags() - DROP_PAWN) : -1;
+        };
+
+        if (!group_drops)
+        {
+            std::stable_sort(moves.begin(), moves.end(), [](const Move& a, const Move& b) { return a.policy > b.policy; });
+            moves.grouped_drops = false;
+            moves.drop_groups.clear();
+            moves.drop_group_end.clear();
+            return;
+        }
+
+        std::stable_sort(moves.begin(), moves.end(), [&drop_type](const Move& a, const Move& b) {
+            int type_a = drop_type(a);
+            int type_b = drop_type(b);
+            return (type_a != type_b) ? type_a < type_b : a.policy > b.policy;
+        });
+
+        size_t index = 0;
+        while (index < moves.size() && drop_type(moves[index]) < 0)
+            index++;
+        moves.num_board_moves = index;
+        moves.drop_groups.assign(NDROP_TYPES, Move());
+        moves.drop_group_end.assign(NDROP_TYPES, 0);
+
+        for (size_t type = 0; type < NDROP_TYPES; type++)
+        {
+            Move& group = moves.drop_groups[type];
+            double sum_Q = 0.0;
+            for (; index < moves.size() && drop_type(moves[index]) == static_cast<int>(type); index++)
             {
-                best_U = u;
-                best_move = index;
+                group.policy += moves[index].policy;
+                group.n_visits += moves[index].n_visits;
+                sum_Q += moves[index].Q_value * static_cast<double>(moves[index].n_visits);
             }
-            index++;
+            if (group.n_visits)
+                group.Q_value = sum_Q / static_cast<double>(group.n_visits);
+            moves.drop_group_end[type] = index;
         }
-        return moves[best_move];
+        moves.grouped_drops = true;
     }
 
 
@@ -2253,8 +3708,10 @@ namespace crazyrabbit
             move.policy /= sum_policy;
     }
 
-    //Improves probabilities for moves that result in a check.
-    inline void enhance_policy_checking_moves(Board& board, move_vector<Move>& moves)
+    //Improves probabilities of checking, forking, dropping and capturing moves in a single pass.
+    //Every enabled enhancement boosts moves where P(s, a) < check_thresh relative to the maximum prior, and the policy is renormalized once.
+    template <PolicyMask Policy>
+    inline void enhance_policy(Board& board, move_vector<Move>& moves)
     {
         double max_policy = 0.0;
         for (const Move& move : moves)
@@ -2264,115 +3721,49 @@ namespace crazyrabbit
                 max_policy = move.policy;
         }
 
-        // enhance the probability for all checking moves where P(s, a) < check_thresh
-        bool enhanced = false;
-        double sum_policy = 0.0;
-        for (Move& move : moves)
-        {
-            if (move.policy < check_thresh && board.gives_check(move))
-            {
-                move.policy += max_policy * check_factor;
-                enhanced = true;
-            }
-            sum_policy += move.policy;
-
-        }
-
-        // renormalize if needed
-        if (enhanced)
-        {
-            for (Move& move : moves)
-                move.policy /= sum_policy;
-        }
-    }
-
-    //Improves probabilities for moves that result in a fork.
-    inline void enhance_policy_forking_moves(Board& board, move_vector<Move>& moves)
-    {
-        double max_policy = 0.0;
-        for (const Move& move : moves)
-        {
-            // find maximum policy value
-            if (move.policy > max_policy)
-                max_policy = move.policy;
-        }
+        CheckInfo ci;
+        if constexpr (Policy & (checking_moves_mask | forking_moves_mask))
+            ci = board.check_info();
 
-        // enhance the probability for all forking moves where P(s, a) < check_thresh
         bool enhanced = false;
         double sum_policy = 0.0;
         for (Move& move : moves)
         {
-            if (move.policy < check_thresh && board.gives_fork(move))
+            if (move.policy < check_thresh)
             {
-                move.policy += max_policy * check_factor;
-                enhanced = true;
-            }
-            sum_policy += move.policy;
-        }
-
-        // renormalize if needed
-        if (enhanced)
-        {
-            for (Move& move : moves)
-                move.policy /= sum_policy;
-        }
-    }
+                double factor = 0.0;
 
-    //Improves probabilities for dropping moves that benefit the player.
-    inline void enhance_policy_dropping_moves(Board& board, move_vector<Move>& moves)
-    {
-        double max_policy = 0.0;
-        for (const Move& move : moves)
-        {
-            // find maximum policy value
-            if (move.policy > max_policy)
-                max_policy = move.policy;
-        }
+                if constexpr (Policy & dropping_moves_mask)
+                {
+                    if (move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN)
+                        factor += board.eval_drop(move);
+                }
 
-        // enhance the probability for all dropping moves where P(s, a) < check_thresh
-        bool enhanced = false;
-        double sum_policy = 0.0;
-        for (Move& move : moves)
-        {
-            if (move.policy < check_thresh && move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN)
-            {
-                move.policy += max_policy * board.eval_drop(move);
-                enhanced = true;
-            }
-            sum_policy += move.policy;
-        }
+                if constexpr (Policy & capturing_moves_mask)
+                {
+                    if (move.flags() == CAPTURE)
+                        factor += check_factor;
+                }
 
-        // renormalize if needed
-        if (enhanced)
-        {
-            for (Move& move : moves)
-                move.policy /= sum_policy;
-        }
-    }
+                if constexpr (Policy & checking_moves_mask)
+                {
+                    if (board.gives_check(move, ci))
+                        factor += check_factor;
+                }
 
-    //Improves probabilities for moves that result in a capture.
-    inline void enhance_policy_capturing_moves(Board& board, move_vector<Move>& moves)
-    {
-        double max_policy = 0.0;
-        for (const Move& move : moves)
-        {
-            // find maximum policy value
-            if (move.policy > max_policy)
-                max_policy = move.policy;
-        }
+                if constexpr (Policy & forking_moves_mask)
+                {
+                    if (board.gives_fork(move, ci))
+                        factor += check_factor;
+                }
 
-        // enhance the probability for all checking moves where P(s, a) < check_thresh
-        bool enhanced = false;
-        double sum_policy = 0.0;
-        for (Move& move : moves)
-        {
-            if (move.policy < check_thresh && move.flags() == CAPTURE)
-            {
-                move.policy += max_policy * check_factor;
-                enhanced = true;
+                if (factor != 0.0)
+                {
+                    move.policy += max_policy * factor;
+                    enhanced = true;
+                }
             }
             sum_policy += move.policy;
-
         }
 
         // renormalize if needed
@@ -2385,20 +3776,6 @@ namespace crazyrabbit
 
 
 
-    inline bool filter_next_move(Position p, Move move)
-    {
-        if (p.turn() == WHITE)
-        {
-            p.play<WHITE>(move);
-            return p.end_score<WHITE>() > 0.5;
-        }
-        else
-        {
-            p.play<BLACK>(move);
-            return p.end_score<BLACK>() > 0.5;
-        }
-    }
-
     inline int filter_move(Position p, Move move)
     {
         if (p.turn() == WHITE)
@@ -2413,13 +3790,9 @@ namespace crazyrabbit
             {
                 return 0;
             }
-            else
+            else if (p.mate_in_one<BLACK>().from() != NO_SQUARE)
             {
-                for (Move& m : p.generate_legals<BLACK>())
-                {
-                    if (filter_next_move(p, m))
-                        return 2;
-                }
+                return 2;
             }
         }
         else
@@ -2434,13 +3807,9 @@ namespace crazyrabbit
             {
                 return 0;
             }
-            else
+            else if (p.mate_in_one<WHITE>().from() != NO_SQUARE)
             {
-                for (Move& m : p.generate_legals<WHITE>())
-                {
-                    if (filter_next_move(p, m))
-                        return 2;
-                }
+                return 2;
             }
         }
         return 0;
@@ -0,0 +1,613 @@
+/*
+    CrazyRabbit 2.2, a program for playing the chess variant Crazyhouse
+    with the use of deep learning and domain knowledge.
+
+    Copyright (C) 2022 Anei Makovec
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CRAZYRABBIT_INSTRUMENTATION_HPP
+#define CRAZYRABBIT_INSTRUMENTATION_HPP
+
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define CRAZYRABBIT_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CRAZYRABBIT_TSC
+#endif
+
+//The hardware counters are read at the borders of the zones, so they imply the zones.
+#if defined(CRAZYRABBIT_PERF_COUNTERS) && !defined(CRAZYRABBIT_INSTRUMENTATION)
+#define CRAZYRABBIT_INSTRUMENTATION
+#endif
+
+#if defined(CRAZYRABBIT_PERF_COUNTERS) && !defined(__linux__)
+#error "CRAZYRABBIT_PERF_COUNTERS needs perf_event_open, which is only available on Linux"
+#endif
+
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#endif
+
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//Times the rest of the enclosing scope as the given zone. Compiles to nothing unless CRAZYRABBIT_INSTRUMENTATION is defined.
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+#define CRAZYRABBIT_ZONE_NAME(line) crazyrabbit_zone_##line
+#define CRAZYRABBIT_ZONE_AT(zone, line) crazyrabbit::instrumentation::ScopedZone CRAZYRABBIT_ZONE_NAME(line)(crazyrabbit::instrumentation::Zone::zone)
+#define CRAZYRABBIT_ZONE(zone) CRAZYRABBIT_ZONE_AT(zone, __LINE__)
+#else
+#define CRAZYRABBIT_ZONE(zone) ((void)0)
+#endif
+
+namespace crazyrabbit
+{
+    namespace instrumentation
+    {
+        //Reads the time stamp counter, which ticks at a constant rate. Without it, nanoseconds are counted instead.
+        inline uint64_t read_ticks()
+        {
+#ifdef CRAZYRABBIT_TSC
+            return __rdtsc();
+#else
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+        }
+
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+        //Parts of a simulation. Zones can be nested, the self time of a zone does not include the zones inside it.
+        enum class Zone
+        {
+            Simulation,
+            Select,
+            Movegen,
+            PolicyEnhancement,
+            Encode,
+            NNet,
+            Expand,
+            ValueCorrection,
+            Backprop,
+            SessionRun,
+            MateSearch,
+            TimeCheck,
+            NUM
+        };
+
+        constexpr int NUM_ZONES = static_cast<int>(Zone::NUM);
+        constexpr int HISTOGRAM_BUCKETS = 40;    // bucket i counts the calls that took [2^(i-1), 2^i) ticks
+        constexpr const char* zone_names[NUM_ZONES] = { "simulation", "select", "movegen", "policy_enhancement", "encode", "nnet", "expand", "value_correction", "backprop",
+                                                        "session_run", "mate_search", "time_check" };
+        constexpr size_t TRACE_BUFFER_SPANS = 1 << 16;    // spans kept per thread, a power of two
+
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+        //Hardware events counted in user mode by the thread that runs a zone.
+        enum class Event
+        {
+            Cycles,
+            Instructions,
+            L1DMisses,
+            LLCMisses,
+            BranchMisses,
+            NUM
+        };
+
+        constexpr int NUM_EVENTS = static_cast<int>(Event::NUM);
+        constexpr const char* event_names[NUM_EVENTS] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses" };
+
+        //A group of hardware counters of the calling thread, opened with perf_event_open. The group is scheduled on the processor
+        //as a whole, so all its counters cover the same instructions and a single read returns all of them. Events that the
+        //processor does not support are left out of the group and read as zero.
+        class PerfCounters
+        {
+        public:
+            PerfCounters()
+            {
+                const std::pair<uint32_t, uint64_t> events[NUM_EVENTS] = {
+                    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+                    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+                    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+                    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+                };
+
+                for (int event = 0; event < NUM_EVENTS; event++)
+                {
+                    perf_event_attr attr;
+                    std::memset(&attr, 0, sizeof(attr));
+                    attr.size = sizeof(attr);
+                    attr.type = events[event].first;
+                    attr.config = events[event].second;
+                    attr.disabled = (leader < 0) ? 1 : 0;
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv = 1;
+                    attr.read_format = PERF_FORMAT_GROUP;
+
+                    int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+                    if (fd < 0)
+                    {
+                        //Without the cycles there is no group at all.
+                        if (leader < 0)
+                        {
+                            error = errno;
+                            return;
+                        }
+                        continue;
+                    }
+
+                    if (leader < 0)
+                        leader = fd;
+                    index[event] = num_open;
+                    fds[num_open++] = fd;
+                }
+
+                ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+
+            ~PerfCounters()
+            {
+                for (int i = 0; i < num_open; i++)
+                    close(fds[i]);
+            }
+
+            PerfCounters(const PerfCounters&) = delete;
+            void operator=(const PerfCounters&) = delete;
+
+            inline bool available() const { return leader >= 0; }
+
+            //Returns the errno of the failed perf_event_open, 0 if the counters are available.
+            inline int open_error() const { return error; }
+
+            //Reads all counters with one system call.
+            inline void read(uint64_t (&values)[NUM_EVENTS]) const
+            {
+                struct { uint64_t nr; uint64_t values[NUM_EVENTS]; } data = {};
+                if (leader < 0 || ::read(leader, &data, sizeof(data)) <= 0)
+                {
+                    std::fill(values, values + NUM_EVENTS, 0ULL);
+                    return;
+                }
+
+                for (int event = 0; event < NUM_EVENTS; event++)
+                    values[event] = (index[event] >= 0) ? data.values[index[event]] : 0ULL;
+            }
+
+        private:
+            int leader = -1;
+            int error = 0;
+            int num_open = 0;
+            int fds[NUM_EVENTS] = {};
+            int index[NUM_EVENTS] = { -1, -1, -1, -1, -1 };    // position of each event in the group read, -1 if it is not counted
+        };
+#endif
+
+        //Counters of a zone on one thread. Only the owning thread writes them, so they are updated without atomic read-modify-write
+        //instructions, and other threads can read them at any time.
+        struct ZoneCounters
+        {
+            std::atomic<uint64_t> calls = 0ULL;
+            std::atomic<uint64_t> ticks = 0ULL;
+            std::atomic<uint64_t> self_ticks = 0ULL;
+            std::atomic<uint64_t> histogram[HISTOGRAM_BUCKETS] = {};
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+            std::atomic<uint64_t> events[NUM_EVENTS] = {};
+            std::atomic<uint64_t> self_events[NUM_EVENTS] = {};
+#endif
+
+            inline static void add(std::atomic<uint64_t>& counter, const uint64_t value) { counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+        };
+
+        //An interval of ticks spent in a zone.
+        struct Span
+        {
+            uint64_t begin;
+            uint64_t end;
+            Zone zone;
+        };
+
+        //The last spans of a thread, kept in a ring so that tracing takes the same memory however long it runs. Only the owning thread
+        //writes it, the spans up to the published count can be read by another thread while the owner is not running zones.
+        struct TraceBuffer
+        {
+            std::unique_ptr<Span[]> spans;
+            std::atomic<uint64_t> written = 0ULL;
+            uint64_t dumped = 0ULL;    // spans already written to a trace, only used under the registry mutex
+
+            inline void push(const Span& span)
+            {
+                if (!spans)
+                    spans = std::make_unique<Span[]>(TRACE_BUFFER_SPANS);
+
+                uint64_t count = written.load(std::memory_order_relaxed);
+                spans[count & (TRACE_BUFFER_SPANS - 1)] = span;
+                written.store(count + 1, std::memory_order_release);
+            }
+        };
+
+        struct ThreadCounters
+        {
+            ZoneCounters zones[NUM_ZONES];
+            TraceBuffer trace;
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+            PerfCounters perf;
+#endif
+        };
+
+        //Sum of the counters of a zone over all threads.
+        struct ZoneSummary
+        {
+            uint64_t calls = 0ULL;
+            uint64_t ticks = 0ULL;
+            uint64_t self_ticks = 0ULL;
+            uint64_t histogram[HISTOGRAM_BUCKETS] = {};
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+            uint64_t events[NUM_EVENTS] = {};
+            uint64_t self_events[NUM_EVENTS] = {};
+#endif
+
+            inline void add(const ZoneCounters& counters)
+            {
+                calls += counters.calls.load(std::memory_order_relaxed);
+                ticks += counters.ticks.load(std::memory_order_relaxed);
+                self_ticks += counters.self_ticks.load(std::memory_order_relaxed);
+                for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+                    histogram[bucket] += counters.histogram[bucket].load(std::memory_order_relaxed);
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                for (int event = 0; event < NUM_EVENTS; event++)
+                {
+                    events[event] += counters.events[event].load(std::memory_order_relaxed);
+                    self_events[event] += counters.self_events[event].load(std::memory_order_relaxed);
+                }
+#endif
+            }
+
+            //Returns the upper bound of the bucket holding the given fraction of the calls, in ticks.
+            inline uint64_t percentile(const double fraction) const
+            {
+                if (!calls)
+                    return 0ULL;
+
+                uint64_t target = static_cast<uint64_t>(fraction * static_cast<double>(calls));
+                uint64_t seen = 0ULL;
+                for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+                {
+                    seen += histogram[bucket];
+                    if (seen > target)
+                        return 1ULL << bucket;
+                }
+                return 1ULL << (HISTOGRAM_BUCKETS - 1);
+            }
+        };
+
+        //Owns the counters of every thread that entered a zone. The counters outlive their threads, so no time is lost when a thread ends.
+        class Registry
+        {
+        public:
+            static Registry& get_instance()
+            {
+                static Registry instance;
+                return instance;
+            }
+
+            Registry(const Registry&) = delete;
+            void operator=(const Registry&) = delete;
+
+            //Returns the counters of the calling thread, registering them on the first call.
+            inline ThreadCounters& local()
+            {
+                thread_local ThreadCounters* counters = nullptr;
+                if (!counters)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    threads.push_back(std::make_unique<ThreadCounters>());
+                    counters = threads.back().get();
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                    if (counters->perf.available())
+                        perf_threads++;
+                    else
+                        perf_error = counters->perf.open_error();
+#endif
+                }
+                return *counters;
+            }
+
+            inline void summarize(ZoneSummary (&summary)[NUM_ZONES], const bool whole_run = false);
+            inline void reset();
+            inline double ticks_per_ns() const;
+            inline bool write_trace(const std::string& path);
+
+            //Records the spans of the zones while set.
+            std::atomic<bool> tracing = false;
+
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+            //The number of threads with hardware counters, and the errno of the last thread whose counters could not be opened.
+            std::atomic<int> perf_threads = 0;
+            std::atomic<int> perf_error = 0;
+#endif
+
+        private:
+            std::mutex mutex;
+            std::vector<std::unique_ptr<ThreadCounters>> threads;
+            ZoneSummary run[NUM_ZONES];    // counters cleared by the resets so far
+            std::chrono::steady_clock::time_point start_time;
+            uint64_t start_ticks;
+
+            Registry() : start_time(std::chrono::steady_clock::now()), start_ticks(read_ticks()) {}
+        };
+
+        //Adds the counters of all threads since the last reset into the summary, or since the start of the program for the whole run.
+        inline void Registry::summarize(ZoneSummary (&summary)[NUM_ZONES], const bool whole_run)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int zone = 0; zone < NUM_ZONES; zone++)
+            {
+                summary[zone] = whole_run ? run[zone] : ZoneSummary();
+                for (const std::unique_ptr<ThreadCounters>& thread : threads)
+                    summary[zone].add(thread->zones[zone]);
+            }
+        }
+
+        //Clears the counters of all threads, keeping them in the totals of the run. Meant to be called between searches, a zone that
+        //ends at the same time may survive it.
+        inline void Registry::reset()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const std::unique_ptr<ThreadCounters>& thread : threads)
+            {
+                for (int zone = 0; zone < NUM_ZONES; zone++)
+                {
+                    ZoneCounters& counters = thread->zones[zone];
+                    run[zone].add(counters);
+                    counters.calls.store(0ULL, std::memory_order_relaxed);
+                    counters.ticks.store(0ULL, std::memory_order_relaxed);
+                    counters.self_ticks.store(0ULL, std::memory_order_relaxed);
+                    for (std::atomic<uint64_t>& bucket : counters.histogram)
+                        bucket.store(0ULL, std::memory_order_relaxed);
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                    for (int event = 0; event < NUM_EVENTS; event++)
+                    {
+                        counters.events[event].store(0ULL, std::memory_order_relaxed);
+                        counters.self_events[event].store(0ULL, std::memory_order_relaxed);
+                    }
+#endif
+                }
+            }
+        }
+
+        //Returns the rate of the counter measured since the registry was created, so no time is spent calibrating it.
+        inline double Registry::ticks_per_ns() const
+        {
+            uint64_t ticks = read_ticks();
+            long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+            return (ns > 0) ? static_cast<double>(ticks - start_ticks) / static_cast<double>(ns) : 1.0;
+        }
+
+        //Writes the spans recorded since the last trace in the Chrome trace event format, which chrome://tracing and Perfetto open.
+        //Every thread is a track of nested spans, with the times in microseconds since the registry was created. When a thread ran
+        //more zones than its ring holds, only its last spans are written. Meant to be called between searches, like reset().
+        inline bool Registry::write_trace(const std::string& path)
+        {
+            std::ofstream out(path);
+            if (!out.is_open())
+                return false;
+
+            double rate = ticks_per_ns();
+            std::lock_guard<std::mutex> lock(mutex);
+            out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"CrazyRabbit\"}}";
+            for (size_t thread = 0; thread < threads.size(); thread++)
+            {
+                TraceBuffer& trace = threads[thread]->trace;
+                uint64_t written = trace.written.load(std::memory_order_acquire);
+                uint64_t first = std::max<uint64_t>(trace.dumped, (written > TRACE_BUFFER_SPANS) ? written - TRACE_BUFFER_SPANS : 0ULL);
+                out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread + 1 << ",\"args\":{\"name\":\"thread " << thread + 1
+                    << "\",\"dropped_spans\":" << first - trace.dumped << "}}";
+
+                for (uint64_t i = first; i < written; i++)
+                {
+                    const Span& span = trace.spans[i & (TRACE_BUFFER_SPANS - 1)];
+                    out << ",\n{\"name\":\"" << zone_names[static_cast<int>(span.zone)] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread + 1
+                        << ",\"ts\":" << static_cast<double>(span.begin - start_ticks) / rate / 1000.0
+                        << ",\"dur\":" << static_cast<double>(span.end - span.begin) / rate / 1000.0 << "}";
+                }
+                trace.dumped = written;
+            }
+            out << "]}\n";
+            return out.good();
+        }
+
+        //Adds the time from its construction to its destruction to the zone, and removes it from the self time of the enclosing zone.
+        //While tracing, the interval is also recorded as a span of the thread.
+        //With the hardware counters, the events are attributed the same way. They are read outside of the timed interval, but each
+        //read is a system call, which adds to the time and the user mode events of the enclosing zone.
+        class ScopedZone
+        {
+        public:
+            ScopedZone(const Zone zone) : zone(zone), thread(Registry::get_instance().local()), counters(thread.zones[static_cast<int>(zone)]), parent(current)
+            {
+                current = this;
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                thread.perf.read(begin_events);
+#endif
+                begin = read_ticks();
+            }
+
+            ~ScopedZone()
+            {
+                uint64_t end = read_ticks();
+                uint64_t ticks = end - begin;
+                current = parent;
+                if (parent)
+                    parent->nested_ticks += ticks;
+
+                ZoneCounters::add(counters.calls, 1ULL);
+                ZoneCounters::add(counters.ticks, ticks);
+                ZoneCounters::add(counters.self_ticks, ticks - std::min(ticks, nested_ticks));
+                ZoneCounters::add(counters.histogram[std::min<int>(std::bit_width(ticks), HISTOGRAM_BUCKETS - 1)], 1ULL);
+                if (Registry::get_instance().tracing.load(std::memory_order_relaxed))
+                    thread.trace.push({ begin, end, zone });
+
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                uint64_t end_events[NUM_EVENTS];
+                thread.perf.read(end_events);
+                for (int event = 0; event < NUM_EVENTS; event++)
+                {
+                    uint64_t count = end_events[event] - begin_events[event];
+                    if (parent)
+                        parent->nested_events[event] += count;
+
+                    ZoneCounters::add(counters.events[event], count);
+                    ZoneCounters::add(counters.self_events[event], count - std::min(count, nested_events[event]));
+                }
+#endif
+            }
+
+            ScopedZone(const ScopedZone&) = delete;
+            void operator=(const ScopedZone&) = delete;
+
+        private:
+            Zone zone;
+            ThreadCounters& thread;
+            ZoneCounters& counters;
+            ScopedZone* parent;
+            uint64_t begin = 0ULL;
+            uint64_t nested_ticks = 0ULL;
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+            uint64_t begin_events[NUM_EVENTS] = {};
+            uint64_t nested_events[NUM_EVENTS] = {};
+#endif
+
+            inline static thread_local ScopedZone* current = nullptr;
+        };
+
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+        //Explains why perf_event_open failed.
+        inline std::string perf_error_message(const int error)
+        {
+            if (error == EACCES || error == EPERM)
+                return std::string(std::strerror(error)) + ", lower /proc/sys/kernel/perf_event_paranoid or grant CAP_PERFMON";
+            if (error == ENOENT || error == EOPNOTSUPP)
+                return std::string(std::strerror(error)) + ", the processor or hypervisor does not expose the hardware counters";
+            return std::strerror(error);
+        }
+
+        //Returns the events counted in the zone itself, followed by the instructions per cycle and the misses per thousand instructions.
+        inline std::string counters_summary(const ZoneSummary& s)
+        {
+            const uint64_t (&events)[NUM_EVENTS] = s.self_events;
+            double kilo_instructions = std::max(1.0, static_cast<double>(events[static_cast<int>(Event::Instructions)]) / 1000.0);
+
+            std::ostringstream out;
+            for (int event = 0; event < NUM_EVENTS; event++)
+                out << (event ? " " : "") << event_names[event] << " " << events[event];
+            out << std::fixed << std::setprecision(2)
+                << " ipc " << static_cast<double>(events[static_cast<int>(Event::Instructions)]) / std::max(1.0, static_cast<double>(events[static_cast<int>(Event::Cycles)]))
+                << " l1d_mpki " << static_cast<double>(events[static_cast<int>(Event::L1DMisses)]) / kilo_instructions
+                << " llc_mpki " << static_cast<double>(events[static_cast<int>(Event::LLCMisses)]) / kilo_instructions
+                << " branch_mpki " << static_cast<double>(events[static_cast<int>(Event::BranchMisses)]) / kilo_instructions;
+            return out.str();
+        }
+#endif
+
+        //Returns one "info string" line per zone that was entered, with its calls, total and self time and latency percentiles, and with
+        //the hardware counters another line with the events of the zone itself. The lines of the whole run start with "info string run".
+        inline std::string info_summary(const bool whole_run = false)
+        {
+            ZoneSummary summary[NUM_ZONES];
+            Registry::get_instance().summarize(summary, whole_run);
+            double rate = Registry::get_instance().ticks_per_ns();
+            const char* prefix = whole_run ? "info string run " : "info string ";
+
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(0);
+            for (int zone = 0; zone < NUM_ZONES; zone++)
+            {
+                const ZoneSummary& s = summary[zone];
+                if (!s.calls)
+                    continue;
+
+                out << prefix << "zone " << zone_names[zone] << " calls " << s.calls
+                    << " total " << static_cast<double>(s.ticks) / rate / 1000.0 << " us self " << static_cast<double>(s.self_ticks) / rate / 1000.0 << " us"
+                    << " avg " << static_cast<double>(s.ticks) / static_cast<double>(s.calls) / rate << " ns"
+                    << " p50 " << static_cast<double>(s.percentile(0.5)) / rate << " ns p99 " << static_cast<double>(s.percentile(0.99)) / rate << " ns\n";
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                if (Registry::get_instance().perf_threads.load())
+                    out << prefix << "counters " << zone_names[zone] << " " << counters_summary(s) << "\n";
+#endif
+            }
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+            if (int error = Registry::get_instance().perf_error.load())
+                out << prefix << "counters unavailable on some threads: " << perf_error_message(error) << "\n";
+#endif
+            return out.str();
+        }
+
+        //Returns the counters of all zones as a single line of JSON, with the times in nanoseconds and the histograms in ticks.
+        inline std::string json_summary(const bool whole_run = false)
+        {
+            ZoneSummary summary[NUM_ZONES];
+            Registry::get_instance().summarize(summary, whole_run);
+            double rate = Registry::get_instance().ticks_per_ns();
+
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(3) << "{\"ticks_per_ns\":" << rate << ",\"zones\":{" << std::setprecision(0);
+            for (int zone = 0; zone < NUM_ZONES; zone++)
+            {
+                const ZoneSummary& s = summary[zone];
+                out << (zone ? "," : "") << "\"" << zone_names[zone] << "\":{\"calls\":" << s.calls
+                    << ",\"total_ns\":" << static_cast<double>(s.ticks) / rate << ",\"self_ns\":" << static_cast<double>(s.self_ticks) / rate
+                    << ",\"p50_ns\":" << static_cast<double>(s.percentile(0.5)) / rate << ",\"p99_ns\":" << static_cast<double>(s.percentile(0.99)) / rate
+                    << ",\"histogram\":[";
+                for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+                    out << (bucket ? "," : "") << s.histogram[bucket];
+                out << "]";
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+                for (const auto& [name, events] : { std::make_pair("events", s.events), std::make_pair("self_events", s.self_events) })
+                {
+                    out << ",\"" << name << "\":{";
+                    for (int event = 0; event < NUM_EVENTS; event++)
+                        out << (event ? "," : "") << "\"" << event_names[event] << "\":" << events[event];
+                    out << "}";
+                }
+#endif
+                out << "}";
+            }
+            out << "}}";
+            return out.str();
+        }
+#endif
+    }
+}
+
+#endif
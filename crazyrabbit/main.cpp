@@ -21,6 +21,8 @@
 #include <iostream>
 #include <stdlib.h>
 #include <sstream>
+#include <iomanip>
+#include <mutex>
 #include "utils.h"
 #include "crazyrabbit.h"
 #include "cppflow/cppflow.h"
@@ -43,12 +45,113 @@ int main(int argc, char* argv[])
 	uci uci;
 	bool debug_mode = true;
 
+	// the best move of each search is sent once, either by the search or by the watchdog when the hard deadline passes
+	std::mutex output_mutex;
+	bool answered = false;
+	Move answered_move;
+
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+	// with a trace file set, every move writes a trace of its zones, numbered before the extension (trace.json becomes trace.1.json, ...)
+	std::string trace_file;
+	int traced_moves = 0;
+#endif
+
+	mcts.on_deadline = [&](Move move) {
+		std::lock_guard<std::mutex> lock(output_mutex);
+		if (!answered)
+		{
+			answered = true;
+			answered_move = move;
+			std::cout << "bestmove " << move << std::endl;
+		}
+	};
+
+	// searches the bench positions with a fixed number of simulations and every random choice seeded, so that builds can be compared by the signature and speed
+	auto run_bench = [&](int simulations) {
+		if (simulations <= 0)
+			simulations = default_bench_sims;
+
+		bool time_control = mcts.time_control;
+		int num_sims = mcts.num_sims;
+		bool use_openings = mcts.use_openings;
+		mcts.time_control = false;
+		mcts.num_sims = simulations;
+		mcts.use_openings = false;
+
+		Dirichlet::get_instance().seed(bench_seed);
+		tie_break_rng().seed(bench_seed);
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+		instrumentation::Registry::get_instance().reset();
+#endif
+
+		Board bench_board;
+		mcts.init(bench_board);
+
+		long long nodes = 0LL;
+		uint64_t signature = 0ULL;
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bench_positions.size(); i++)
+		{
+			bench_board.set_fen(bench_positions[i]);
+			mcts.reset();
+			mcts.player = bench_board.p.turn();
+
+			Move best_move = mcts.best_move(bench_board);
+			nodes += mcts.explored_nodes;
+
+			// the signature covers the visits of every root move, so any change of the search shows up
+			signature = mix_hash(signature ^ best_move.hash());
+			for (Move& move : mcts.move_data[mcts.node_key(bench_board)])
+				signature = mix_hash(signature ^ static_cast<uint64_t>(move.n_visits));
+
+			std::cout << "Position " << i + 1 << "/" << bench_positions.size() << ": bestmove " << best_move << " nodes " << mcts.explored_nodes << "\n";
+		}
+		long long time = std::max(1LL, static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count()));
+
+		mcts.reset();
+		mcts.time_control = time_control;
+		mcts.num_sims = num_sims;
+		mcts.use_openings = use_openings;
+
+		std::cout << "\nTotal time (ms)       : " << time
+			<< "\nNodes searched        : " << nodes
+			<< "\nNodes/second          : " << static_cast<long long>(static_cast<double>(nodes) / (static_cast<double>(time) / 1000.0))
+			<< "\nSignature             : " << std::hex << signature << std::dec << "\n";
+
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+		// the self time of every zone, so the parts add up to the time spent in the simulations
+		instrumentation::ZoneSummary zones[instrumentation::NUM_ZONES];
+		instrumentation::Registry::get_instance().summarize(zones);
+		double rate = instrumentation::Registry::get_instance().ticks_per_ns();
+		for (int zone = 0; zone < instrumentation::NUM_ZONES; zone++)
+		{
+			double ms = static_cast<double>(zones[zone].self_ticks) / rate / 1e6;
+			std::cout << std::left << std::setw(22) << instrumentation::zone_names[zone] << std::right << ": " << static_cast<long long>(ms) << " ms ("
+				<< std::fixed << std::setprecision(1) << 100.0 * ms / static_cast<double>(time) << "%)\n";
+			std::cout.unsetf(std::ios::fixed);
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+			if (zones[zone].calls && instrumentation::Registry::get_instance().perf_threads.load())
+				std::cout << std::setw(24) << "" << instrumentation::counters_summary(zones[zone]) << "\n";
+#endif
+		}
+#ifdef CRAZYRABBIT_PERF_COUNTERS
+		if (int error = instrumentation::Registry::get_instance().perf_error.load())
+			std::cout << "Hardware counters     : " << instrumentation::perf_error_message(error) << "\n";
+#endif
+		instrumentation::Registry::get_instance().reset();
+#else
+		std::cout << "Time breakdown        : only in builds with CRAZYRABBIT_INSTRUMENTATION\n";
+#endif
+		std::cout << std::flush;
+	};
+
 	// register callbacks to the messages from the UI and respond appropriately.
 	uci.receive_uci.connect([&]() {
 		uci.send_id("CrazyRabbit 2.2", "Anei Makovec");
 		uci.send_option_combo_box("UCI_Variant", "crazyhouse", { "crazyhouse" });
 		uci.send_option_combo_box("TimeControl", "Default", { "Default", "None" });
 		uci.send_option_spin_wheel("Simulations/Move", 100, 1, 100000);
+		uci.send_option_spin_wheel("Hash", 256, 1, 65536);
 		uci.send_option_combo_box("BestMoveStrategy", "Default", { "Default", "Q-value" });
 		uci.send_option_combo_box("NodeExpansionStrategy", "Default", { "Default", "Exploration" });
 		uci.send_option_combo_box("BackpropStrategy", "Default", { "Default", "SMA" });
@@ -56,6 +159,9 @@ int main(int argc, char* argv[])
 		uci.send_option_check_box("UseMateSearch", false);
 		uci.send_option_spin_wheel("MateSearchMaxDepth", 3, 1, 10000);
 		uci.send_option_check_box("MoveFiltering", false);
+		uci.send_option_check_box("ProgressiveWidening", false);
+		uci.send_option_check_box("HierarchicalDrops", false);
+		uci.send_option_check_box("GraphSearch", false);
 		uci.send_option_check_box("PE_Dirichlet", true);
 		uci.send_option_check_box("PE_CheckingMoves", false);
 		uci.send_option_check_box("PE_ForkingMoves", false);
@@ -66,6 +172,15 @@ int main(int argc, char* argv[])
 		uci.send_option_check_box("Eval_KingSafety", false);
 		uci.send_option_check_box("Eval_PiecePlacement", false);
 		uci.send_option_check_box("Eval_BoardControl", false);
+#ifdef CRAZYRABBIT_AOT
+		uci.send_option_combo_box("NNetBackend", "TensorFlow", { "TensorFlow", "Synthetic", "AOT" });
+#else
+		uci.send_option_combo_box("NNetBackend", "TensorFlow", { "TensorFlow", "Synthetic" });
+#endif
+		uci.send_option_spin_wheel("SyntheticLatency", 0, 0, 1000000);
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+		uci.send_option_string("TraceFile", "<empty>");
+#endif
 		uci.send_uci_ok();
 	});
 
@@ -89,6 +204,12 @@ int main(int argc, char* argv[])
 			if (sims >= 1 && sims <= 100000)
 				mcts.num_sims = sims;
 		} 
+		else if (name == "Hash")
+		{
+			int megabytes = stoi(value);
+			if (megabytes >= 1 && megabytes <= 65536)
+				mcts.set_hash_size(static_cast<size_t>(megabytes));
+		}
 		else if (name == "BestMoveStrategy") 
 		{
 			if (value == "Default")
@@ -137,6 +258,27 @@ int main(int argc, char* argv[])
 			else
 				mcts.filter_moves = false;
 		}
+		else if (name == "ProgressiveWidening")
+		{
+			if (value == "true")
+				mcts.progressive_widening = true;
+			else
+				mcts.progressive_widening = false;
+		}
+		else if (name == "HierarchicalDrops")
+		{
+			if (value == "true")
+				mcts.hierarchical_drops = true;
+			else
+				mcts.hierarchical_drops = false;
+		}
+		else if (name == "GraphSearch")
+		{
+			if (value == "true")
+				mcts.graph_search = true;
+			else
+				mcts.graph_search = false;
+		}
 		else if (name == "PE_Dirichlet") 
 		{
 			if (value == "true")
@@ -217,6 +359,28 @@ int main(int argc, char* argv[])
 				mcts.config.eval_mask &= ~board_control_mask;
 			mcts.set_config(mcts.config);
 		} 
+		else if (name == "NNetBackend")
+		{
+			if (value == "TensorFlow")
+				mcts.set_nnet_backend(NNetBackendType::TensorFlow, mcts.nnet.latency);
+			else if (value == "Synthetic")
+				mcts.set_nnet_backend(NNetBackendType::Synthetic, mcts.nnet.latency);
+			else if (value == "AOT")
+				mcts.set_nnet_backend(NNetBackendType::AOT, mcts.nnet.latency);
+		}
+		else if (name == "SyntheticLatency")
+		{
+			long long latency = stoll(value);
+			if (latency >= 0 && latency <= 1000000)
+				mcts.set_nnet_backend(mcts.nnet.backend_type, latency);
+		}
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+		else if (name == "TraceFile")
+		{
+			trace_file = (value == "<empty>") ? "" : value;
+			instrumentation::Registry::get_instance().tracing = !trace_file.empty();
+		}
+#endif
 		else 
 		{
 			std::cout << "UCI ERROR: option " << name << " could not be set to value " << value << ".\n";
@@ -255,49 +419,116 @@ int main(int argc, char* argv[])
 	});
 
 	uci.receive_go.connect([&](const std::map<uci::command, std::string>& parameters) {
-		if (parameters.contains(uci::command::white_time)) 
+		if (parameters.contains(uci::command::perft))
 		{
-			if (mcts.time_per_move == -1LL) 
+			// counts the leaves of the move tree from the current position instead of searching, to check the move generator
+			Perft perft;
+			perft.set_hash_size(default_perft_hash_size);
+			std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+			std::vector<std::pair<Move, uint64_t>> counts = perft.divide(board.p, std::stoi(parameters.at(uci::command::perft)), static_cast<int>(std::max(1U, std::thread::hardware_concurrency())));
+			long long time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+
+			uint64_t nodes = 0;
+			for (auto& [move, count] : counts)
 			{
-				switch (mcts.player) 
-				{
-				case WHITE:
-					mcts.init_time(std::stoi(parameters.at(uci::command::white_time)), std::stoi(parameters.at(uci::command::white_increment)));
-					break;
-				case BLACK:
-					mcts.init_time(std::stoi(parameters.at(uci::command::black_time)), std::stoi(parameters.at(uci::command::black_increment)));
-					break;
-				}
-			} 
-			else 
+				std::cout << move << ": " << count << "\n";
+				nodes += count;
+			}
+			std::cout << "\nNodes searched: " << nodes << "\ninfo nodes " << nodes << " time " << time << " nps " << static_cast<long long>(static_cast<double>(nodes) / (static_cast<double>(std::max(time, 1LL)) / 1000.0)) << std::endl;
+			return;
+		}
+
+		if (parameters.contains(uci::command::white_time)) 
+		{
+			int moves_to_go = parameters.contains(uci::command::moves_to_go) ? std::stoi(parameters.at(uci::command::moves_to_go)) : 0;
+
+			switch (mcts.player) 
 			{
-				switch (mcts.player) 
-				{
-				case WHITE:
-					mcts.update_time(std::stoi(parameters.at(uci::command::white_time)));
-					break;
-				case BLACK:
-					mcts.update_time(std::stoi(parameters.at(uci::command::black_time)));
-					break;
-				}
+			case WHITE:
+				mcts.init_time(std::stoi(parameters.at(uci::command::white_time)), parameters.contains(uci::command::white_increment) ? std::stoi(parameters.at(uci::command::white_increment)) : 0, moves_to_go);
+				break;
+			case BLACK:
+				mcts.init_time(std::stoi(parameters.at(uci::command::black_time)), parameters.contains(uci::command::black_increment) ? std::stoi(parameters.at(uci::command::black_increment)) : 0, moves_to_go);
+				break;
 			}
 		} 
 		else if (parameters.contains(uci::command::move_time)) 
 		{
-			mcts.time_per_move = std::stoll(parameters.at(uci::command::move_time)) - 500LL;
+			mcts.init_move_time(std::stoll(parameters.at(uci::command::move_time)));
 		}
 
+		answered = false;
 		Move best_move = mcts.best_move(board);
-		board.push(best_move);
 
-		if (debug_mode)
-			std::cout << "info depth " << mcts.explored_nodes << " score cp " << mcts.best_move_cp << " nodes " << mcts.explored_nodes << " time " << mcts.time_simulating << " nps " << static_cast<long long>(static_cast<double>(mcts.explored_nodes) / (static_cast<double>(mcts.time_simulating) / 1000.0)) << "\n";
-			
-		std::cout << "bestmove " << best_move << "\n";
+		{
+			std::lock_guard<std::mutex> lock(output_mutex);
+			if (answered)
+			{
+				// the watchdog already sent its move, so the board follows it
+				board.push(answered_move);
+			}
+			else
+			{
+				answered = true;
+				board.push(best_move);
+
+				if (debug_mode)
+				{
+					std::cout << "info depth " << mcts.explored_nodes << " score cp " << mcts.best_move_cp << " nodes " << mcts.explored_nodes << " time " << mcts.time_simulating << " nps " << static_cast<long long>(static_cast<double>(mcts.explored_nodes) / (static_cast<double>(mcts.time_simulating) / 1000.0)) << "\n";
+					if (mcts.eval.pawn_cache.probes)
+						std::cout << "info string pawn cache hits " << mcts.eval.pawn_cache.hits << "/" << mcts.eval.pawn_cache.probes << " (" << static_cast<int>(100.0 * mcts.eval.pawn_cache.hit_rate()) << "%)\n";
+					if (mcts.deadline_moves)
+						std::cout << "info string overshoot avg " << mcts.total_overshoot / mcts.deadline_moves << " ms max " << mcts.max_overshoot << " ms, hard deadlines missed " << mcts.deadline_misses << "/" << mcts.deadline_moves << "\n";
+				}
+
+				std::cout << "bestmove " << best_move << std::endl;
+			}
+		}
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+		// the zones are counted per move and reported after the move is sent, so writing them does not delay it
+		{
+			std::lock_guard<std::mutex> lock(output_mutex);
+			std::cout << instrumentation::info_summary() << "info string zones " << instrumentation::json_summary() << "\n";
+		}
+		bool traced = true;
+		std::string path;
+		if (!trace_file.empty())
+		{
+			size_t dot = trace_file.find_last_of('.');
+			size_t slash = trace_file.find_last_of("/\\");
+			if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+				dot = trace_file.size();
+			path = trace_file.substr(0, dot) + "." + std::to_string(++traced_moves) + trace_file.substr(dot);
+			traced = instrumentation::Registry::get_instance().write_trace(path);
+		}
+		instrumentation::Registry::get_instance().reset();
+		if (!traced)
+		{
+			std::lock_guard<std::mutex> lock(output_mutex);
+			std::cout << "info string could not write the trace to " << path << "\n";
+		}
+#endif
+	});
+
+	uci.receive_bench.connect([&](const std::size_t& simulations) {
+		run_bench(static_cast<int>(simulations));
 	});
 
+	// "crazyrabbit bench [simulations] [backend]" runs the bench without the UI
+	if (argc > 1 && std::string(argv[1]) == "bench")
+	{
+		if (argc > 3)
+			mcts.nnet.backend_type = (std::string(argv[3]) == "Synthetic") ? NNetBackendType::Synthetic : (std::string(argv[3]) == "AOT") ? NNetBackendType::AOT : NNetBackendType::TensorFlow;
+		run_bench((argc > 2) ? std::stoi(argv[2]) : default_bench_sims);
+		return 0;
+	}
+
 	// start communication with the UI through console
 	uci.launch();
 
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+	// the zones of all the moves of the run
+	std::cout << instrumentation::info_summary(true) << "info string run zones " << instrumentation::json_summary(true) << std::endl;
+#endif
 	return 0;
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <utility>
 #include <sstream>
 #include <list>
+#include <algorithm>
 #include "robin_hood/robin_hood.h"
 #include "types.h"
 #include "tables.h"
@@ -34,11 +35,35 @@ public:
 };
 
 
+//The number of pieces of one kind a pocket can hold, with one key for each count
+constexpr int NPOCKET_KEYS = 33;
+
+//The results returned by end_score(), from the perspective of the given side. A draw is slightly positive, so that
+//it can be told apart from a game that has not ended
+constexpr double END_SCORE_NONE = 0.0;
+constexpr double END_SCORE_DRAW = 1e-4;
+constexpr double END_SCORE_WIN = 1.0;
+constexpr double END_SCORE_LOSS = -1.0;
+
 namespace zobrist {
 	extern uint64_t zobrist_table[NPIECES][NSQUARES];
+	extern uint64_t pawn_table[NPIECES][NSQUARES];
+	extern uint64_t pocket_table[NPIECES][NPOCKET_KEYS];
+	extern uint64_t promoted_table[NSQUARES];
+	extern uint64_t castling_table[16];
+	extern uint64_t en_passant_table[8];
+	extern uint64_t side_key;
 	extern void initialise_zobrist_keys();
 }
 
+//Weights of the incrementally evaluated terms, from white's perspective (black pieces have negative weights).
+//They are filled in by the engine before any position is set up
+namespace eval_weights {
+	extern int material_table[NPIECES];
+	extern int hand_table[NPIECES];
+	extern int psq_table[NPIECES][NSQUARES];
+}
+
 //Stores position information which cannot be recovered on undo-ing a move
 struct UndoInfo {
 	//The bitboard of squares on which pieces have either moved from, or have been moved to. Used for castling
@@ -88,6 +113,14 @@ private:
 	//The zobrist hash of the position, which can be incrementally updated and rolled back after each
 	//make/unmake
 	uint64_t hash;
+
+	//The zobrist hash of only the pawns and kings, used to cache the pawn structure and king shelter evaluation
+	uint64_t pawn_hash;
+
+	//The material (on board and in pockets) and piece-square scores from white's perspective, which are
+	//incrementally updated and rolled back after each make/unmake
+	int material_score;
+	int psq_score;
 public:
 	//The history of non-recoverable information
 	//UndoInfo history[256];
@@ -104,12 +137,12 @@ public:
 	//The bitboard of pieces that have been promoted, updated whenever play() or undo() are called
 	Bitboard promoted;
 
-	//How many times a certain board position occured
-	robin_hood::unordered_map<std::string, int> repetitions;
+	//How many times a certain board position occured, keyed by the hash of the pieces and pockets
+	robin_hood::unordered_map<uint64_t, int> repetitions;
 	
 	
 	Position() : piece_bb{ 0 }, side_to_play(WHITE), game_ply(0), board{}, pocket{ {}, {} },
-		hash(0), pinned(0), checkers(0), promoted(0) {
+		hash(0), pawn_hash(0), material_score(0), psq_score(0), pinned(0), checkers(0), promoted(0) {
 		
 		//Sets all squares on the board as empty
 		for (int i = 0; i < 64; i++) board[i] = NO_PIECE;
@@ -129,15 +162,33 @@ public:
 		board[s] = pc;
 		piece_bb[pc] |= SQUARE_BB[s];
 		hash ^= zobrist::zobrist_table[pc][s];
+		pawn_hash ^= zobrist::pawn_table[pc][s];
+		material_score += eval_weights::material_table[pc];
+		psq_score += eval_weights::psq_table[pc][s];
 	}
 
 	//Removes a piece from a particular square and updates the hash. 
 	inline void remove_piece(Square s) {
 		hash ^= zobrist::zobrist_table[board[s]][s];
+		pawn_hash ^= zobrist::pawn_table[board[s]][s];
+		material_score -= eval_weights::material_table[board[s]];
+		psq_score -= eval_weights::psq_table[board[s]][s];
 		piece_bb[board[s]] &= ~SQUARE_BB[s];
 		board[s] = NO_PIECE;
 	}
 
+	//Adds a piece to the given player's pocket and updates the material score.
+	inline void add_to_pocket(Color c, PieceType pt) {
+		pocket[c][pt]++;
+		material_score += eval_weights::hand_table[make_piece(c, pt)];
+	}
+
+	//Removes a piece from the given player's pocket and updates the material score.
+	inline void remove_from_pocket(Color c, PieceType pt) {
+		pocket[c][pt]--;
+		material_score -= eval_weights::hand_table[make_piece(c, pt)];
+	}
+
 	void move_piece(Square from, Square to);
 	void move_piece_quiet(Square from, Square to);
 
@@ -147,6 +198,7 @@ public:
 	std::string fen() const;
 	std::string fen_hash() const;
 	std::string fen_board() const;
+	void compute_scores();
 
 	//Position& operator=(const Position&) = delete;
 	inline bool operator==(const Position& other) const { return hash == other.hash; }
@@ -165,6 +217,9 @@ public:
 		side_to_play = other.side_to_play;
 		game_ply = other.game_ply;
 		hash = other.hash;
+		pawn_hash = other.pawn_hash;
+		material_score = other.material_score;
+		psq_score = other.psq_score;
 
 		/*for (int i = 0; i <= game_ply; i++)
 			history[i] = other.history[i];*/
@@ -188,10 +243,21 @@ public:
 	inline Square en_passant() { return history.back().epsq; }
 	inline int halfmove_clock() { return history.back().halfmove_clock; }
 	inline int fullmove_number() { return history.back().fullmove_number; }
+	//The ply of the game taken from the move number, since ply() is not updated by the moves
+	inline int game_ply_number() { return 2 * (fullmove_number() - 1) + (side_to_play == BLACK ? 1 : 0); }
 	inline bool has_kingside_castling_rights(Color c) { return (c == WHITE) ? !(history.back().entry & WHITE_OO_MASK) : !(history.back().entry & BLACK_OO_MASK); }
 	inline bool has_queenside_castling_rights(Color c) { return (c == WHITE) ? !(history.back().entry & WHITE_OOO_MASK) : !(history.back().entry & BLACK_OOO_MASK); }
 	inline int ply() const { return game_ply; }
+	inline int repetition_count() const {
+		auto it = repetitions.find(board_hash());
+		return (it != repetitions.end()) ? it->second : 0;
+	}
 	inline uint64_t get_hash() const { return hash; }
+	inline uint64_t board_hash() const;
+	inline uint64_t full_hash() const;
+	inline uint64_t get_pawn_hash() const { return pawn_hash; }
+	inline int material() const { return material_score; }
+	inline int piece_square() const { return psq_score; }
 
 	template<Color C> inline Bitboard diagonal_sliders() const;
 	template<Color C> inline Bitboard orthogonal_sliders() const;
@@ -202,8 +268,8 @@ public:
 		return attackers_from<~C>(bsf(bitboard_of(C, KING)), all_pieces<WHITE>() | all_pieces<BLACK>());
 	}
 
-	template<Color C> void play(Move m);
-	template<Color C> void undo(Move m);
+	template<Color C, bool TrackRepetitions = true> void play(Move m);
+	template<Color C, bool TrackRepetitions = true> void undo(Move m);
 
 	template<Color Us>
 	Move *generate_legals(Move* list);
@@ -211,6 +277,15 @@ public:
 	template<Color Us>
 	move_vector<Move> generate_legals();
 
+	template<Color Us>
+	inline bool has_evasions() const;
+
+	template<Color Us>
+	inline bool gives_mate(Move m);
+
+	template<Color Us>
+	inline Move mate_in_one();
+
 	inline EndType is_checkmate();
 	inline bool is_insufficient_material();
 	inline bool is_seventyfive_moves();
@@ -258,8 +333,8 @@ inline Bitboard Position::attackers_from(Square s, Bitboard occ) const {
 		(attacks<ROOK>(s, occ) & (piece_bb[BLACK_ROOK] | piece_bb[BLACK_QUEEN]));
 }
 
-//Plays a move in the position
-template<Color C>
+//Plays a move in the position. Repetition tracking can be skipped for moves that are undone right away
+template<Color C, bool TrackRepetitions>
 void Position::play(const Move m) {
 	//++game_ply;
 	//history[game_ply] = UndoInfo(history[game_ply - 1]);
@@ -318,7 +393,7 @@ void Position::play(const Move m) {
 		move_piece_quiet(m.from(), m.to());
 		remove_piece(m.to() + relative_dir<C>(SOUTH));
 
-		pocket[C][PAWN]++;
+		add_to_pocket(C, PAWN);
 		history.back().promoted = false;
 
 		if (promoted & SQUARE_BB[m.from()]) {
@@ -357,10 +432,10 @@ void Position::play(const Move m) {
 		history.back().captured = board[m.to()];
 
 		if (promoted & SQUARE_BB[m.to()]) {
-			pocket[C][PAWN]++;
+			add_to_pocket(C, PAWN);
 			history.back().promoted = true;
 		} else {
-			pocket[C][type_of(board[m.to()])]++;
+			add_to_pocket(C, type_of(board[m.to()]));
 			history.back().promoted = false;
 		}
 		
@@ -377,10 +452,10 @@ void Position::play(const Move m) {
 		history.back().captured = board[m.to()];
 		
 		if (promoted & SQUARE_BB[m.to()]) {
-			pocket[C][PAWN]++;
+			add_to_pocket(C, PAWN);
 			history.back().promoted = true;
 		} else {
-			pocket[C][type_of(board[m.to()])]++;
+			add_to_pocket(C, type_of(board[m.to()]));
 			history.back().promoted = false;
 		}
 
@@ -397,10 +472,10 @@ void Position::play(const Move m) {
 		history.back().captured = board[m.to()];
 		
 		if (promoted & SQUARE_BB[m.to()]) {
-			pocket[C][PAWN]++;
+			add_to_pocket(C, PAWN);
 			history.back().promoted = true;
 		} else {
-			pocket[C][type_of(board[m.to()])]++;
+			add_to_pocket(C, type_of(board[m.to()]));
 			history.back().promoted = false;
 		}
 
@@ -417,10 +492,10 @@ void Position::play(const Move m) {
 		history.back().captured = board[m.to()];
 		
 		if (promoted & SQUARE_BB[m.to()]) {
-			pocket[C][PAWN]++;
+			add_to_pocket(C, PAWN);
 			history.back().promoted = true;
 		} else {
-			pocket[C][type_of(board[m.to()])]++;
+			add_to_pocket(C, type_of(board[m.to()]));
 			history.back().promoted = false;
 		}
 
@@ -435,11 +510,11 @@ void Position::play(const Move m) {
 		history.back().captured = board[m.to()];
 		
 		if (promoted & SQUARE_BB[m.to()]) {
-			pocket[C][PAWN]++;
+			add_to_pocket(C, PAWN);
 			history.back().promoted = true;
 			promoted &= ~SQUARE_BB[m.to()];
 		} else {
-			pocket[C][type_of(board[m.to()])]++;
+			add_to_pocket(C, type_of(board[m.to()]));
 			history.back().promoted = false;
 		}
 
@@ -451,43 +526,47 @@ void Position::play(const Move m) {
 		}
 		break;
 	case DROP_PAWN:
-		pocket[C][PAWN]--;
+		remove_from_pocket(C, PAWN);
 		put_piece(make_piece(C, PAWN), m.to());
 		break;
 	case DROP_KNIGHT:
-		pocket[C][KNIGHT]--;
+		remove_from_pocket(C, KNIGHT);
 		put_piece(make_piece(C, KNIGHT), m.to());
 		break;
 	case DROP_BISHOP:
-		pocket[C][BISHOP]--;
+		remove_from_pocket(C, BISHOP);
 		put_piece(make_piece(C, BISHOP), m.to());
 		break;
 	case DROP_ROOK:
-		pocket[C][ROOK]--;
+		remove_from_pocket(C, ROOK);
 		put_piece(make_piece(C, ROOK), m.to());
 		break;
 	case DROP_QUEEN:
-		pocket[C][QUEEN]--;
+		remove_from_pocket(C, QUEEN);
 		put_piece(make_piece(C, QUEEN), m.to());
 		break;
 	}
 
 	//Update the repetitions
-	std::string board_fen = fen_board();
-	if (!repetitions.contains(board_fen))
-		repetitions[board_fen] = 0;
-	else
-		repetitions[board_fen]++;
+	if constexpr (TrackRepetitions) {
+		uint64_t board_key = board_hash();
+		if (!repetitions.contains(board_key))
+			repetitions[board_key] = 0;
+		else
+			repetitions[board_key]++;
+	}
 }
 
 //Undos a move in the current position, rolling it back to the previous position
-template<Color C>
+template<Color C, bool TrackRepetitions>
 void Position::undo(const Move m) {
 	//Update the repetitions
-	std::string board_fen = fen_board();
-	repetitions[board_fen]--;
-	if (repetitions[board_fen] == 0)
-		repetitions.erase(board_fen);
+	if constexpr (TrackRepetitions) {
+		uint64_t board_key = board_hash();
+		repetitions[board_key]--;
+		if (repetitions[board_key] == 0)
+			repetitions.erase(board_key);
+	}
 
 	MoveFlags type = m.flags();
 	switch (type) {
@@ -524,7 +603,7 @@ void Position::undo(const Move m) {
 		move_piece_quiet(m.to(), m.from());
 		put_piece(make_piece(~C, PAWN), m.to() + relative_dir<C>(SOUTH));
 
-		pocket[C][PAWN]--;
+		remove_from_pocket(C, PAWN);
 
 		if (promoted & SQUARE_BB[m.to()]) {
 			promoted &= ~SQUARE_BB[m.to()];
@@ -549,9 +628,9 @@ void Position::undo(const Move m) {
 		put_piece(history.back().captured, m.to());
 
 		if (history.back().promoted) {
-			pocket[C][PAWN]--;
+			remove_from_pocket(C, PAWN);
 		} else {
-			pocket[C][type_of(history.back().captured)]--;
+			remove_from_pocket(C, type_of(history.back().captured));
 			promoted &= ~SQUARE_BB[m.to()];
 		}
 		break;
@@ -560,14 +639,14 @@ void Position::undo(const Move m) {
 		put_piece(history.back().captured, m.to());
 
 		if (history.back().promoted) {
-			pocket[C][PAWN]--;
+			remove_from_pocket(C, PAWN);
 
 			if (promoted & SQUARE_BB[m.to()])
 				promoted |= SQUARE_BB[m.from()];
 			else
 				promoted |= SQUARE_BB[m.to()];
 		} else {
-			pocket[C][type_of(history.back().captured)]--;
+			remove_from_pocket(C, type_of(history.back().captured));
 
 			if (promoted & SQUARE_BB[m.to()]) {
 				promoted &= ~SQUARE_BB[m.to()];
@@ -580,7 +659,7 @@ void Position::undo(const Move m) {
 	case DROP_BISHOP:
 	case DROP_ROOK:
 	case DROP_QUEEN:
-		pocket[C][type_of(board[m.to()])]++;
+		add_to_pocket(C, type_of(board[m.to()]));
 		remove_piece(m.to());
 		break;
 	}
@@ -1333,6 +1412,9 @@ move_vector<Move> Position::generate_legals() {
 	return list;
 }
 
+//Upper bound on the number of legal moves in a crazyhouse position (board moves and drops)
+constexpr int MAX_MOVES = 600;
+
 //A convenience class for interfacing with legal moves, rather than using the low-level
 //generate_legals() function directly. It can be iterated over.
 template<Color Us>
@@ -1344,11 +1426,218 @@ public:
 	const Move* end() const { return last; }
 	size_t size() const { return last - list; }
 private:
-	Move list[218];
+	Move list[MAX_MOVES];
 	Move *last;
 };
 
+//Returns true if the side to move, which must be in check, has a legal move. Mirrors the evasions
+//produced by generate_legals(), but stops at the first one found
+template<Color Us>
+inline bool Position::has_evasions() const {
+	constexpr Color Them = ~Us;
+
+	const Bitboard us_bb = all_pieces<Us>();
+	const Bitboard them_bb = all_pieces<Them>();
+	const Bitboard all = us_bb | them_bb;
+
+	const Square our_king = bsf(bitboard_of(Us, KING));
+	const Square their_king = bsf(bitboard_of(Them, KING));
+
+	Bitboard b1, b2;
+	Square s;
+
+	//Squares that our king cannot move to
+	Bitboard danger = pawn_attacks<Them>(bitboard_of(Them, PAWN)) | attacks<KING>(their_king, all);
+
+	b1 = bitboard_of(Them, KNIGHT);
+	while (b1) danger |= attacks<KNIGHT>(pop_lsb(&b1), all);
+
+	b1 = diagonal_sliders<Them>();
+	while (b1) danger |= attacks<BISHOP>(pop_lsb(&b1), all ^ SQUARE_BB[our_king]);
+
+	b1 = orthogonal_sliders<Them>();
+	while (b1) danger |= attacks<ROOK>(pop_lsb(&b1), all ^ SQUARE_BB[our_king]);
+
+	//The king can step out of check or capture the checker
+	if (attacks<KING>(our_king, all) & ~(us_bb | danger))
+		return true;
+
+	//Identify checkers and pinned pieces the same way as generate_legals()
+	Bitboard our_checkers = (attacks<KNIGHT>(our_king, all) & bitboard_of(Them, KNIGHT))
+		| (pawn_attacks<Us>(our_king) & bitboard_of(Them, PAWN));
+
+	Bitboard candidates = (attacks<ROOK>(our_king, them_bb) & orthogonal_sliders<Them>())
+		| (attacks<BISHOP>(our_king, them_bb) & diagonal_sliders<Them>());
+
+	Bitboard our_pinned = 0;
+	while (candidates) {
+		s = pop_lsb(&candidates);
+		b1 = SQUARES_BETWEEN_BB[our_king][s] & us_bb;
+
+		if (b1 == 0) our_checkers ^= SQUARE_BB[s];
+		else if ((b1 & (b1 - 1)) == 0) our_pinned ^= b1;
+	}
+
+	const Bitboard not_pinned = ~our_pinned;
+
+	//If there is a double check, the only legal moves are king moves
+	if (sparse_pop_count(our_checkers) != 1)
+		return false;
+
+	const Square checker_square = bsf(our_checkers);
+
+	//Any non-pinned piece may capture the checker
+	if (attackers_from<Us>(checker_square, all) & not_pinned)
+		return true;
+
+	switch (board[checker_square]) {
+	case make_piece(Them, PAWN):
+		//The checker may have just double pushed and be captured e.p.
+		if (our_checkers == shift<relative_dir<Us>(SOUTH)>(SQUARE_BB[history.back().epsq]))
+			return pawn_attacks<Them>(history.back().epsq) & bitboard_of(Us, PAWN) & not_pinned;
+		return false;
+	case make_piece(Them, KNIGHT):
+		return false;
+	default:
+		break;
+	}
+
+	//The checker is a slider, so the check can also be blocked
+	const Bitboard block_mask = SQUARES_BETWEEN_BB[our_king][checker_square];
+	if (!block_mask)
+		return false;
+
+	//...by dropping a piece in between
+	for (int piece = PAWN; piece <= QUEEN; piece++) {
+		if (pocket[Us][piece]) {
+			if (piece != PAWN || block_mask & ~(MASK_RANK[RANK8] | MASK_RANK[RANK1]))
+				return true;
+		}
+	}
+
+	//...or by moving a piece in between
+	b1 = bitboard_of(Us, KNIGHT) & not_pinned;
+	while (b1) if (attacks<KNIGHT>(pop_lsb(&b1), all) & block_mask) return true;
+
+	b1 = diagonal_sliders<Us>() & not_pinned;
+	while (b1) if (attacks<BISHOP>(pop_lsb(&b1), all) & block_mask) return true;
+
+	b1 = orthogonal_sliders<Us>() & not_pinned;
+	while (b1) if (attacks<ROOK>(pop_lsb(&b1), all) & block_mask) return true;
+
+	//Single and double pawn pushes, including quiet promotions
+	b1 = bitboard_of(Us, PAWN) & not_pinned;
+	b2 = shift<relative_dir<Us>(NORTH)>(b1) & ~all;
+	if (b2 & block_mask)
+		return true;
+
+	b2 = shift<relative_dir<Us>(NORTH)>(b2 & MASK_RANK[relative_rank<Us>(RANK3)]) & block_mask;
+	return b2 != 0;
+}
+
+//Returns true if the given legal move checkmates the opponent
+template<Color Us>
+inline bool Position::gives_mate(const Move m) {
+	play<Us, false>(m);
+	bool mate = in_check<~Us>() && !has_evasions<~Us>();
+	undo<Us, false>(m);
+	return mate;
+}
+
+//Returns a move that checkmates the opponent, or a null move if there is none. Only moves that can give check
+//are played: drops onto the squares attacking the enemy king first, then board moves that give a direct or
+//discovered check
+template<Color Us>
+inline Move Position::mate_in_one() {
+	constexpr Color Them = ~Us;
+
+	const Bitboard all = all_pieces<WHITE>() | all_pieces<BLACK>();
+	const Square their_king = bsf(bitboard_of(Them, KING));
+
+	//Squares from which each piece type would attack the enemy king
+	Bitboard check_squares[NPIECE_TYPES];
+	check_squares[PAWN] = pawn_attacks<Them>(their_king);
+	check_squares[KNIGHT] = attacks<KNIGHT>(their_king, all);
+	check_squares[BISHOP] = attacks<BISHOP>(their_king, all);
+	check_squares[ROOK] = attacks<ROOK>(their_king, all);
+	check_squares[QUEEN] = check_squares[BISHOP] | check_squares[ROOK];
+	check_squares[KING] = 0;
+
+	//Our pieces that are the only blocker between one of our sliders and the enemy king
+	Bitboard discoverers = 0;
+	Bitboard snipers = (attacks<BISHOP>(their_king, 0) & diagonal_sliders<Us>())
+		| (attacks<ROOK>(their_king, 0) & orthogonal_sliders<Us>());
+	while (snipers) {
+		Bitboard b = SQUARES_BETWEEN_BB[their_king][pop_lsb(&snipers)] & all;
+		if (sparse_pop_count(b) == 1)
+			discoverers |= b & all_pieces<Us>();
+	}
+
+	//Drops next to or in line with the enemy king. Drops are legal on any empty square unless we are in check
+	if (!in_check<Us>()) {
+		static constexpr MoveFlags drops[] = { DROP_PAWN, DROP_KNIGHT, DROP_BISHOP, DROP_ROOK, DROP_QUEEN };
+		for (int piece = PAWN; piece <= QUEEN; piece++) {
+			if (!pocket[Us][piece])
+				continue;
+
+			Bitboard to = check_squares[piece] & ~all;
+			if (piece == PAWN)
+				to &= ~(MASK_RANK[RANK8] | MASK_RANK[RANK1]);
+
+			while (to) {
+				Square s = pop_lsb(&to);
+				Move m(s, s, drops[piece]);
+				if (gives_mate<Us>(m))
+					return m;
+			}
+		}
+	}
+
+	//Board moves (and drops that block a check on our king)
+	Move list[MAX_MOVES];
+	Move* last = generate_legals<Us>(list);
+	for (Move* m = list; m != last; ++m) {
+		MoveFlags flags = m->flags();
+		bool candidate;
+
+		if (flags >= DROP_PAWN && flags <= DROP_QUEEN) {
+			candidate = in_check<Us>() && check_squares[flags - DROP_PAWN] & SQUARE_BB[m->to()];
+		} else if (flags == OO || flags == OOO || flags == EN_PASSANT || (flags >= PR_KNIGHT && flags <= PC_QUEEN)) {
+			candidate = true;
+		} else {
+			candidate = check_squares[type_of(board[m->from()])] & SQUARE_BB[m->to()] ||
+				(discoverers & SQUARE_BB[m->from()] && !(LINE[m->from()][their_king] & SQUARE_BB[m->to()]));
+		}
+
+		if (candidate && gives_mate<Us>(*m))
+			return *m;
+	}
+
+	return Move();
+}
+
 inline EndType Position::is_checkmate() {
+	bool check;
+	if (side_to_play == WHITE)
+		check = in_check<WHITE>();
+	else
+		check = in_check<BLACK>();
+
+	if (check) {
+		bool can_move = (side_to_play == WHITE) ? has_evasions<WHITE>() : has_evasions<BLACK>();
+
+		//Checkmate
+		return can_move ? NONE : CHECKMATE;
+	}
+
+	//Any drop onto an empty square is legal when not in check
+	const Bitboard empty = ~(all_pieces<WHITE>() | all_pieces<BLACK>());
+	for (int piece = PAWN; piece <= QUEEN; piece++) {
+		Bitboard to = (piece == PAWN) ? empty & ~(MASK_RANK[RANK8] | MASK_RANK[RANK1]) : empty;
+		if (pocket[side_to_play][piece] && to)
+			return NONE;
+	}
+
 	bool can_move;
 	if (side_to_play == WHITE) {
 		can_move = (generate_legals<WHITE>().size()) ? true : false;
@@ -1356,23 +1645,8 @@ inline EndType Position::is_checkmate() {
 		can_move = (generate_legals<BLACK>().size()) ? true : false;
 	}
 
-	if (!can_move) {
-		bool check;
-		if (side_to_play == WHITE)
-			check = in_check<WHITE>();
-		else
-			check = in_check<BLACK>();
-
-		if (check)
-			//Checkmate
-			return CHECKMATE;
-		else
-			//Stalemate
-			return STALEMATE;
-	} else {
-		//Not end game
-		return NONE;
-	}
+	//Stalemate
+	return can_move ? NONE : STALEMATE;
 }
 
 inline bool Position::is_insufficient_material() {
@@ -1419,8 +1693,8 @@ inline bool Position::is_seventyfive_moves() {
 }
 
 inline bool Position::is_fivefold_repetition() {
-	std::string board_fen = fen_board();
-	if (repetitions.contains(board_fen) && repetitions[board_fen] >= 4)
+	uint64_t board_key = board_hash();
+	if (repetitions.contains(board_key) && repetitions[board_key] >= 4)
 		return true;
 	return false;
 }
@@ -1428,19 +1702,11 @@ inline bool Position::is_fivefold_repetition() {
 //Check if reached end of game and returnes the score that the player got
 template<Color Us>
 inline double Position::end_score() {
-	constexpr double not_ended = 0.0;
-	constexpr double draw = 1e-4;
-	double score;
-	if (Us == side_to_play)
-		score = 1.0;
-	else
-		score = -1.0;
-
 	switch (is_checkmate()) {
 	case CHECKMATE:
-		return -score;
+		return (Us == side_to_play) ? END_SCORE_LOSS : END_SCORE_WIN;
 	case STALEMATE:
-		return draw;
+		return END_SCORE_DRAW;
 	}
 
 	//if (is_insufficient_material())
@@ -1450,9 +1716,9 @@ inline double Position::end_score() {
 	//	return draw;
 
 	if (is_fivefold_repetition())
-		return draw;
+		return END_SCORE_DRAW;
 
-	return not_ended;
+	return END_SCORE_NONE;
 }
 
 
@@ -1462,12 +1728,96 @@ inline double Position::end_score() {
 //Used to incrementally update the hash key of a position
 uint64_t zobrist::zobrist_table[NPIECES][NSQUARES];
 
+//The same keys for pawns and kings, and zero for all other pieces
+uint64_t zobrist::pawn_table[NPIECES][NSQUARES];
+
+//Keys for the rest of the position, only used by the full hash
+uint64_t zobrist::pocket_table[NPIECES][NPOCKET_KEYS];
+uint64_t zobrist::promoted_table[NSQUARES];
+uint64_t zobrist::castling_table[16];
+uint64_t zobrist::en_passant_table[8];
+uint64_t zobrist::side_key;
+
 //Initializes the zobrist table with random 64-bit numbers
+//The keys are always generated in the same order from the same seed, since opening books store them
 void zobrist::initialise_zobrist_keys() {
 	PRNG rng(70026072);
-	for (int i = 0; i < NPIECES; i++)
-		for (int j = 0; j < NSQUARES; j++)
+	for (size_t i = 0; i < NPIECES; i++)
+		for (size_t j = 0; j < NSQUARES; j++)
 			zobrist::zobrist_table[i][j] = rng.rand<uint64_t>();
+
+	for (size_t i = 0; i < NPIECES; i++)
+		for (size_t j = 0; j < NSQUARES; j++)
+			zobrist::pawn_table[i][j] = (i != NO_PIECE && (type_of(Piece(i)) == PAWN || type_of(Piece(i)) == KING)) ? zobrist::zobrist_table[i][j] : 0;
+
+	for (size_t i = 0; i < NPIECES; i++)
+		for (int j = 0; j < NPOCKET_KEYS; j++)
+			zobrist::pocket_table[i][j] = rng.rand<uint64_t>();
+
+	for (size_t i = 0; i < NSQUARES; i++)
+		zobrist::promoted_table[i] = rng.rand<uint64_t>();
+
+	for (int i = 0; i < 16; i++)
+		zobrist::castling_table[i] = rng.rand<uint64_t>();
+
+	for (int i = 0; i < 8; i++)
+		zobrist::en_passant_table[i] = rng.rand<uint64_t>();
+
+	zobrist::side_key = rng.rand<uint64_t>();
+}
+
+//Returns the zobrist hash of the pieces and the pockets, the same part of the position as fen_board()
+inline uint64_t Position::board_hash() const {
+	uint64_t key = hash;
+
+	for (int color = WHITE; color <= BLACK; color++)
+		for (size_t piece = PAWN; piece < NPIECE_TYPES - 1; piece++)
+			if (pocket[color][piece])
+				key ^= zobrist::pocket_table[make_piece(Color(color), PieceType(piece))][std::min(pocket[color][piece], NPOCKET_KEYS - 1)];
+
+	return key;
+}
+
+//Returns the zobrist hash of the whole position: the pieces, side to move, castling rights, en passant file,
+//pockets and promoted pieces. Only the pieces are hashed incrementally, the rest is added on every call
+inline uint64_t Position::full_hash() const {
+	uint64_t key = board_hash();
+
+	Bitboard b = promoted;
+	while (b) key ^= zobrist::promoted_table[pop_lsb(&b)];
+
+	const Bitboard entry = history.back().entry;
+	key ^= zobrist::castling_table[((entry & WHITE_OO_MASK) ? 0 : 1) | ((entry & WHITE_OOO_MASK) ? 0 : 2)
+		| ((entry & BLACK_OO_MASK) ? 0 : 4) | ((entry & BLACK_OOO_MASK) ? 0 : 8)];
+
+	if (history.back().epsq != NO_SQUARE)
+		key ^= zobrist::en_passant_table[file_of(history.back().epsq)];
+
+	if (side_to_play == BLACK)
+		key ^= zobrist::side_key;
+
+	return key;
+}
+
+//Incremental evaluation weights, filled in by the engine
+int eval_weights::material_table[NPIECES];
+int eval_weights::hand_table[NPIECES];
+int eval_weights::psq_table[NPIECES][NSQUARES];
+
+//Recomputes the material and piece-square scores from scratch
+void Position::compute_scores() {
+	material_score = 0;
+	psq_score = 0;
+
+	for (int s = a1; s <= h8; s++) {
+		material_score += eval_weights::material_table[board[s]];
+		psq_score += eval_weights::psq_table[board[s]][s];
+	}
+
+	for (int pt = PAWN; pt <= QUEEN; pt++) {
+		material_score += pocket[WHITE][pt] * eval_weights::hand_table[make_piece(WHITE, PieceType(pt))];
+		material_score += pocket[BLACK][pt] * eval_weights::hand_table[make_piece(BLACK, PieceType(pt))];
+	}
 }
 
 //Pretty-prints the position (including FEN and hash key)
@@ -1650,6 +2000,7 @@ void Position::set(const std::string& fen, Position& p) {
 	std::string info = fen.substr(fen.find(' ') + 1);
 	char color = info[0];
 	p.side_to_play = color == 'w' ? WHITE : BLACK;
+	p.compute_scores();
 
 	info = info.substr(info.find(' ') + 1);
 	p.history.back().entry = ALL_CASTLING_MASK;
@@ -1702,7 +2053,7 @@ void Position::set(const std::string& fen, Position& p) {
 	p.history.back().fullmove_number = std::stoi(num2.str());
 
 	p.repetitions.clear();
-	p.repetitions[p.fen_board()] = 0;
+	p.repetitions[p.board_hash()] = 0;
 }
 
 //Returns the string representation that can be used as a hash
@@ -1787,6 +2138,11 @@ std::string Position::fen_board() const {
 void Position::move_piece(Square from, Square to) {
 	hash ^= zobrist::zobrist_table[board[from]][from] ^ zobrist::zobrist_table[board[from]][to]
 		^ zobrist::zobrist_table[board[to]][to];
+	pawn_hash ^= zobrist::pawn_table[board[from]][from] ^ zobrist::pawn_table[board[from]][to]
+		^ zobrist::pawn_table[board[to]][to];
+	material_score -= eval_weights::material_table[board[to]];
+	psq_score += eval_weights::psq_table[board[from]][to] - eval_weights::psq_table[board[from]][from]
+		- eval_weights::psq_table[board[to]][to];
 	Bitboard mask = SQUARE_BB[from] | SQUARE_BB[to];
 	piece_bb[board[from]] ^= mask;
 	piece_bb[board[to]] &= ~mask;
@@ -1797,6 +2153,8 @@ void Position::move_piece(Square from, Square to) {
 //Moves a piece to an empty square. Note that it is an error if the <to> square contains a piece
 void Position::move_piece_quiet(Square from, Square to) {
 	hash ^= zobrist::zobrist_table[board[from]][from] ^ zobrist::zobrist_table[board[from]][to];
+	pawn_hash ^= zobrist::pawn_table[board[from]][from] ^ zobrist::pawn_table[board[from]][to];
+	psq_score += eval_weights::psq_table[board[from]][to] - eval_weights::psq_table[board[from]][from];
 	piece_bb[board[from]] ^= (SQUARE_BB[from] | SQUARE_BB[to]);
 	board[to] = board[from];
 	board[from] = NO_PIECE;
@@ -53,6 +53,7 @@ constexpr uint16_t DROP_MOVE_START = 76U;
 constexpr uint16_t MOVES_PER_SQUARE = 81U;
 
 const size_t NPIECE_TYPES = 6;
+const size_t NDROP_TYPES = 5;
 enum PieceType : int {
 	PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING
 };
@@ -191,6 +192,24 @@ class move_vector : public std::vector<T>
 public:
 	long n_visits = 0L;
 	double end_score = 0.0;
+	bool policy_enhanced = false;
+
+	//If drops are grouped, the moves are ordered as [board moves][pawn drops]...[queen drops] and
+	//each group of drops is summarized by an aggregate node in drop_groups. The groups are only
+	//allocated when the drops are grouped, other nodes keep two empty vectors
+	bool grouped_drops = false;
+	size_t num_board_moves = 0;
+	std::vector<T> drop_groups;
+	std::vector<size_t> drop_group_end;
+
+	//Aggregated value of the node from the perspective of the side to move and the shared child
+	//node of each move, used by graph search
+	double Q_value = 0.0;
+	long value_visits = 0L;
+	std::vector<move_vector*> children;
+
+	//Simulation in which the node was last visited, used to prune the tree
+	long last_visit = 0L;
 };
 
 
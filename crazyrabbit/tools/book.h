@@ -0,0 +1,131 @@
+/*
+	Opening book building for the CrazyRabbit tools.
+
+	Counts the moves of PGN collections and of books in the old text format for the positions they were
+	played in, and writes the counted moves as the binary opening book read by the engine.
+*/
+
+#ifndef CRAZYRABBIT_BOOK_H
+#define CRAZYRABBIT_BOOK_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "pgn.h"
+
+namespace crazyrabbit
+{
+	struct BookMove
+	{
+		uint64_t key;
+		uint16_t move;
+
+		bool operator==(const BookMove& other) const { return key == other.key && move == other.move; }
+	};
+
+	struct BookMoveHash
+	{
+		size_t operator()(const BookMove& book_move) const { return robin_hood::hash<uint64_t>()(book_move.key ^ (static_cast<uint64_t>(book_move.move) * 0x9E3779B97F4A7C15ULL)); }
+	};
+
+	struct BookMoveStats
+	{
+		uint32_t games = 0;
+		uint32_t score = 0;
+	};
+
+	typedef robin_hood::unordered_flat_map<BookMove, BookMoveStats, BookMoveHash> BookStats_t;
+
+	//Counts the moves of all games in a PGN file, weighted by the game's result from the perspective of the side that played them
+	//(2 for a win, 1 for a draw or an unknown result, 0 for a loss). Returns the number of games read.
+	inline long read_pgn(std::istream& in, BookStats_t& stats, const int max_plies, long& errors)
+	{
+		PGNReader reader(in);
+		PGNGame game;
+		Board board;
+		long games = 0;
+
+		while (reader.next(game))
+		{
+			auto variant = game.tags.find("Variant");
+			if (variant != game.tags.end() && variant->second != "Crazyhouse" && variant->second != "crazyhouse")
+				continue;
+
+			game.set_up(board);
+			for (int ply = 0; ply < max_plies && ply < static_cast<int>(game.moves.size()); ply++)
+			{
+				Move move = san_to_move(board, game.moves[ply]);
+				if (move.from() == NO_SQUARE)
+				{
+					errors++;
+					break;
+				}
+
+				double score = game.score(board.p.turn());
+				BookMoveStats& move_stats = stats[BookMove{ board.p.full_hash(), move.hash() }];
+				move_stats.games++;
+				move_stats.score += (score < 0.0) ? 1U : static_cast<uint32_t>(2.0 * score);
+
+				board.push(move);
+			}
+
+			if (++games % 10000 == 0)
+				std::cerr << "  " << games << " games\n";
+		}
+
+		return games;
+	}
+
+	//Counts the moves of a book in the old text format. Returns the number of positions read.
+	inline long read_text_book(std::istream& in, BookStats_t& stats, long& errors)
+	{
+		std::vector<BookEntry> book;
+		long positions = Openings::read_text(in, book, errors);
+		for (const BookEntry& entry : book)
+		{
+			BookMoveStats& move_stats = stats[BookMove{ entry.key, entry.move }];
+			move_stats.games++;
+			move_stats.score += entry.weight;
+		}
+
+		return positions;
+	}
+
+	//Returns the book entries of the moves played in at least the given number of games, sorted by key for the binary search
+	//and by weight within a position.
+	inline std::vector<BookEntry> book_entries(const BookStats_t& stats, const uint32_t min_games)
+	{
+		std::vector<BookEntry> entries;
+		entries.reserve(stats.size());
+		for (const auto& [book_move, move_stats] : stats)
+		{
+			if (move_stats.games >= min_games && move_stats.score > 0U)
+				entries.push_back(BookEntry{ book_move.key, move_stats.score, book_move.move, 0 });
+		}
+
+		std::sort(entries.begin(), entries.end(), [](const BookEntry& a, const BookEntry& b) {
+			return (a.key != b.key) ? a.key < b.key : (a.weight != b.weight) ? a.weight > b.weight : a.move < b.move;
+		});
+		return entries;
+	}
+
+	//Writes the entries as a binary book. Returns false if the file cannot be written.
+	inline bool write_book(const std::string& path, const std::vector<BookEntry>& entries)
+	{
+		std::ofstream out(path, std::ios::binary);
+		if (!out.is_open())
+			return false;
+
+		BookHeader header;
+		std::copy(book_magic, book_magic + 4, header.magic);
+		header.version = book_version;
+		header.num_entries = entries.size();
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(BookEntry)));
+		return static_cast<bool>(out);
+	}
+}
+
+#endif
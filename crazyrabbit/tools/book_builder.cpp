@@ -0,0 +1,73 @@
+/*
+	Opening book builder for CrazyRabbit.
+
+	Compiles PGN collections into the binary opening book read by the engine. Every move played in the
+	first plies of a game is counted for the position it was played in, weighted by the game's result from
+	the perspective of the side that played it (2 for a win, 1 for a draw or an unknown result, 0 for a loss).
+	Files ending in .txt are read in the old text format of the book, one position per line, given as a FEN,
+	followed by a semicolon and a comma separated list of moves in UCI notation.
+
+	Usage: book_builder [--plies N] [--min-games N] <output book> <input files...>
+*/
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include "book.h"
+
+using namespace crazyrabbit;
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	int max_plies = 24;
+	uint32_t min_games = 1;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--plies" && i + 1 < argc)
+			max_plies = std::stoi(argv[++i]);
+		else if (arg == "--min-games" && i + 1 < argc)
+			min_games = static_cast<uint32_t>(std::stoul(argv[++i]));
+		else
+			paths.push_back(arg);
+	}
+
+	if (paths.size() < 2)
+	{
+		std::cerr << "Usage: book_builder [--plies N] [--min-games N] <output book> <input files...>\n";
+		return 1;
+	}
+
+	BookStats_t stats;
+	long errors = 0;
+	for (size_t i = 1; i < paths.size(); i++)
+	{
+		std::ifstream in(paths[i]);
+		if (!in.is_open())
+		{
+			std::cerr << "Could not open " << paths[i] << "\n";
+			return 1;
+		}
+
+		std::cerr << "Reading " << paths[i] << "\n";
+		bool text_book = paths[i].size() >= 4 && paths[i].compare(paths[i].size() - 4, 4, ".txt") == 0;
+		long read = text_book ? read_text_book(in, stats, errors) : read_pgn(in, stats, max_plies, errors);
+		std::cerr << "  " << read << (text_book ? " positions\n" : " games\n");
+	}
+
+	std::vector<BookEntry> entries = book_entries(stats, min_games);
+	if (!write_book(paths[0], entries))
+	{
+		std::cerr << "Could not write " << paths[0] << "\n";
+		return 1;
+	}
+
+	std::cerr << "Wrote " << entries.size() << " entries to " << paths[0] << " (" << errors << " moves could not be read)\n";
+	return 0;
+}
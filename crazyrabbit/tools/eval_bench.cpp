@@ -0,0 +1,268 @@
+/*
+	Evaluation benchmark for CrazyRabbit.
+
+	Measures what each value correction feature and each policy enhancement costs per position, so that the
+	features can be weighed against the simulations per second they take away. The corpus is made of the
+	positions of the given PGN games or, without games, of the bench positions and the positions one and two
+	plies after them. Every function is run on every position of the corpus several times. The time stamp
+	counter is read around each call, its own cost is subtracted, and the ticks are converted to nanoseconds
+	with the frequency measured at startup (on processors without the counter both columns are nanoseconds).
+	Like in Evaluator::eval(), the attack tables of a position are filled in before its features are timed,
+	and update_tables() is timed on its own. The policy enhancements run on a copy of the legal moves, with
+	priors from the synthetic backend.
+
+	Usage: eval_bench [--positions N] [--repeat N] [games.pgn ...]
+*/
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include "pgn.h"
+
+using namespace crazyrabbit;
+
+struct Sample
+{
+	Board board;
+	move_vector<Move> moves;    // legal moves with normalized priors
+};
+
+volatile double sink = 0.0;
+
+//Returns the number of ticks per nanosecond, measured over a short busy wait.
+double ticks_per_ns()
+{
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	uint64_t begin_ticks = instrumentation::read_ticks();
+	while (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(200));
+	uint64_t end_ticks = instrumentation::read_ticks();
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	return static_cast<double>(end_ticks - begin_ticks) / static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+}
+
+//Adds the position with the legal moves and their priors to the corpus.
+void add_sample(std::vector<Sample>& corpus, Board& board, SyntheticBackend& backend)
+{
+	Sample sample{ board, board.legal_moves() };
+	auto [policy, value] = backend.predict(board);
+
+	double sum_policy = 0.0;
+	for (Move& move : sample.moves)
+	{
+		move.policy = static_cast<double>(policy[move.hash()]);
+		sum_policy += move.policy;
+	}
+	for (Move& move : sample.moves)
+		move.policy /= sum_policy;
+
+	if (!sample.moves.empty())
+		corpus.push_back(std::move(sample));
+}
+
+//Adds the positions of the games that are played before each move.
+bool load_games(const std::vector<std::string>& paths, const size_t limit, std::vector<Sample>& corpus, SyntheticBackend& backend)
+{
+	for (const std::string& path : paths)
+	{
+		std::ifstream in(path);
+		if (!in.is_open())
+		{
+			std::cerr << "Could not open " << path << "\n";
+			return false;
+		}
+
+		PGNReader reader(in);
+		PGNGame game;
+		Board board;
+		while (corpus.size() < limit && reader.next(game))
+		{
+			game.set_up(board);
+			for (const std::string& san : game.moves)
+			{
+				Move move = san_to_move(board, san);
+				if (move.from() == NO_SQUARE || corpus.size() == limit)
+					break;
+
+				add_sample(corpus, board, backend);
+				board.push(move);
+			}
+		}
+	}
+
+	return true;
+}
+
+//Adds the bench positions and the positions one and two plies after them.
+void load_bench_positions(const size_t limit, std::vector<Sample>& corpus, SyntheticBackend& backend)
+{
+	std::vector<Board> ply(bench_positions.size());
+	for (size_t i = 0; i < bench_positions.size(); i++)
+		ply[i].set_fen(bench_positions[i]);
+
+	for (int depth = 0; depth < 3 && corpus.size() < limit; depth++)
+	{
+		std::vector<Board> next;
+		for (Board& board : ply)
+		{
+			if (corpus.size() == limit)
+				break;
+			add_sample(corpus, board, backend);
+
+			for (Move& move : board.legal_moves())
+			{
+				next.push_back(board);
+				next.back().push(move);
+			}
+		}
+		ply = std::move(next);
+	}
+}
+
+class EvalBench
+{
+public:
+	EvalBench(std::vector<Sample>& corpus, const int repeat) : corpus(corpus), repeat(repeat), tick_rate(ticks_per_ns())
+	{
+		overhead = 0.0;
+		overhead = measure([](Sample&) {}, [](Sample&) { return 0.0; });
+	}
+
+	//Times the function on every position of the corpus, after the untimed setup of the position. Returns the ticks per position.
+	template <typename Setup, typename Function>
+	inline double measure(Setup setup, Function function);
+
+	//Prints the cost of the function per position.
+	template <typename Setup, typename Function>
+	inline void report(const std::string& name, Setup setup, Function function);
+
+private:
+	std::vector<Sample>& corpus;
+	int repeat;
+	double tick_rate;
+	double overhead;
+};
+
+template <typename Setup, typename Function>
+inline double EvalBench::measure(Setup setup, Function function)
+{
+	uint64_t ticks = 0ULL;
+	for (int r = 0; r < repeat; r++)
+	{
+		for (Sample& sample : corpus)
+		{
+			setup(sample);
+			uint64_t begin = instrumentation::read_ticks();
+			sink = function(sample);
+			uint64_t end = instrumentation::read_ticks();
+			ticks += end - begin;
+		}
+	}
+
+	return std::max(0.0, static_cast<double>(ticks) / static_cast<double>(repeat * corpus.size()) - overhead);
+}
+
+template <typename Setup, typename Function>
+inline void EvalBench::report(const std::string& name, Setup setup, Function function)
+{
+	double ticks = measure(setup, function);
+	std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << ticks / tick_rate << std::setw(16) << ticks << "\n";
+}
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	size_t limit = 10000;
+	int repeat = 3;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--positions" && i + 1 < argc)
+			limit = std::max<size_t>(1, std::stoul(argv[++i]));
+		else if (arg == "--repeat" && i + 1 < argc)
+			repeat = std::max(1, std::stoi(argv[++i]));
+		else if (arg.rfind("--", 0) == 0)
+		{
+			std::cerr << "Usage: eval_bench [--positions N] [--repeat N] [games.pgn ...]\n";
+			return 1;
+		}
+		else
+			paths.push_back(arg);
+	}
+
+	SyntheticBackend backend(0);
+	std::vector<Sample> corpus;
+	if (paths.empty())
+		load_bench_positions(limit, corpus, backend);
+	else if (!load_games(paths, limit, corpus, backend))
+		return 1;
+
+	if (corpus.empty())
+	{
+		std::cerr << "No positions to measure\n";
+		return 1;
+	}
+
+	size_t num_moves = 0;
+	size_t num_drops = 0;
+	for (Sample& sample : corpus)
+	{
+		num_moves += sample.moves.size();
+		for (Move& move : sample.moves)
+			num_drops += (move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN) ? 1 : 0;
+	}
+
+	EvalBench bench(corpus, repeat);
+	std::cout << corpus.size() << " positions, " << std::fixed << std::setprecision(1) << static_cast<double>(num_moves) / corpus.size() << " legal moves and "
+		<< static_cast<double>(num_drops) / corpus.size() << " drops on average, " << repeat << " runs\n\n";
+	std::cout << std::left << std::setw(32) << "function" << std::right << std::setw(14) << "ns/position" << std::setw(16) << "ticks/position" << "\n";
+
+	Evaluator eval;
+	auto no_setup = [](Sample&) {};
+	auto tables = [&](Sample& sample) { eval.update_tables(sample.board); };
+	eval.pawn_cache.reset_stats();
+
+	bench.report("Evaluator::update_tables", no_setup, [&](Sample& sample) { eval.update_tables(sample.board); return 0.0; });
+	bench.report("Evaluator::material", tables, [&](Sample& sample) { return eval.material(sample.board); });
+	bench.report("Evaluator::pawn_structure", tables, [&](Sample& sample) { return eval.pawn_structure(sample.board); });
+	bench.report("Evaluator::king_safety", tables, [&](Sample& sample) { return eval.king_safety(sample.board); });
+	bench.report("Evaluator::piece_placement", tables, [&](Sample& sample) { return eval.piece_placement(sample.board); });
+	bench.report("Evaluator::board_control", tables, [&](Sample& sample) { return eval.board_control(sample.board); });
+
+	eval.add_eval(material_mask | pawn_structure_mask | king_safety_mask | piece_placement_mask | board_control_mask);
+	bench.report("Evaluator::eval (all features)", no_setup, [&](Sample& sample) { return eval.eval(sample.board); });
+
+	//The enhancements change the priors, so they work on a fresh copy every time.
+	move_vector<Move> moves;
+	auto copy_moves = [&](Sample& sample) { moves = sample.moves; };
+	bench.report("enhance_policy_dirichlet", copy_moves, [&](Sample& sample) { enhance_policy_dirichlet(sample.board, moves); return moves.front().policy; });
+	bench.report("enhance_policy<dropping>", copy_moves, [&](Sample& sample) { enhance_policy<dropping_moves_mask>(sample.board, moves); return moves.front().policy; });
+	bench.report("enhance_policy<checking>", copy_moves, [&](Sample& sample) { enhance_policy<checking_moves_mask>(sample.board, moves); return moves.front().policy; });
+	bench.report("enhance_policy<forking>", copy_moves, [&](Sample& sample) { enhance_policy<forking_moves_mask>(sample.board, moves); return moves.front().policy; });
+	bench.report("enhance_policy<capturing>", copy_moves, [&](Sample& sample) { enhance_policy<capturing_moves_mask>(sample.board, moves); return moves.front().policy; });
+	bench.report("enhance_policy<all>", copy_moves, [&](Sample& sample) {
+		enhance_policy<dropping_moves_mask | checking_moves_mask | forking_moves_mask | capturing_moves_mask>(sample.board, moves);
+		return moves.front().policy;
+	});
+
+	bench.report("Board::eval_drop (all drops)", no_setup, [&](Sample& sample) {
+		double factor = 0.0;
+		for (Move& move : sample.moves)
+		{
+			if (move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN)
+				factor += sample.board.eval_drop(move);
+		}
+		return factor;
+	});
+
+	std::cout << "\npawn cache hits " << eval.pawn_cache.hits << "/" << eval.pawn_cache.probes << " (" << static_cast<int>(100.0 * eval.pawn_cache.hit_rate()) << "%)\n";
+	return 0;
+}
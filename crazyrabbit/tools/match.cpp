@@ -0,0 +1,332 @@
+/*
+	Match runner for CrazyRabbit.
+
+	Plays two configurations of the program against each other on several threads and stops as soon as a
+	sequential probability ratio test decides between the hypotheses elo = elo0 and elo = elo1 of the first
+	configuration against the second. Every opening of the suite is played twice, with the colors swapped.
+	The suite is a file with one FEN per line (the text after a semicolon is ignored, so the old text opening
+	book can be used as well); without one, all games start from the initial position.
+
+	A configuration is a modification mask like the ones of the tournament configs ("default" or for example
+	"MT-PS-DM"), optionally followed by comma separated settings: sims=N, bestmove=Q-value,
+	expansion=Exploration, backprop=SMA and dirichlet=off. With the TensorFlow backend the model is loaded once
+	and shared by all the searches.
+
+	Usage: match [--threads N] [--games N] [--openings FILE] [--elo0 E] [--elo1 E] [--alpha A] [--beta B]
+	             [--max-plies N] [--hash MB] [--backend Synthetic|TensorFlow] [--pgn FILE] <config 1> <config 2>
+*/
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include "../utils.h"
+#include "../crazyrabbit.h"
+
+using namespace crazyrabbit;
+
+const std::string start_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] w KQkq - 0 1";
+
+struct MatchConfig
+{
+	int threads = static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+	long games = 20000;
+	double elo0 = 0.0;
+	double elo1 = 10.0;
+	double alpha = 0.05;
+	double beta = 0.05;
+	int max_plies = 500;
+	size_t hash = 64;
+	NNetBackendType backend = NNetBackendType::Synthetic;
+	std::string pgn_path;
+	std::vector<std::string> openings;
+	MCTS_config engines[2];
+	std::string names[2];
+};
+
+//Parses a configuration like "MT-PS,sims=400,bestmove=Q-value".
+MCTS_config parse_config(const std::string& text)
+{
+	MCTS_config config;
+
+	size_t split_point = text.find(',');
+	std::string mask = text.substr(0, split_point);
+	if (mask != "default")
+		config.config = parse_mod_mask(mask);
+
+	while (split_point != std::string::npos)
+	{
+		size_t begin = split_point + 1;
+		split_point = text.find(',', begin);
+		std::string setting = text.substr(begin, split_point - begin);
+		std::string name = setting.substr(0, setting.find('='));
+		std::string value = (setting.find('=') != std::string::npos) ? setting.substr(setting.find('=') + 1) : "";
+
+		if (name == "sims")
+			config.num_sims = std::stoi(value);
+		else if (name == "bestmove")
+			config.best_move_strategy = (value == "Q-value") ? BestMoveStrat::Q_value : BestMoveStrat::Default;
+		else if (name == "expansion")
+			config.node_expansion_strategy = (value == "Exploration") ? NodeExpansionStrat::Exploration : NodeExpansionStrat::Default;
+		else if (name == "backprop")
+			config.backprop_strategy = (value == "SMA") ? BackpropStrat::SMA : BackpropStrat::Default;
+		else if (name == "dirichlet")
+			config.use_dirichlet = (value != "off");
+		else
+			throw std::runtime_error("MATCH ERROR: unknown setting " + setting + ".");
+	}
+
+	config.config.use_dirichlet = config.use_dirichlet;
+	return config;
+}
+
+class Match
+{
+public:
+	Match(const MatchConfig& config) : config(config), sprt(config.elo0, config.elo1, config.alpha, config.beta)
+	{
+		if (!config.pgn_path.empty())
+			pgn = std::make_unique<PGN_writer>(config.pgn_path);
+	}
+
+	inline void run();
+
+	int wins = 0;
+	int losses = 0;
+	int draws = 0;
+	int decision = 0;
+	double llr = 0.0;
+
+private:
+	MatchConfig config;
+	SPRT sprt;
+	std::unique_ptr<cppflow::model> model;
+	std::unique_ptr<PGN_writer> pgn;
+	std::mutex result_mutex;
+	std::atomic<long> next_game = 0L;
+	std::atomic<bool> stop = false;
+
+	inline void init_engine(MCTS& mcts, const MCTS_config& engine);
+	inline Color play(MCTS* engines[2], const std::string& fen, const int first, const long round);
+	inline void report(const Color winner, const int first);
+};
+
+//Applies the configuration to a search and connects it to the network.
+inline void Match::init_engine(MCTS& mcts, const MCTS_config& engine)
+{
+	mcts.time_control = false;
+	mcts.num_sims = engine.num_sims;
+	mcts.set_config(engine.config);
+	mcts.set_best_move_strategy(engine.best_move_strategy);
+	mcts.set_node_expansion_strategy(engine.node_expansion_strategy);
+	mcts.set_backprop_strategy(engine.backprop_strategy);
+	mcts.set_hash_size(config.hash);
+
+	if (model)
+	{
+		mcts.init(model.get());
+	} else
+	{
+		mcts.nnet.backend_type = config.backend;
+		mcts.nnet.init();
+	}
+}
+
+//Plays the games on all threads until the test is decided or the game limit is reached.
+inline void Match::run()
+{
+	if (config.backend == NNetBackendType::TensorFlow)
+		model = std::make_unique<cppflow::model>(NNET_MODEL_PATH);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < config.threads; t++)
+	{
+		threads.emplace_back([this]()
+		{
+			MCTS first;
+			MCTS second;
+			init_engine(first, config.engines[0]);
+			init_engine(second, config.engines[1]);
+			MCTS* engines[2] = { &first, &second };
+
+			while (!stop)
+			{
+				long game = next_game++;
+				if (game >= config.games)
+					break;
+
+				//Both colors are played from every opening, the first configuration is white in the even games.
+				const std::string& fen = config.openings.empty() ? start_fen : config.openings[(game / 2) % config.openings.size()];
+				int white = static_cast<int>(game % 2);
+				Color winner = play(engines, fen, white, game + 1);
+				if (!stop)
+					report(winner, white);
+			}
+		});
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+//Plays a game between the engines, the one with the given index is white. Returns the winner, or NO_COLOR for a draw.
+inline Color Match::play(MCTS* engines[2], const std::string& fen, const int white, const long round)
+{
+	Board board;
+	board.set_fen(fen);
+	engines[0]->reset();
+	engines[1]->reset();
+
+	std::vector<std::string> moves;
+	Color winner = NO_COLOR;
+	for (int ply = 0; ply < config.max_plies && !stop; ply++)
+	{
+		MCTS& mcts = *engines[(board.p.turn() == WHITE) ? white : 1 - white];
+		mcts.player = board.p.turn();
+
+		Move move = mcts.best_move(board);
+		if (pgn)
+			moves.push_back(board.san(move));
+		board.push(move);
+
+		double es = board.end_score(WHITE);
+		if (es != END_SCORE_NONE)
+		{
+			winner = (es == END_SCORE_WIN) ? WHITE : (es == END_SCORE_LOSS) ? BLACK : NO_COLOR;
+			break;
+		}
+	}
+
+	if (pgn && !stop)
+	{
+		std::lock_guard<std::mutex> lock(result_mutex);
+		pgn->new_game("CrazyRabbit match", static_cast<int>(round), config.names[white], config.names[1 - white]);
+		for (const std::string& move : moves)
+			pgn->add_move(move);
+		pgn->flush(winner);
+	}
+
+	return winner;
+}
+
+//Counts the result from the perspective of the first configuration and updates the test.
+inline void Match::report(const Color winner, const int white)
+{
+	std::lock_guard<std::mutex> lock(result_mutex);
+
+	Color first_color = (white == 0) ? WHITE : BLACK;
+	if (winner == NO_COLOR)
+		draws++;
+	else if (winner == first_color)
+		wins++;
+	else
+		losses++;
+
+	int games = wins + losses + draws;
+	decision = sprt.status(wins, losses, draws);
+	llr = sprt.LLR(wins, losses, draws);
+
+	Elo elo(wins, losses, draws);
+	std::cout << "Games " << games << ": " << wins << " - " << losses << " - " << draws << std::fixed << std::setprecision(2)
+		<< ", Elo " << elo.diff() << " +/- " << elo.error_margin() << ", LOS " << elo.LOS() << " %"
+		<< ", LLR " << llr << " [" << sprt.lower_bound() << ", " << sprt.upper_bound() << "]" << std::endl;
+	std::cout.unsetf(std::ios::fixed);
+
+	if (decision != 0)
+		stop = true;
+}
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	MatchConfig config;
+	std::string openings_path;
+	std::vector<std::string> engines;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc)
+			config.threads = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--games" && i + 1 < argc)
+			config.games = std::stol(argv[++i]);
+		else if (arg == "--openings" && i + 1 < argc)
+			openings_path = argv[++i];
+		else if (arg == "--elo0" && i + 1 < argc)
+			config.elo0 = std::stod(argv[++i]);
+		else if (arg == "--elo1" && i + 1 < argc)
+			config.elo1 = std::stod(argv[++i]);
+		else if (arg == "--alpha" && i + 1 < argc)
+			config.alpha = std::stod(argv[++i]);
+		else if (arg == "--beta" && i + 1 < argc)
+			config.beta = std::stod(argv[++i]);
+		else if (arg == "--max-plies" && i + 1 < argc)
+			config.max_plies = std::stoi(argv[++i]);
+		else if (arg == "--hash" && i + 1 < argc)
+			config.hash = std::max<size_t>(1, std::stoul(argv[++i]));
+		else if (arg == "--backend" && i + 1 < argc)
+			config.backend = (std::string(argv[++i]) == "TensorFlow") ? NNetBackendType::TensorFlow : NNetBackendType::Synthetic;
+		else if (arg == "--pgn" && i + 1 < argc)
+			config.pgn_path = argv[++i];
+		else
+			engines.push_back(arg);
+	}
+
+	if (engines.size() != 2)
+	{
+		std::cerr << "Usage: match [--threads N] [--games N] [--openings FILE] [--elo0 E] [--elo1 E] [--alpha A] [--beta B] "
+			"[--max-plies N] [--hash MB] [--backend Synthetic|TensorFlow] [--pgn FILE] <config 1> <config 2>\n";
+		return 1;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		config.engines[i] = parse_config(engines[i]);
+		config.names[i] = engines[i];
+	}
+
+	if (!openings_path.empty())
+	{
+		std::ifstream in(openings_path);
+		if (!in.is_open())
+		{
+			std::cerr << "Could not open " << openings_path << "\n";
+			return 1;
+		}
+
+		std::string line;
+		while (std::getline(in, line))
+		{
+			line = line.substr(0, line.find(';'));
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty())
+				config.openings.push_back(line);
+		}
+	}
+
+	std::cout << engines[0] << " vs " << engines[1] << ", SPRT elo0 " << config.elo0 << " elo1 " << config.elo1 << ", alpha " << config.alpha << " beta " << config.beta
+		<< ", " << config.threads << " threads, " << std::max<size_t>(config.openings.size(), 1) << " openings" << std::endl;
+
+	Match match(config);
+	match.run();
+
+	if (match.decision > 0)
+		std::cout << "H1 accepted: " << engines[0] << " gains " << config.elo1 << " Elo rather than " << config.elo0 << std::endl;
+	else if (match.decision < 0)
+		std::cout << "H0 accepted: " << engines[0] << " gains " << config.elo0 << " Elo rather than " << config.elo1 << std::endl;
+	else
+	{
+		SPRT sprt(config.elo0, config.elo1, config.alpha, config.beta);
+		std::cout << "No decision after " << match.wins + match.losses + match.draws << " games, LLR " << std::fixed << std::setprecision(2) << match.llr
+			<< " [" << sprt.lower_bound() << ", " << sprt.upper_bound() << "]" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+	Move generator test for CrazyRabbit.
+
+	Counts the leaves of the legal move tree of a position up to a given depth and prints the number of
+	nodes per second. The moves of the last ply are only counted, not played (bulk counting), and the
+	counts of transposed positions are shared through a lockless table keyed by the full Zobrist hash of
+	the position, which includes the pockets and promoted pieces. With --divide the count of every move
+	of the root is printed, with the root moves shared out between the threads. With --suite the tool
+	checks the counts of known Crazyhouse positions, up to the given depth if one is given, and exits with
+	an error if any of them differs.
+
+	Usage: perft [--threads N] [--hash MB] [--no-bulk] [--divide] [--suite] [depth] [FEN]
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include "../utils.h"
+#include "../crazyrabbit.h"
+#include "perft_suite.h"
+
+using namespace crazyrabbit;
+
+const std::string start_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] w KQkq - 0 1";
+
+struct PerftResult
+{
+	uint64_t nodes = 0;
+	double seconds = 0.0;
+};
+
+//Counts the leaves of the position, splitting the root moves between the threads.
+PerftResult run(Perft& perft, Position& p, const int depth, const int threads, const bool divide)
+{
+	PerftResult result;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::pair<Move, uint64_t>> counts = perft.divide(p, depth, threads);
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (auto& [move, nodes] : counts)
+	{
+		if (divide)
+			std::cout << move << ": " << nodes << "\n";
+		result.nodes += nodes;
+	}
+
+	return result;
+}
+
+inline long long nps(const PerftResult& result)
+{
+	return static_cast<long long>(result.nodes / std::max(result.seconds, 1e-9));
+}
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	int threads = static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+	size_t hash = default_perft_hash_size;
+	bool bulk = true;
+	bool divide = false;
+	bool run_suite = false;
+	int depth = 0;
+	std::string fen = start_fen;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc)
+			threads = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--hash" && i + 1 < argc)
+			hash = std::stoul(argv[++i]);
+		else if (arg == "--no-bulk")
+			bulk = false;
+		else if (arg == "--divide")
+			divide = true;
+		else if (arg == "--suite")
+			run_suite = true;
+		else if (depth == 0 && !arg.empty() && std::isdigit(static_cast<unsigned char>(arg[0])))
+			depth = std::stoi(arg);
+		else if (arg.find('/') != std::string::npos)
+			fen = arg;
+		else
+		{
+			std::cerr << "Usage: perft [--threads N] [--hash MB] [--no-bulk] [--divide] [--suite] [depth] [FEN]\n";
+			return 1;
+		}
+	}
+
+	Perft perft;
+	perft.bulk = bulk;
+	perft.set_hash_size(hash);
+
+	if (!run_suite)
+	{
+		Position p;
+		Position::set(fen, p);
+		PerftResult result = run(perft, p, std::max(depth, 1), threads, divide);
+		std::cout << "\nNodes: " << result.nodes << "\nTime: " << static_cast<long long>(result.seconds * 1000.0) << " ms\nNPS: " << nps(result) << std::endl;
+		return 0;
+	}
+
+	int failed = 0;
+	PerftResult total;
+	for (const SuitePosition& position : perft_suite)
+	{
+		int max_depth = (depth > 0) ? std::min<int>(depth, static_cast<int>(position.counts.size())) : static_cast<int>(position.counts.size());
+		for (int d = 1; d <= max_depth; d++)
+		{
+			Position p;
+			Position::set(position.fen, p);
+			PerftResult result = run(perft, p, d, threads, false);
+			bool ok = (result.nodes == position.counts[d - 1]);
+			failed += ok ? 0 : 1;
+			total.nodes += result.nodes;
+			total.seconds += result.seconds;
+
+			std::cout << std::left << std::setw(12) << position.name << std::right << " depth " << d << std::setw(14) << result.nodes
+				<< (ok ? "  OK  " : "  FAIL, expected " + std::to_string(position.counts[d - 1]) + "  ") << std::setw(12) << nps(result) << " nps" << std::endl;
+		}
+	}
+
+	std::cout << "\n" << (failed ? std::to_string(failed) + " counts differ" : std::string("All counts match")) << ", " << total.nodes << " nodes in "
+		<< static_cast<long long>(total.seconds * 1000.0) << " ms, " << nps(total) << " nps" << std::endl;
+	return failed ? 1 : 0;
+}
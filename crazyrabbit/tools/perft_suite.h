@@ -0,0 +1,33 @@
+/*
+	Perft suite for the CrazyRabbit tools.
+
+	Positions with known counts of the leaves of their legal move trees, used by perft --suite and by the
+	regression checks.
+*/
+
+#ifndef CRAZYRABBIT_PERFT_SUITE_H
+#define CRAZYRABBIT_PERFT_SUITE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace crazyrabbit
+{
+	struct SuitePosition
+	{
+		std::string name;
+		std::string fen;
+		std::vector<uint64_t> counts;    // leaves at depth 1, 2, ...
+	};
+
+	//Known Crazyhouse counts, they differ from chess as soon as a capture can be followed by a drop.
+	const std::vector<SuitePosition> perft_suite = {
+		{ "startpos", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] w KQkq - 0 1", { 20ULL, 400ULL, 8902ULL, 197281ULL, 4888832ULL, 120812942ULL } },
+		{ "pockets", "2k5/8/8/8/8/8/8/4K3[QRBNPqrbnp] w - - 0 1", { 301ULL, 75353ULL, 15634852ULL } },
+		{ "drops", "2k5/8/8/8/8/8/8/4K3[Qn] w - - 0 1", { 67ULL, 3083ULL, 88634ULL } },
+		{ "middlegame", "r1bqk2r/pppp1ppp/2n1p3/4P3/1b1Pn3/2NB1N2/PPP2PPP/R1BQK2R[] b KQkq - 0 1", { 42ULL, 1347ULL, 58057ULL } },
+	};
+}
+
+#endif
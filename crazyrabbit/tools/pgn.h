@@ -0,0 +1,286 @@
+/*
+	PGN reading for the CrazyRabbit tools.
+
+	PGNReader streams games one at a time from a PGN collection, so collections of any size can be
+	processed. Comments, variations and annotations are skipped. san_to_move() turns a move in
+	standard algebraic notation, including crazyhouse drops like N@f3, into the matching legal move.
+*/
+
+#ifndef CRAZYRABBIT_PGN_H
+#define CRAZYRABBIT_PGN_H
+
+#include <istream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cctype>
+#include "../crazyrabbit.h"
+
+namespace crazyrabbit
+{
+	struct PGNGame
+	{
+		std::map<std::string, std::string> tags;
+		std::vector<std::string> moves;
+		std::string result = "*";
+
+		//Sets the board to the starting position of the game, which is given by the FEN tag when set up from a position.
+		inline void set_up(Board& board) const
+		{
+			auto fen = tags.find("FEN");
+			if (fen != tags.end())
+				board.set_fen(fen->second);
+			else
+				board.reset();
+		}
+
+		//Returns the score of the game from the perspective of the given side: 1 for a win, 0.5 for a draw, 0 for a loss and -1 if unknown.
+		inline double score(const Color side) const
+		{
+			if (result == "1-0")
+				return (side == WHITE) ? 1.0 : 0.0;
+			if (result == "0-1")
+				return (side == BLACK) ? 1.0 : 0.0;
+			if (result == "1/2-1/2")
+				return 0.5;
+			return -1.0;
+		}
+	};
+
+	//Reads games from a PGN stream.
+	class PGNReader
+	{
+	public:
+		PGNReader(std::istream& in) : in(in) {}
+
+		//Reads the next game. Returns false when there are no more games.
+		inline bool next(PGNGame& game);
+
+	private:
+		std::istream& in;
+		std::string pending_line;
+		bool has_pending_line = false;
+
+		inline bool read_line(std::string& line);
+		inline static void parse_tag(const std::string& line, PGNGame& game);
+		inline static bool is_result(const std::string& token);
+	};
+
+	//Returns the next line of the stream, including a line that was put back.
+	inline bool PGNReader::read_line(std::string& line)
+	{
+		if (has_pending_line)
+		{
+			line = pending_line;
+			has_pending_line = false;
+			return true;
+		}
+
+		if (!std::getline(in, line))
+			return false;
+
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		return true;
+	}
+
+	//Adds the tag pair on the given line to the game.
+	inline void PGNReader::parse_tag(const std::string& line, PGNGame& game)
+	{
+		size_t name_end = line.find(' ');
+		size_t value_begin = line.find('"');
+		size_t value_end = line.rfind('"');
+		if (name_end == std::string::npos || value_begin == std::string::npos || value_end <= value_begin)
+			return;
+
+		game.tags[line.substr(1, name_end - 1)] = line.substr(value_begin + 1, value_end - value_begin - 1);
+	}
+
+	inline bool PGNReader::is_result(const std::string& token)
+	{
+		return token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*";
+	}
+
+	inline bool PGNReader::next(PGNGame& game)
+	{
+		game = PGNGame();
+
+		std::string line;
+		bool in_movetext = false;
+		int comment_depth = 0;
+		int variation_depth = 0;
+
+		while (read_line(line))
+		{
+			if (comment_depth == 0 && !line.empty() && line[0] == '[')
+			{
+				//A tag after the movetext starts the next game, which had no result.
+				if (in_movetext)
+				{
+					pending_line = line;
+					has_pending_line = true;
+					return true;
+				}
+
+				parse_tag(line, game);
+				continue;
+			}
+
+			if (comment_depth == 0 && line.empty())
+				continue;
+
+			in_movetext = true;
+
+			std::string token;
+			for (size_t i = 0; i <= line.size(); i++)
+			{
+				char c = (i < line.size()) ? line[i] : ' ';
+
+				if (comment_depth)
+				{
+					if (c == '}')
+						comment_depth = 0;
+					continue;
+				}
+
+				if (c == '{' || c == ';' || c == '(' || c == ')' || std::isspace(static_cast<unsigned char>(c)))
+				{
+					if (!token.empty() && variation_depth == 0)
+					{
+						if (is_result(token))
+						{
+							game.result = token;
+							return true;
+						}
+
+						//Skip annotation glyphs like $1 and move numbers like 12. or 12..., which can be glued to the move.
+						size_t digits = token.find_first_not_of("0123456789");
+						if (digits == std::string::npos || token[0] == '$')
+							token.clear();
+						else if (digits > 0 && token[digits] == '.')
+							token = (token.find_first_not_of('.', digits) != std::string::npos) ? token.substr(token.find_first_not_of('.', digits)) : "";
+
+						if (!token.empty())
+							game.moves.push_back(token);
+					}
+					token.clear();
+
+					if (c == '{')
+						comment_depth = 1;
+					else if (c == ';')
+						break;
+					else if (c == '(')
+						variation_depth++;
+					else if (c == ')' && variation_depth)
+						variation_depth--;
+				}
+				else
+				{
+					token += c;
+				}
+			}
+		}
+
+		return in_movetext || !game.tags.empty();
+	}
+
+	//Returns the legal move described by the given move in standard algebraic notation, or an empty move if there is none.
+	inline Move san_to_move(Board& board, std::string san)
+	{
+		//Strip checks, annotations and capture marks.
+		while (!san.empty() && (san.back() == '+' || san.back() == '#' || san.back() == '!' || san.back() == '?'))
+			san.pop_back();
+		std::erase(san, 'x');
+		std::erase(san, '-');
+
+		move_vector<Move> moves = board.legal_moves();
+
+		if (san == "OO" || san == "00")
+		{
+			for (Move& move : moves)
+				if (move.flags() == OO)
+					return move;
+			return Move();
+		}
+
+		if (san == "OOO" || san == "000")
+		{
+			for (Move& move : moves)
+				if (move.flags() == OOO)
+					return move;
+			return Move();
+		}
+
+		if (san.size() < 2)
+			return Move();
+
+		PieceType piece = PAWN;
+		const std::string piece_letters = "PNBRQK";
+		size_t begin = 0;
+		if (piece_letters.find(san[0]) != std::string::npos)
+		{
+			piece = static_cast<PieceType>(piece_letters.find(san[0]));
+			begin = 1;
+		}
+
+		//Drops, like N@f3 or @f3 for pawns.
+		size_t drop = san.find('@');
+		if (drop != std::string::npos)
+		{
+			if (san.size() < drop + 3)
+				return Move();
+
+			Square to = create_square(File(san[drop + 1] - 'a'), Rank(san[drop + 2] - '1'));
+			for (Move& move : moves)
+			{
+				if (move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN && move.to() == to && move.flags() - DROP_PAWN == piece)
+					return move;
+			}
+			return Move();
+		}
+
+		//Promotions, like e8=Q or e8Q.
+		int promotion = -1;
+		size_t end = san.size();
+		if (san.size() >= 3 && std::string("NBRQ").find(san.back()) != std::string::npos && (std::isdigit(static_cast<unsigned char>(san[san.size() - 2])) || san[san.size() - 2] == '='))
+		{
+			promotion = static_cast<int>(piece_letters.find(san.back()));
+			end--;
+		}
+		if (end && san[end - 1] == '=')
+			end--;
+
+		if (end < begin + 2)
+			return Move();
+
+		Square to = create_square(File(san[end - 2] - 'a'), Rank(san[end - 1] - '1'));
+		int from_file = -1;
+		int from_rank = -1;
+		for (size_t i = begin; i < end - 2; i++)
+		{
+			if (san[i] >= 'a' && san[i] <= 'h')
+				from_file = san[i] - 'a';
+			else if (san[i] >= '1' && san[i] <= '8')
+				from_rank = san[i] - '1';
+		}
+
+		for (Move& move : moves)
+		{
+			MoveFlags flags = move.flags();
+			if (flags >= DROP_PAWN || move.to() != to || type_of(board.p.at(move.from())) != piece)
+				continue;
+			if ((from_file >= 0 && file_of(move.from()) != from_file) || (from_rank >= 0 && rank_of(move.from()) != from_rank))
+				continue;
+
+			int promoted_to = (flags >= PR_KNIGHT && flags <= PR_QUEEN) ? flags - PR_KNIGHT + KNIGHT : (flags >= PC_KNIGHT && flags <= PC_QUEEN) ? flags - PC_KNIGHT + KNIGHT : -1;
+			if (promoted_to != promotion)
+				continue;
+
+			return move;
+		}
+
+		return Move();
+	}
+}
+
+#endif
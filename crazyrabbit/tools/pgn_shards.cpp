@@ -0,0 +1,114 @@
+/*
+	Training data extraction for CrazyRabbit.
+
+	Replays the games of PGN collections and writes every position into binary shards for the training
+	scripts (see training/ShardReader.py). The PGN file is memory mapped and split at game boundaries into
+	one chunk per thread, so every thread parses and replays its own games and writes its own shards.
+	A position is stored as the input representation of the network, the encoded move played from it
+	(the policy index) and the result of the game from the perspective of the side to move (the value).
+	The spatial planes only hold zeros and ones, so each is packed into a bitboard, which makes a position
+	200 bytes instead of the 3916 bytes of the float planes. Games without a result are skipped.
+
+	Usage: pgn_shards [--threads N] [--shard-size N] <output prefix> <input files...>
+*/
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "shards.h"
+
+using namespace crazyrabbit;
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	int num_threads = std::max(1U, std::thread::hardware_concurrency());
+	size_t shard_size = 1 << 20;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc)
+			num_threads = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--shard-size" && i + 1 < argc)
+			shard_size = std::max<size_t>(1, std::stoul(argv[++i]));
+		else
+			paths.push_back(arg);
+	}
+
+	if (paths.size() < 2)
+	{
+		std::cerr << "Usage: pgn_shards [--threads N] [--shard-size N] <output prefix> <input files...>\n";
+		return 1;
+	}
+
+	ChunkStats total;
+	std::vector<std::string> shards;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 1; i < paths.size(); i++)
+	{
+		MappedFile file;
+		if (!file.open(paths[i].c_str()))
+		{
+			std::cerr << "Could not open " << paths[i] << "\n";
+			return 1;
+		}
+
+		std::cerr << "Reading " << paths[i] << "\n";
+		const char* begin = file.data();
+		const char* end = begin + file.size();
+
+		//Split the file into chunks of about the same size, each starting at a game.
+		std::vector<const char*> bounds;
+		for (int t = 0; t < num_threads; t++)
+			bounds.push_back(game_boundary(begin, begin + file.size() * t / num_threads, end));
+		bounds.push_back(end);
+
+		std::vector<ChunkStats> stats(num_threads);
+		std::vector<std::unique_ptr<ShardWriter>> writers;
+		std::atomic<bool> failed = false;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < num_threads; t++)
+		{
+			writers.push_back(std::make_unique<ShardWriter>(paths[0] + "_" + std::to_string(i - 1) + "_" + std::to_string(t), shard_size));
+			if (bounds[t] < bounds[t + 1])
+				threads.emplace_back([&, t]() {
+					if (!process_chunk(bounds[t], bounds[t + 1], *writers[t], stats[t]))
+						failed = true;
+					writers[t]->close();
+				});
+		}
+
+		for (std::thread& thread : threads)
+			thread.join();
+
+		if (failed)
+		{
+			std::cerr << "Could not write the shards of " << paths[i] << "\n";
+			return 1;
+		}
+
+		for (int t = 0; t < num_threads; t++)
+		{
+			total.games += stats[t].games;
+			total.skipped += stats[t].skipped;
+			total.errors += stats[t].errors;
+			total.positions += stats[t].positions;
+			shards.insert(shards.end(), writers[t]->paths().begin(), writers[t]->paths().end());
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << "Wrote " << total.positions << " positions of " << total.games << " games into " << shards.size() << " shards in " << seconds << " s ("
+		<< static_cast<long>(total.positions / std::max(seconds, 1e-9)) << " positions/s, " << total.skipped << " games skipped, " << total.errors << " games with unreadable moves)\n";
+	for (const std::string& shard : shards)
+		std::cout << shard << "\n";
+	return 0;
+}
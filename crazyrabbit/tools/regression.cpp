@@ -0,0 +1,801 @@
+/*
+	Regression checks for CrazyRabbit.
+
+	Runs quick checks of behaviour that the search and the tools rely on and that is easy to break without
+	noticing, because a wrong answer still looks like a valid move or file. Every check prints OK or FAIL
+	with the details of the first difference, and the program exits with an error if any check failed.
+	Without arguments all checks are run, otherwise only the named ones.
+
+	- perft: the move generator counts the known leaves of the perft suite up to five million nodes, with and
+	  without bulk counting and the transposition table, on one and on several threads
+	- mate: mate_in_one() and has_evasions() agree with the full legal move generation on the positions
+	  of random games
+	- scores: the incremental material and piece-square scores and pawn hash agree with the ones computed
+	  from scratch, after every move of random games and after playing and undoing every legal move
+	- checks: gives_check() and gives_fork() with the precomputed CheckInfo agree with playing every legal
+	  move of the positions of random games
+	- book: a book built from a PGN game and from a text book, written in the binary format and read back
+	  by the engine, returns the moves that were put in, and so does the text book read by the engine
+	- pgn: Board::san() gives every legal move of the positions of random games a unique SAN with the least
+	  disambiguation and the right check or mate mark, which san_to_move() reads back, and random games
+	  written by PGN_writer replay through PGNReader
+	- sprt: the log-likelihood ratio of known results, and simulated matches at the Elo of either hypothesis
+	  accept the right one about as often as alpha and beta allow
+	- shards: PGN games split into chunks and written into small shards are read back with the layout of
+	  the training scripts as the input planes, moves and results of the replayed games
+	- movetime: "go movetime" read by the UCI parser is answered with a legal move by the hard deadline, also
+	  when the time is too short for a single simulation
+
+	Usage: regression [check ...]
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <random>
+#include <functional>
+#include <filesystem>
+#include <set>
+#include <cstddef>
+#include <chrono>
+#include <mutex>
+#include "../utils.h"
+#include "../crazyrabbit.h"
+#include "book.h"
+#include "perft_suite.h"
+#include "shards.h"
+#include "../uci/uci.h"
+
+using namespace crazyrabbit;
+
+struct Check
+{
+	std::string name;
+	std::function<bool(std::ostream&)> run;    // writes the reason of a failure to the stream
+};
+
+//Plays random games from the start position and from positions with full pockets, calling visit on every position reached.
+void random_positions(const int games, const int plies, const uint64_t seed, const std::function<bool(Board&)>& visit)
+{
+	const std::vector<std::string> starts = {
+		"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] w KQkq - 0 1",
+		"r1bqk2r/pppp1ppp/2n1p3/4P3/1b1Pn3/2NB1N2/PPP2PPP/R1BQK2R[] b KQkq - 0 1",
+		"2k5/8/8/8/8/8/8/4K3[QRBNPqrbnp] w - - 0 1",
+	};
+
+	std::mt19937_64 rng(seed);
+	for (int game = 0; game < games; game++)
+	{
+		Board board;
+		board.set_fen(starts[game % starts.size()]);
+		for (int ply = 0; ply < plies; ply++)
+		{
+			if (!visit(board))
+				return;
+
+			move_vector<Move> moves = board.legal_moves();
+			if (moves.empty())
+				break;
+			board.push(moves[rng() % moves.size()]);
+		}
+	}
+}
+
+bool check_perft(std::ostream& err)
+{
+	struct Setup
+	{
+		bool bulk;
+		size_t hash;
+		int threads;
+	};
+	const std::vector<Setup> setups = { { true, 16, 2 }, { false, 0, 1 } };
+
+	for (const Setup& setup : setups)
+	{
+		Perft perft;
+		perft.bulk = setup.bulk;
+		perft.set_hash_size(setup.hash);
+		for (const SuitePosition& position : perft_suite)
+		{
+			for (size_t depth = 1; depth <= position.counts.size() && position.counts[depth - 1] <= 5000000ULL; depth++)
+			{
+				Position p;
+				Position::set(position.fen, p);
+				uint64_t nodes = 0ULL;
+				for (auto& [move, count] : perft.divide(p, static_cast<int>(depth), setup.threads))
+					nodes += count;
+
+				if (nodes != position.counts[depth - 1])
+				{
+					err << position.name << " depth " << depth << " counts " << nodes << " instead of " << position.counts[depth - 1]
+						<< (setup.bulk ? " with" : " without") << " bulk counting on " << setup.threads << " threads";
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+//Compares the shortcuts of the mate search with playing every legal move of the position.
+template <Color Us>
+bool check_mate_shortcuts(Position& p, std::ostream& err, int& mates)
+{
+	Move list[MAX_MOVES];
+	Move* last = p.generate_legals<Us>(list);
+
+	if (p.in_check<Us>() && p.has_evasions<Us>() != (last != list))
+	{
+		err << "has_evasions() is " << p.has_evasions<Us>() << " with " << last - list << " legal moves in " << p.fen();
+		return false;
+	}
+
+	std::vector<Move> mating;
+	for (Move* m = list; m != last; m++)
+	{
+		Move reply[MAX_MOVES];
+		p.play<Us, false>(*m);
+		if (p.in_check<~Us>() && p.generate_legals<~Us>(reply) == reply)
+			mating.push_back(*m);
+		p.undo<Us, false>(*m);
+	}
+
+	Move found = p.mate_in_one<Us>();
+	bool listed = false;
+	for (const Move& m : mating)
+		listed |= (m == found);
+
+	if ((found.from() == NO_SQUARE) != mating.empty() || (!mating.empty() && !listed))
+	{
+		err << "mate_in_one() returned " << found << " but " << mating.size() << " moves mate in " << p.fen();
+		return false;
+	}
+
+	mates += mating.empty() ? 0 : 1;
+	return true;
+}
+
+bool check_mate(std::ostream& err)
+{
+	bool ok = true;
+	int positions = 0;
+	int mates = 0;
+	random_positions(400, 120, 1, [&](Board& board) {
+		Position& p = board.p;
+		positions++;
+		ok = (p.turn() == WHITE) ? check_mate_shortcuts<WHITE>(p, err, mates) : check_mate_shortcuts<BLACK>(p, err, mates);
+		return ok;
+	});
+
+	//Random games must reach some mates, otherwise the comparison proves little.
+	if (ok && mates == 0)
+	{
+		err << "no mate in one among " << positions << " positions";
+		ok = false;
+	}
+	return ok;
+}
+
+//The scores and the pawn hash of a position that are updated incrementally by play() and undo().
+struct IncrementalState
+{
+	int material;
+	int piece_square;
+	uint64_t pawn_hash;
+};
+
+IncrementalState incremental_state(const Position& p)
+{
+	return IncrementalState{ p.material(), p.piece_square(), p.get_pawn_hash() };
+}
+
+//Computes the incremental state from the pieces on the board and in the pockets.
+IncrementalState recomputed_state(const Position& p)
+{
+	IncrementalState state{ 0, 0, 0ULL };
+	for (int s = a1; s <= h8; s++)
+	{
+		Piece pc = p.at(Square(s));
+		state.material += eval_weights::material_table[pc];
+		state.piece_square += eval_weights::psq_table[pc][s];
+		state.pawn_hash ^= zobrist::pawn_table[pc][s];
+	}
+	for (Color c : { WHITE, BLACK })
+		for (int pt = PAWN; pt <= QUEEN; pt++)
+			state.material += p.pocket_count(c, PieceType(pt)) * eval_weights::hand_table[make_piece(c, PieceType(pt))];
+	return state;
+}
+
+//Compares the incremental state field by field with the expected one.
+bool compare_state(const Position& p, const IncrementalState& expected, const std::string& source, std::ostream& err)
+{
+	IncrementalState state = incremental_state(p);
+	const char* field = (state.material != expected.material) ? "material" : (state.piece_square != expected.piece_square) ? "piece-square score"
+		: (state.pawn_hash != expected.pawn_hash) ? "pawn hash" : nullptr;
+	if (field)
+		err << "the " << field << " differs from the one " << source << " in " << p.fen();
+	return field == nullptr;
+}
+
+//Plays and undoes every legal move, comparing the incremental state after each with the one computed from scratch.
+template <Color Us>
+bool check_incremental_moves(Position& p, std::ostream& err, int counts[3])
+{
+	Move list[MAX_MOVES];
+	Move* last = p.generate_legals<Us>(list);
+	IncrementalState before = incremental_state(p);
+
+	for (Move* m = list; m != last; m++)
+	{
+		p.play<Us>(*m);
+		bool ok = compare_state(p, recomputed_state(p), "recomputed after the move", err);
+		p.undo<Us>(*m);
+		if (!ok || !compare_state(p, before, "before the move was played and undone", err))
+		{
+			err << ", the move was " << *m;
+			return false;
+		}
+
+		MoveFlags flags = m->flags();
+		counts[0] += (flags >= DROP_PAWN && flags <= DROP_QUEEN) ? 1 : 0;
+		counts[1] += (flags == CAPTURE || flags == EN_PASSANT || (flags >= PC_KNIGHT && flags <= PC_QUEEN)) ? 1 : 0;
+		counts[2] += (flags >= PR_KNIGHT && flags <= PC_QUEEN) ? 1 : 0;
+	}
+	return true;
+}
+
+bool check_scores(std::ostream& err)
+{
+	bool ok = true;
+	int counts[3] = {};    // drops, captures and promotions played
+	random_positions(300, 120, 3, [&](Board& board) {
+		Position& p = board.p;
+		Position fresh;
+		Position::set(p.fen(), fresh);
+		ok = compare_state(p, recomputed_state(p), "recomputed", err) && compare_state(p, incremental_state(fresh), "set from the FEN", err)
+			&& ((p.turn() == WHITE) ? check_incremental_moves<WHITE>(p, err, counts) : check_incremental_moves<BLACK>(p, err, counts));
+		return ok;
+	});
+
+	//Random games must reach drops, captures and promotions, otherwise the comparison proves little.
+	if (ok && (counts[0] == 0 || counts[1] == 0 || counts[2] == 0))
+	{
+		err << counts[0] << " drops, " << counts[1] << " captures and " << counts[2] << " promotions among the moves of the random positions";
+		ok = false;
+	}
+	return ok;
+}
+
+//Compares the checks and forks found with the CheckInfo of the position with playing every legal move.
+template <Color Us>
+bool check_check_info(Board& board, std::ostream& err, int& checks, int& forks)
+{
+	Position& p = board.p;
+	CheckInfo ci = board.check_info();
+	Move list[MAX_MOVES];
+	Move* last = p.generate_legals<Us>(list);
+
+	for (Move* m = list; m != last; m++)
+	{
+		p.play<Us>(*m);
+		bool check = p.in_check<~Us>();
+		Bitboard attacked = attacks(type_of(p.at(m->to())), m->to(), p.all_pieces<WHITE>() | p.all_pieces<BLACK>()) & p.all_pieces<~Us>();
+		bool fork = pop_count(attacked) >= 2;
+		p.undo<Us>(*m);
+
+		if (board.gives_check(*m, ci) != check || board.gives_fork(*m, ci) != fork)
+		{
+			err << *m << " gives check " << board.gives_check(*m, ci) << " and fork " << board.gives_fork(*m, ci) << " instead of "
+				<< check << " and " << fork << " in " << p.fen();
+			return false;
+		}
+		checks += check ? 1 : 0;
+		forks += fork ? 1 : 0;
+	}
+	return true;
+}
+
+bool check_checks(std::ostream& err)
+{
+	bool ok = true;
+	int checks = 0;
+	int forks = 0;
+	random_positions(400, 120, 2, [&](Board& board) {
+		ok = (board.p.turn() == WHITE) ? check_check_info<WHITE>(board, err, checks, forks) : check_check_info<BLACK>(board, err, checks, forks);
+		return ok;
+	});
+
+	//Random games must reach some checks and forks, otherwise the comparison proves little.
+	if (ok && (checks == 0 || forks == 0))
+	{
+		err << checks << " checks and " << forks << " forks among the moves of the random positions";
+		ok = false;
+	}
+	return ok;
+}
+
+//Checks that every position of the book returns one of the moves that were put in for it, and the positions outside of it none.
+bool check_book_moves(Openings& book, const std::string& name, const std::map<std::string, std::set<std::string>>& expected, std::ostream& err)
+{
+	Board board;
+	for (const auto& [fen, moves] : expected)
+	{
+		board.set_fen(fen);
+		for (int draw = 0; draw < 8; draw++)
+		{
+			Move found = book.get_move(board);
+			std::ostringstream move;
+			if (found.from() != NO_SQUARE)
+				move << found;
+			if (!moves.contains(move.str()))
+			{
+				err << "the " << name << " book returned " << (move.str().empty() ? "no move" : move.str()) << " in " << fen;
+				return false;
+			}
+		}
+	}
+
+	board.set_fen("2k5/8/8/8/8/8/8/4K3[Q] w - - 0 1");
+	if (book.get_move(board).from() != NO_SQUARE)
+	{
+		err << "the " << name << " book returned a move for a position that is not in it";
+		return false;
+	}
+	return true;
+}
+
+bool check_book(std::ostream& err)
+{
+	//A text book with up to three moves for the positions of a few random games.
+	std::map<std::string, std::set<std::string>> expected;
+	std::ostringstream text;
+	size_t text_moves = 0;
+	std::mt19937_64 rng(2);
+	random_positions(12, 20, 2, [&](Board& board) {
+		move_vector<Move> moves = board.legal_moves();
+		text << board.fen() << ";";
+		for (size_t i = 0; i < std::min<size_t>(3, moves.size()); i++)
+		{
+			std::ostringstream move;
+			move << moves[rng() % moves.size()];
+			text << (i ? "," : "") << move.str();
+			expected[board.fen()].insert(move.str());
+			text_moves++;
+		}
+		text << "\n";
+		return true;
+	});
+
+	const std::filesystem::path text_path = std::filesystem::temp_directory_path() / "crazyrabbit_regression_book.txt";
+	const std::filesystem::path book_path = std::filesystem::temp_directory_path() / "crazyrabbit_regression_book.bin";
+	std::ofstream(text_path) << text.str();
+
+	BookStats_t stats;
+	long errors = 0;
+	std::istringstream text_in(text.str());
+	read_text_book(text_in, stats, errors);
+	std::vector<BookEntry> entries = book_entries(stats, 1);
+	bool written = write_book(book_path.string(), entries);
+
+	Openings text_book;
+	Openings binary_book;
+	text_book.init_text(text_path.string().c_str());
+	binary_book.init(book_path.string().c_str());
+	std::filesystem::remove(text_path);
+	std::filesystem::remove(book_path);
+
+	if (errors || !written || binary_book.size() != entries.size() || entries.size() != stats.size() || text_book.size() != text_moves)
+	{
+		err << errors << " unreadable moves, " << entries.size() << " entries built from " << stats.size() << " moves, "
+			<< binary_book.size() << " read back, " << text_book.size() << " of " << text_moves << " text book moves read";
+		return false;
+	}
+	if (!check_book_moves(binary_book, "binary", expected, err) || !check_book_moves(text_book, "text", expected, err))
+		return false;
+
+	//Only the moves of the winning side are kept, with the weight of a win.
+	BookStats_t pgn_stats;
+	std::istringstream pgn("[Event \"regression\"]\n[Result \"1-0\"]\n\n1. e4 e5 2. Nf3 Nc6 1-0\n");
+	read_pgn(pgn, pgn_stats, 24, errors);
+	std::vector<BookEntry> pgn_entries = book_entries(pgn_stats, 1);
+	if (errors || pgn_entries.size() != 2 || pgn_entries[0].weight != 2 || pgn_entries[1].weight != 2)
+	{
+		err << "the PGN game gave " << pgn_entries.size() << " entries with " << errors << " unreadable moves, expected 2 with the weight 2";
+		return false;
+	}
+	return true;
+}
+
+//Compares the SAN of every legal move with the move that san_to_move() reads from it and with the other moves of the position.
+bool check_san(Board& board, std::ostream& err, int& mates)
+{
+	move_vector<Move> moves = board.legal_moves();
+	std::set<std::string> sans;
+	for (Move& move : moves)
+	{
+		std::string san = board.san(move);
+		Move read = san_to_move(board, san);
+
+		//Another piece of the same type that can move to the same square needs the origin to be given.
+		bool ambiguous = false;
+		for (Move& other : moves)
+			ambiguous |= other.flags() < DROP_PAWN && other.to() == move.to() && other.from() != move.from() && type_of(board.p.at(other.from())) == type_of(board.p.at(move.from()));
+
+		std::string plain = san;
+		std::erase(plain, 'x');
+		while (!plain.empty() && (plain.back() == '+' || plain.back() == '#'))
+			plain.pop_back();
+		bool piece_move = move.flags() < DROP_PAWN && move.flags() != OO && move.flags() != OOO && type_of(board.p.at(move.from())) != PAWN;
+
+		board.push(move);
+		bool check = board.p.turn() == WHITE ? board.p.in_check<WHITE>() : board.p.in_check<BLACK>();
+		bool mate = check && board.legal_moves().empty();
+		board.pop(move);
+
+		std::string mark = mate ? "#" : check ? "+" : "";
+		if (!(read == move) || !sans.insert(san).second || (piece_move && !ambiguous && plain.size() != 3) || san.substr(san.size() - mark.size()) != mark
+			|| (mark.empty() && (san.back() == '+' || san.back() == '#')))
+		{
+			err << "the SAN " << san << " of " << move << " reads back as " << read << " in " << board.fen();
+			return false;
+		}
+		mates += mate ? 1 : 0;
+	}
+	return true;
+}
+
+bool check_pgn(std::ostream& err)
+{
+	bool ok = true;
+	int mates = 0;
+	random_positions(200, 100, 3, [&](Board& board) {
+		ok = check_san(board, err, mates);
+		return ok;
+	});
+	if (!ok)
+		return false;
+	if (mates == 0)
+	{
+		err << "no mating move among the positions of the random games";
+		return false;
+	}
+
+	//Random games written to a PGN file and read back.
+	const std::filesystem::path path = std::filesystem::temp_directory_path() / "crazyrabbit_regression.pgn";
+	std::filesystem::remove(path);
+	std::vector<std::vector<Move>> games;
+	std::vector<std::vector<std::string>> sans;
+	std::vector<Color> winners;
+	{
+		PGN_writer writer(path.string());
+		std::mt19937_64 rng(4);
+		for (int round = 1; round <= 40; round++)
+		{
+			Board board;
+			std::vector<Move> played;
+			std::vector<std::string> written;
+			Color winner = NO_COLOR;
+			writer.new_game("regression", round, "white", "black");
+			for (int ply = 0; ply < 150; ply++)
+			{
+				move_vector<Move> moves = board.legal_moves();
+				if (moves.empty())
+				{
+					bool check = board.p.turn() == WHITE ? board.p.in_check<WHITE>() : board.p.in_check<BLACK>();
+					winner = check ? ~board.p.turn() : NO_COLOR;
+					break;
+				}
+
+				Move move = moves[rng() % moves.size()];
+				written.push_back(board.san(move));
+				writer.add_move(written.back());
+				played.push_back(move);
+				board.push(move);
+			}
+			writer.flush(winner);
+			games.push_back(played);
+			sans.push_back(written);
+			winners.push_back(winner);
+		}
+		writer.close();
+	}
+
+	std::ifstream in(path);
+	PGNReader reader(in);
+	PGNGame game;
+	size_t index = 0;
+	while (ok && reader.next(game))
+	{
+		const std::string result = (winners[index] == WHITE) ? "1-0" : (winners[index] == BLACK) ? "0-1" : "1/2-1/2";
+		ok = game.moves == sans[index] && game.result == result;
+		Board board;
+		for (size_t ply = 0; ok && ply < game.moves.size(); ply++)
+		{
+			Move move = san_to_move(board, game.moves[ply]);
+			ok = (move == games[index][ply]);
+			board.push(move);
+		}
+		if (!ok)
+			err << "game " << index + 1 << " of " << path.string() << " does not replay as it was played";
+		index++;
+	}
+	in.close();
+	std::filesystem::remove(path);
+
+	if (ok && index != games.size())
+	{
+		err << index << " of " << games.size() << " games were read back";
+		ok = false;
+	}
+	return ok;
+}
+
+//Plays simulated matches at the given Elo difference until the test decides or the game limit is reached. Returns the number of matches that accepted H1.
+int sprt_accepted(const SPRT& sprt, const double elo, const int matches, std::mt19937_64& rng)
+{
+	const double draw_rate = 0.4;
+	const double score = 1.0 / (1.0 + std::pow(10.0, -elo / 400.0));
+	std::discrete_distribution<int> result({ score - draw_rate / 2.0, 1.0 - score - draw_rate / 2.0, draw_rate });
+
+	int accepted = 0;
+	for (int match = 0; match < matches; match++)
+	{
+		int counts[3] = {};
+		int decision = 0;
+		for (int game = 0; game < 200000 && decision == 0; game++)
+		{
+			counts[result(rng)]++;
+			decision = sprt.status(counts[0], counts[1], counts[2]);
+		}
+		accepted += (decision > 0) ? 1 : 0;
+	}
+	return accepted;
+}
+
+bool check_sprt(std::ostream& err)
+{
+	SPRT sprt(0.0, 10.0, 0.05, 0.05);
+	const double llr = sprt.LLR(1200, 1000, 1800);
+	if (std::abs(llr - 7.486657754499684) > 1e-9 || std::abs(sprt.upper_bound() - std::log(19.0)) > 1e-12 || std::abs(sprt.lower_bound() + std::log(19.0)) > 1e-12
+		|| sprt.LLR(0, 0, 0) != 0.0 || sprt.status(1200, 1000, 1800) != 1 || sprt.status(1000, 1200, 1800) != -1 || sprt.status(10, 10, 10) != 0)
+	{
+		err << "LLR " << llr << " of 1200 - 1000 - 1800 instead of 7.4867, bounds [" << sprt.lower_bound() << ", " << sprt.upper_bound() << "]";
+		return false;
+	}
+
+	//With alpha and beta of 5 %, about 95 of 100 matches should accept the true hypothesis.
+	std::mt19937_64 rng(5);
+	const int matches = 100;
+	int h1_at_elo1 = sprt_accepted(sprt, 10.0, matches, rng);
+	int h1_at_elo0 = sprt_accepted(sprt, 0.0, matches, rng);
+	if (h1_at_elo1 < 85 || h1_at_elo0 > 15)
+	{
+		err << "H1 accepted in " << h1_at_elo1 << " of " << matches << " matches at elo1 and in " << h1_at_elo0 << " at elo0";
+		return false;
+	}
+	return true;
+}
+
+bool check_shards(std::ostream& err)
+{
+	//The offsets of the fields as training/ShardReader.py reads them.
+	if (offsetof(ShardHeader, version) != 4 || offsetof(ShardHeader, num_positions) != 8 || offsetof(ShardHeader, spatial_planes) != 16
+		|| offsetof(ShardHeader, scalars) != 20 || offsetof(ShardPosition, scalars) != 8 * SPATIAL_PLANES
+		|| offsetof(ShardPosition, policy) != 8 * SPATIAL_PLANES + 4 * SCALAR_INPUT_SIZE || offsetof(ShardPosition, value) != offsetof(ShardPosition, policy) + 2)
+	{
+		err << "the shard layout does not match training/ShardReader.py";
+		return false;
+	}
+
+	//The game without a result is skipped.
+	const std::string pgn =
+		"[Event \"a\"]\n[Result \"1-0\"]\n\n1. e4 d5 2. exd5 Qxd5 3. Nc3 Qa5 4. P@e5 1-0\n\n"
+		"[Event \"b\"]\n[Result \"*\"]\n\n1. e4 *\n\n"
+		"[Event \"c\"]\n[Result \"0-1\"]\n\n1. d4 e5 2. dxe5 Nc6 3. Nf3 0-1\n";
+	const size_t shard_size = 3;
+	const std::string prefix = (std::filesystem::temp_directory_path() / "crazyrabbit_regression_shard").string();
+
+	//Two chunks split at a game boundary, written by their own writers like the threads of pgn_shards.
+	const char* begin = pgn.data();
+	const char* end = begin + pgn.size();
+	const char* middle = game_boundary(begin, begin + pgn.size() / 2, end);
+	std::vector<std::string> shards;
+	ChunkStats stats;
+	int chunk = 0;
+	for (const auto& [chunk_begin, chunk_end] : { std::make_pair(begin, middle), std::make_pair(middle, end) })
+	{
+		ShardWriter writer(prefix + "_" + std::to_string(chunk++), shard_size);
+		if (!process_chunk(chunk_begin, chunk_end, writer, stats))
+		{
+			err << "could not write the shards to " << prefix;
+			return false;
+		}
+		writer.close();
+		shards.insert(shards.end(), writer.paths().begin(), writer.paths().end());
+	}
+
+	//Read the shards back in order.
+	std::vector<ShardPosition> positions;
+	bool ok = true;
+	for (const std::string& path : shards)
+	{
+		std::ifstream in(path, std::ios::binary);
+		ShardHeader header{};
+		in.read(reinterpret_cast<char*>(&header), sizeof(header));
+		const size_t file_size = static_cast<size_t>(std::filesystem::file_size(path));
+		if (ok && (!std::equal(header.magic, header.magic + 4, shard_magic) || header.version != shard_version || header.spatial_planes != SPATIAL_PLANES
+			|| header.scalars != SCALAR_INPUT_SIZE || header.num_positions == 0 || header.num_positions > shard_size
+			|| file_size != sizeof(ShardHeader) + header.num_positions * sizeof(ShardPosition)))
+		{
+			err << path << " has a wrong header for its " << file_size << " bytes";
+			ok = false;
+		}
+
+		std::vector<ShardPosition> shard(ok ? header.num_positions : 0);
+		in.read(reinterpret_cast<char*>(shard.data()), static_cast<std::streamsize>(shard.size() * sizeof(ShardPosition)));
+		positions.insert(positions.end(), shard.begin(), shard.end());
+		in.close();
+		std::filesystem::remove(path);
+	}
+	if (!ok)
+		return false;
+
+	if (stats.games != 2 || stats.skipped != 1 || stats.errors != 0 || positions.size() != 12 || static_cast<long>(positions.size()) != stats.positions)
+	{
+		err << stats.games << " games, " << stats.skipped << " skipped, " << stats.errors << " with errors and " << positions.size()
+			<< " positions read back, expected 2 games of 12 positions with 1 skipped";
+		return false;
+	}
+
+	//Replay the games and compare every position with its input representation.
+	std::istringstream in(pgn);
+	PGNReader reader(in);
+	PGNGame game;
+	Board board;
+	size_t index = 0;
+	while (reader.next(game))
+	{
+		if (game.score(WHITE) < 0.0)
+			continue;
+
+		game.set_up(board);
+		for (const std::string& san : game.moves)
+		{
+			Move move = san_to_move(board, san);
+			float spatial[SPATIAL_INPUT_SIZE] = {};
+			float scalars[SCALAR_INPUT_SIZE] = {};
+			board.input_planes(spatial, scalars);
+
+			const ShardPosition& position = positions[index];
+			bool same = position.policy == move.hash() && position.value == ((game.score(board.p.turn()) > 0.5) ? 1 : -1)
+				&& std::equal(scalars, scalars + SCALAR_INPUT_SIZE, position.scalars);
+			for (int i = 0; i < SPATIAL_INPUT_SIZE; i++)
+				same &= spatial[i] == static_cast<float>((position.planes[i / 64] >> (i % 64)) & 1ULL);
+
+			if (!same)
+			{
+				err << "position " << index << " does not match " << board.fen() << " with " << move;
+				return false;
+			}
+
+			board.push(move);
+			index++;
+		}
+	}
+	return true;
+}
+
+//Sends "go movetime" for a few short times through the UCI parser and checks that the answer, from the search or from the
+//watchdog, is a legal move sent before the move time is over.
+bool check_movetime(std::ostream& err)
+{
+	const std::vector<long long> move_times = { 0, 20, 80, 150, 300 };
+	const long long slack = 100;    // in milliseconds, for the scheduling of a busy machine
+
+	Board board;
+	MCTS mcts;
+	mcts.set_nnet_backend(NNetBackendType::Synthetic, 0LL);
+	mcts.init(board);
+	move_vector<Move> legal = board.legal_moves();
+
+	std::mutex answer_mutex;
+	std::chrono::steady_clock::time_point begin;
+	long long answer_time = -1LL;
+	Move answer;
+	mcts.on_deadline = [&](Move move) {
+		std::lock_guard<std::mutex> lock(answer_mutex);
+		if (answer_time < 0LL)
+		{
+			answer_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+			answer = move;
+		}
+	};
+
+	bool ok = true;
+	uci uci;
+	uci.receive_go.connect([&](const auto& parameters) {
+		if (!ok)
+			return;
+
+		auto move_time = parameters.find(uci::command::move_time);
+		if (move_time == parameters.end())
+		{
+			err << "go movetime was not read by the UCI parser";
+			ok = false;
+			return;
+		}
+
+		mcts.reset();
+		mcts.player = board.p.turn();
+		mcts.init_move_time(std::stoll(move_time->second));
+		answer_time = -1LL;
+		begin = std::chrono::steady_clock::now();
+		Move searched = mcts.best_move(board);
+		mcts.on_deadline(searched);
+
+		long long limit = std::stoll(move_time->second);
+		bool is_legal = std::any_of(legal.begin(), legal.end(), [&](Move& move) { return move.hash() == answer.hash(); });
+		if (!is_legal || answer_time > limit + slack)
+		{
+			err << "go movetime " << limit << " answered " << answer << " after " << answer_time << " ms";
+			ok = false;
+		}
+	});
+
+	std::stringstream commands;
+	for (long long move_time : move_times)
+		commands << "go movetime " << move_time << "\n";
+	commands << "quit\n";
+
+	std::streambuf* input = std::cin.rdbuf(commands.rdbuf());
+	uci.launch();
+	std::cin.rdbuf(input);
+	return ok;
+}
+
+const std::vector<Check> checks = {
+	{ "perft", check_perft },
+	{ "mate", check_mate },
+	{ "scores", check_scores },
+	{ "checks", check_checks },
+	{ "book", check_book },
+	{ "pgn", check_pgn },
+	{ "sprt", check_sprt },
+	{ "shards", check_shards },
+	{ "movetime", check_movetime },
+};
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	std::vector<std::string> selected(argv + 1, argv + argc);
+	int failed = 0;
+	int run = 0;
+	for (const Check& check : checks)
+	{
+		if (!selected.empty() && std::find(selected.begin(), selected.end(), check.name) == selected.end())
+			continue;
+
+		std::ostringstream err;
+		bool ok = check.run(err);
+		run++;
+		failed += ok ? 0 : 1;
+		std::cout << std::left << std::setw(12) << check.name << (ok ? "OK" : "FAIL: " + err.str()) << std::endl;
+	}
+
+	if (run == 0)
+	{
+		std::cerr << "Usage: regression [check ...]\n";
+		return 1;
+	}
+
+	std::cout << "\n" << (failed ? std::to_string(failed) + " of " + std::to_string(run) + " checks failed" : "All " + std::to_string(run) + " checks passed") << std::endl;
+	return failed ? 1 : 0;
+}
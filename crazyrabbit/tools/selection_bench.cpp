@@ -0,0 +1,120 @@
+/*
+	Selection benchmark for CrazyRabbit.
+
+	Measures the time needed to choose the next move to expand at a single node
+	as its branching factor grows, for the full scan over all children, for
+	progressive widening and for progressive widening with hierarchical drops.
+
+	Usage: selection_bench [visits]
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include "../utils.h"
+#include "../crazyrabbit.h"
+
+using namespace crazyrabbit;
+
+// a middlegame position with full pockets, so most of the legal moves are drops
+const std::string bench_fen = "r1b1k2r/ppp2ppp/2n5/3q4/8/2N5/PPP2PPP/R1BQK2R[QRBNPPqrbnpp] w KQkq - 0 1";
+
+enum class SelectionMode
+{
+	FullScan,
+	Widening,
+	HierarchicalDrops,
+	NUM
+};
+
+const char* mode_names[] = { "full scan", "widening", "hierarchical" };
+
+//Returns a node with the given number of children and random priors that decay like the priors of a trained network.
+move_vector<Move> make_node(const move_vector<Move>& legal_moves, const size_t branching, std::mt19937& rng)
+{
+	move_vector<Move> moves;
+	std::exponential_distribution<double> prior(1.0);
+	double sum_policy = 0.0;
+	for (size_t i = 0; i < branching; i++)
+	{
+		Move move = legal_moves[i % legal_moves.size()];
+		move.policy = pow(prior(rng), 4.0);
+		sum_policy += move.policy;
+		moves.push_back(move);
+	}
+
+	for (Move& move : moves)
+		move.policy /= sum_policy;
+
+	return moves;
+}
+
+//Runs the given number of selections with backpropagation of random values and returns the time per selection in nanoseconds.
+double run(move_vector<Move> moves, const SelectionMode mode, const long visits, std::mt19937 rng, long& best_visits)
+{
+	std::uniform_real_distribution<double> value(-1.0, 1.0);
+
+	if (mode != SelectionMode::FullScan)
+		order_children(moves, mode == SelectionMode::HierarchicalDrops);
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (long i = 0; i < visits; i++)
+	{
+		Move& move = (mode == SelectionMode::FullScan) ? move_to_expand_default(moves) : move_to_expand_widened<NodeExpansionStrat::Default>(moves, true);
+
+		double v = value(rng) * 0.5 + move.policy;
+		if (moves.grouped_drops && move.flags() >= DROP_PAWN && move.flags() <= DROP_QUEEN)
+		{
+			Move& group = moves.drop_groups[move.flags() - DROP_PAWN];
+			group.Q_value = (group.n_visits) ? backprop_nvisits_qvalue(group, v) : v;
+			group.n_visits++;
+		}
+
+		move.Q_value = (move.n_visits) ? backprop_nvisits_qvalue(move, v) : v;
+		move.n_visits++;
+		moves.n_visits++;
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	best_visits = 0L;
+	for (const Move& move : moves)
+		best_visits = std::max(best_visits, move.n_visits);
+
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()) / static_cast<double>(visits);
+}
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	long visits = (argc > 1) ? std::stol(argv[1]) : 20000L;
+
+	Board board;
+	board.set_fen(bench_fen);
+	move_vector<Move> legal_moves = board.legal_moves();
+
+	std::cout << "legal moves in bench position: " << legal_moves.size() << "\n";
+	std::cout << "visits per node: " << visits << "\n\n";
+	std::cout << std::setw(10) << "branching";
+	for (int mode = 0; mode < static_cast<int>(SelectionMode::NUM); mode++)
+		std::cout << std::setw(16) << mode_names[mode] << std::setw(12) << "best n";
+	std::cout << "\n";
+
+	for (size_t branching : { 20, 50, 100, 200, 300, 600 })
+	{
+		std::mt19937 rng(static_cast<unsigned int>(branching));
+		move_vector<Move> moves = make_node(legal_moves, branching, rng);
+
+		std::cout << std::setw(10) << branching;
+		for (int mode = 0; mode < static_cast<int>(SelectionMode::NUM); mode++)
+		{
+			long best_visits;
+			double ns = run(moves, static_cast<SelectionMode>(mode), visits, rng, best_visits);
+			std::cout << std::setw(13) << std::fixed << std::setprecision(1) << ns << " ns" << std::setw(12) << best_visits;
+		}
+		std::cout << "\n";
+	}
+
+	return 0;
+}
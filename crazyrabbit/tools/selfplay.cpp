@@ -0,0 +1,409 @@
+/*
+	Self-play data generation for CrazyRabbit.
+
+	Plays many games at once in a single process. Every game has its own search tree, and each step every game
+	runs its simulation until it reaches a leaf. The leaves of all games are then evaluated by the network in one
+	batch, so the batch size grows with the number of concurrent games instead of the number of simulations of a
+	single search. The games are split between the threads, which select and back up the simulations of their games
+	while the batch is evaluated between the steps.
+
+	Searches use playout cap randomization: only a random share of the moves is searched with the full number of
+	simulations and recorded as a training target, the others are searched quickly and only move the game forward.
+	The games are written to <output prefix>.pgn and the targets to <output prefix>.policy, one line per position
+	with the round of its game in the PGN, the ply and the visit counts of the searched moves as a sparse policy:
+
+		<round> <ply> <move index>:<visits> <move index>:<visits> ...
+
+	The move indices are the policy indices of the network. The value targets are the results of the games.
+
+	Usage: selfplay [--games N] [--concurrent N] [--threads N] [--sims N] [--fast-sims N] [--full-share P]
+	                [--temperature-plies N] [--max-plies N] [--hash MB] [--backend Synthetic|TensorFlow|AOT] [--latency US] [--seed N]
+	                [--trace trace.json] <output prefix>
+
+	The latency is the simulated inference time of a batch of the Synthetic backend in microseconds. In builds with
+	CRAZYRABBIT_INSTRUMENTATION, --trace writes the last zones of every thread as a Chrome trace when the games end,
+	which shows how the threads wait for the batches.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <barrier>
+#include <random>
+#include <memory>
+#include <numeric>
+#include "../utils.h"
+#include "../crazyrabbit.h"
+
+using namespace crazyrabbit;
+
+struct SelfPlayConfig
+{
+	long games = 100;
+	int concurrent = 256;
+	int threads = static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+	int sims = 800;
+	int fast_sims = 100;
+	double full_share = 0.25;
+	int temperature_plies = 30;
+	int max_plies = 500;
+	size_t hash = 16;
+	NNetBackendType backend = NNetBackendType::Synthetic;
+	long long latency = synthetic_latency;
+	uint64_t seed = 1;
+};
+
+//A game in progress, with the simulation that waits for its leaf to be evaluated.
+struct SelfPlayGame
+{
+	MCTS mcts;
+	Board board;
+	SearchPath path;
+	std::pair<std::vector<float>, float> prediction;
+
+	long round = -1;	// -1 when there are no more games to play
+	int simulations = 0;
+	int target = 0;
+	bool full = false;
+
+	std::vector<std::string> moves;
+	std::vector<std::string> targets;
+};
+
+class SelfPlay
+{
+public:
+	SelfPlay(const SelfPlayConfig& config, const std::string& prefix) : config(config), pgn(prefix + ".pgn"), policy_file(prefix + ".policy")
+	{
+		nnet.backend_type = config.backend;
+		nnet.latency = config.latency;
+		nnet.init();
+	}
+
+	inline bool ready() { return pgn.pgn_file.is_open() && policy_file.is_open(); }
+	inline void run();
+
+	long games = 0L;
+	long positions = 0L;
+	long full_searches = 0L;
+	long fast_searches = 0L;
+	long long simulations = 0LL;
+	long batches = 0L;
+	long long batched_leaves = 0LL;
+	long long nnet_time = 0LL;
+
+private:
+	SelfPlayConfig config;
+	NNet nnet;
+	PGN_writer pgn;
+	std::ofstream policy_file;
+	std::mutex output_mutex;
+	std::atomic<long> next_round = 0L;
+	std::vector<std::unique_ptr<SelfPlayGame>> slots;
+	bool finished = false;
+
+	inline void evaluate_leaves();
+	inline void advance(SelfPlayGame& game, std::mt19937_64& rng);
+	inline bool start_game(SelfPlayGame& game, std::mt19937_64& rng);
+	inline void start_search(SelfPlayGame& game, std::mt19937_64& rng);
+	inline void play_move(SelfPlayGame& game, std::mt19937_64& rng);
+	inline void finish_game(SelfPlayGame& game, const Color winner);
+};
+
+//Plays all games. Every thread advances its share of the games, and the leaves of all games are evaluated together between the steps.
+inline void SelfPlay::run()
+{
+	for (int i = 0; i < config.concurrent; i++)
+	{
+		slots.push_back(std::make_unique<SelfPlayGame>());
+		slots.back()->mcts.set_hash_size(config.hash);
+	}
+
+	std::barrier step(config.threads, [this]() noexcept { evaluate_leaves(); });
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < config.threads; t++)
+	{
+		threads.emplace_back([this, t, &step]()
+		{
+			std::mt19937_64 rng(config.seed * 0x9E3779B97F4A7C15ULL + static_cast<uint64_t>(t));
+
+			for (size_t i = t; i < slots.size(); i += config.threads)
+				start_game(*slots[i], rng);
+
+			while (true)
+			{
+				for (size_t i = t; i < slots.size(); i += config.threads)
+					advance(*slots[i], rng);
+
+				step.arrive_and_wait();
+				if (finished)
+					break;
+			}
+		});
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+//Evaluates the waiting leaves of all games in one batch. Runs on a single thread while the others wait.
+inline void SelfPlay::evaluate_leaves()
+{
+	std::vector<Board*> boards;
+	std::vector<SelfPlayGame*> waiting;
+	for (auto& game : slots)
+	{
+		if (game->path.leaf)
+		{
+			boards.push_back(&*game->path.board);
+			waiting.push_back(game.get());
+		}
+	}
+
+	//Games only stop without a waiting leaf when there are no more games to play.
+	if (boards.empty())
+	{
+		finished = true;
+		return;
+	}
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	std::vector<std::pair<std::vector<float>, float>> predictions;
+	{
+		CRAZYRABBIT_ZONE(NNet);
+		predictions = nnet.predict_batch(boards);
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	nnet_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+
+	for (size_t i = 0; i < waiting.size(); i++)
+		waiting[i]->prediction = std::move(predictions[i]);
+
+	batches++;
+	batched_leaves += static_cast<long long>(boards.size());
+}
+
+//Runs the simulations of the game until one needs its leaf to be evaluated, playing the moves whose search is done.
+inline void SelfPlay::advance(SelfPlayGame& game, std::mt19937_64& rng)
+{
+	if (game.path.leaf)
+	{
+		game.mcts.expand_leaf(game.path, game.prediction);
+		game.mcts.backup(game.board, game.path);
+		game.simulations++;
+	}
+
+	while (game.round >= 0)
+	{
+		if (game.simulations)
+		{
+			//A single legal move does not need to be searched.
+			move_vector<Move>& root = game.mcts.move_data[game.mcts.node_key(game.board)];
+			if (game.simulations >= game.target || game.mcts.stop_simulating || root.size() == 1)
+			{
+				play_move(game, rng);
+
+				double es = game.board.end_score(WHITE);
+				if (es != END_SCORE_NONE || static_cast<int>(game.moves.size()) >= config.max_plies)
+				{
+					finish_game(game, (es == END_SCORE_WIN) ? WHITE : (es == END_SCORE_LOSS) ? BLACK : NO_COLOR);
+					if (!start_game(game, rng))
+						return;
+				} else
+				{
+					start_search(game, rng);
+				}
+			}
+		}
+
+		if (game.mcts.select_leaf(game.board, game.path))
+			return;
+
+		game.mcts.backup(game.board, game.path);
+		game.simulations++;
+	}
+}
+
+//Starts the next game in the slot. Returns false if all games have been started.
+inline bool SelfPlay::start_game(SelfPlayGame& game, std::mt19937_64& rng)
+{
+	game.round = next_round++;
+	if (game.round >= config.games)
+	{
+		game.round = -1;
+		return false;
+	}
+
+	game.mcts.reset();
+	game.board.reset();
+	game.moves.clear();
+	game.targets.clear();
+	start_search(game, rng);
+	return true;
+}
+
+//Starts the search of the next move, which is a full search with the configured probability and a fast search otherwise.
+inline void SelfPlay::start_search(SelfPlayGame& game, std::mt19937_64& rng)
+{
+	game.full = std::uniform_real_distribution<double>(0.0, 1.0)(rng) < config.full_share;
+	game.target = game.full ? config.sims : config.fast_sims;
+	game.simulations = 0;
+	game.mcts.player = game.board.p.turn();
+	game.mcts.stop_simulating = false;
+}
+
+//Plays the searched move. Early in the game it is chosen in proportion to the visits, later the most visited move is played.
+//Positions searched with the full number of simulations are recorded with their visit counts.
+inline void SelfPlay::play_move(SelfPlayGame& game, std::mt19937_64& rng)
+{
+	move_vector<Move>& root = game.mcts.move_data[game.mcts.node_key(game.board)];
+
+	if (game.full)
+	{
+		std::ostringstream target;
+		target << game.round << " " << game.moves.size();
+		for (Move& move : root)
+		{
+			if (move.n_visits)
+				target << " " << move.hash() << ":" << move.n_visits;
+		}
+		game.targets.push_back(target.str());
+	}
+
+	size_t chosen = 0;
+	if (static_cast<int>(game.moves.size()) < config.temperature_plies)
+	{
+		std::vector<double> visits;
+		visits.reserve(root.size());
+		for (Move& move : root)
+			visits.push_back(static_cast<double>(move.n_visits));
+		if (std::accumulate(visits.begin(), visits.end(), 0.0) > 0.0)
+			chosen = std::discrete_distribution<size_t>(visits.begin(), visits.end())(rng);
+	} else
+	{
+		for (size_t i = 1; i < root.size(); i++)
+		{
+			if (root[i].n_visits > root[chosen].n_visits)
+				chosen = i;
+		}
+	}
+
+	Move move = root[chosen];
+	game.moves.push_back(game.board.san(move));
+	game.board.push(move);
+}
+
+//Writes the finished game and its training targets.
+inline void SelfPlay::finish_game(SelfPlayGame& game, const Color winner)
+{
+	std::lock_guard<std::mutex> lock(output_mutex);
+
+	pgn.new_game("CrazyRabbit self-play", static_cast<int>(game.round), "CrazyRabbit", "CrazyRabbit");
+	for (const std::string& move : game.moves)
+		pgn.add_move(move);
+	pgn.flush(winner);
+
+	for (const std::string& target : game.targets)
+		policy_file << target << "\n";
+
+	games++;
+	positions += static_cast<long>(game.targets.size());
+	full_searches += static_cast<long>(game.targets.size());
+	fast_searches += static_cast<long>(game.moves.size() - game.targets.size());
+	simulations += game.mcts.simulation;
+
+	if (games % 10 == 0)
+		std::cerr << "  " << games << " games\n";
+}
+
+int main(int argc, char* argv[])
+{
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	initialise_eval_tables();
+
+	SelfPlayConfig config;
+	std::string prefix;
+	std::string trace_file;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--games" && i + 1 < argc)
+			config.games = std::stol(argv[++i]);
+		else if (arg == "--concurrent" && i + 1 < argc)
+			config.concurrent = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--threads" && i + 1 < argc)
+			config.threads = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--sims" && i + 1 < argc)
+			config.sims = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--fast-sims" && i + 1 < argc)
+			config.fast_sims = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--full-share" && i + 1 < argc)
+			config.full_share = std::stod(argv[++i]);
+		else if (arg == "--temperature-plies" && i + 1 < argc)
+			config.temperature_plies = std::stoi(argv[++i]);
+		else if (arg == "--max-plies" && i + 1 < argc)
+			config.max_plies = std::stoi(argv[++i]);
+		else if (arg == "--hash" && i + 1 < argc)
+			config.hash = std::max<size_t>(1, std::stoul(argv[++i]));
+		else if (arg == "--backend" && i + 1 < argc)
+		{
+			std::string backend = argv[++i];
+			config.backend = (backend == "TensorFlow") ? NNetBackendType::TensorFlow : (backend == "AOT") ? NNetBackendType::AOT : NNetBackendType::Synthetic;
+		}
+		else if (arg == "--latency" && i + 1 < argc)
+			config.latency = std::stoll(argv[++i]);
+		else if (arg == "--seed" && i + 1 < argc)
+			config.seed = std::stoull(argv[++i]);
+		else if (arg == "--trace" && i + 1 < argc)
+			trace_file = argv[++i];
+		else
+			prefix = arg;
+	}
+
+	if (prefix.empty())
+	{
+		std::cerr << "Usage: selfplay [--games N] [--concurrent N] [--threads N] [--sims N] [--fast-sims N] [--full-share P] "
+			"[--temperature-plies N] [--max-plies N] [--hash MB] [--backend Synthetic|TensorFlow|AOT] [--latency US] [--seed N] [--trace trace.json] <output prefix>\n";
+		return 1;
+	}
+
+	//More threads than games would only wait at the barrier.
+	config.threads = std::min(config.threads, config.concurrent);
+
+	SelfPlay self_play(config, prefix);
+	if (!self_play.ready())
+	{
+		std::cerr << "Could not write " << prefix << ".pgn and " << prefix << ".policy\n";
+		return 1;
+	}
+
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+	instrumentation::Registry::get_instance().tracing = !trace_file.empty();
+#endif
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	self_play.run();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cerr << "Played " << self_play.games << " games in " << seconds << " s, " << self_play.positions << " positions recorded ("
+		<< self_play.full_searches << " full and " << self_play.fast_searches << " fast searches)\n";
+	std::cerr << "  " << static_cast<long long>(self_play.simulations / std::max(seconds, 1e-9)) << " simulations/s, "
+		<< self_play.batches << " batches of " << (self_play.batches ? static_cast<double>(self_play.batched_leaves) / self_play.batches : 0.0) << " leaves on average, "
+		<< "nnet " << self_play.nnet_time / 1000 << " ms\n";
+#ifdef CRAZYRABBIT_INSTRUMENTATION
+	std::cerr << instrumentation::info_summary();
+	if (!trace_file.empty() && !instrumentation::Registry::get_instance().write_trace(trace_file))
+		std::cerr << "Could not write " << trace_file << "\n";
+#else
+	if (!trace_file.empty())
+		std::cerr << "Traces are only recorded in builds with CRAZYRABBIT_INSTRUMENTATION\n";
+#endif
+	return 0;
+}
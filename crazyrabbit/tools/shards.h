@@ -0,0 +1,224 @@
+/*
+	Training shards for the CrazyRabbit tools.
+
+	The binary layout of the shards read by the training scripts (see training/ShardReader.py), the writer
+	that splits positions into shards of a fixed size and the replay of PGN games into shard positions.
+*/
+
+#ifndef CRAZYRABBIT_SHARDS_H
+#define CRAZYRABBIT_SHARDS_H
+
+#include <fstream>
+#include <streambuf>
+#include <vector>
+#include <string>
+#include <cstring>
+#include "pgn.h"
+
+namespace crazyrabbit
+{
+	constexpr char shard_magic[4] = { 'C', 'R', 'S', 'D' };
+	constexpr uint32_t shard_version = 1;
+
+	struct ShardHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t num_positions;
+		uint32_t spatial_planes;
+		uint32_t scalars;
+	};
+
+	struct ShardPosition
+	{
+		uint64_t planes[SPATIAL_PLANES];
+		float scalars[SCALAR_INPUT_SIZE];
+		uint16_t policy;
+		int8_t value;
+		int8_t reserved;
+	};
+
+	static_assert(sizeof(ShardHeader) == 24, "the shard header is read by the training scripts");
+	static_assert(sizeof(ShardPosition) == 200, "the shard positions are read by the training scripts");
+
+	//Read-only stream buffer over a part of the mapped file, so the games are parsed without copying them.
+	class MemoryBuffer : public std::streambuf
+	{
+	public:
+		MemoryBuffer(const char* begin, const char* end)
+		{
+			char* data = const_cast<char*>(begin);
+			setg(data, data, data + (end - begin));
+		}
+	};
+
+	//Writes positions into numbered shards of a fixed maximum size.
+	class ShardWriter
+	{
+	public:
+		ShardWriter(const std::string& prefix, const size_t shard_size) : prefix(prefix), shard_size(shard_size) {}
+		~ShardWriter() { close(); }
+
+		inline bool write(const ShardPosition& position);
+		inline void close();
+		inline const std::vector<std::string>& paths() const { return written; }
+
+	private:
+		std::string prefix;
+		size_t shard_size;
+		std::ofstream out;
+		std::vector<ShardPosition> buffer;
+		uint64_t num_positions = 0;
+		std::vector<std::string> written;
+
+		inline bool flush();
+	};
+
+	//Buffers the position and starts a new shard once the current one is full.
+	inline bool ShardWriter::write(const ShardPosition& position)
+	{
+		if (!out.is_open())
+		{
+			std::string path = prefix + "_" + std::to_string(written.size()) + ".bin";
+			out.open(path, std::ios::binary);
+			if (!out.is_open())
+				return false;
+
+			written.push_back(path);
+			num_positions = 0;
+			ShardHeader header{};
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			buffer.reserve(4096);
+		}
+
+		buffer.push_back(position);
+		num_positions++;
+		if (buffer.size() == buffer.capacity() && !flush())
+			return false;
+
+		if (num_positions == shard_size)
+			close();
+		return true;
+	}
+
+	inline bool ShardWriter::flush()
+	{
+		out.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(buffer.size() * sizeof(ShardPosition)));
+		buffer.clear();
+		return static_cast<bool>(out);
+	}
+
+	//Writes the remaining positions and fills in the header of the current shard.
+	inline void ShardWriter::close()
+	{
+		if (!out.is_open())
+			return;
+
+		flush();
+
+		ShardHeader header;
+		std::copy(shard_magic, shard_magic + 4, header.magic);
+		header.version = shard_version;
+		header.num_positions = num_positions;
+		header.spatial_planes = SPATIAL_PLANES;
+		header.scalars = SCALAR_INPUT_SIZE;
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.close();
+	}
+
+	//Returns the start of the first game beginning at or after the given position, which is a tag line following an empty line.
+	inline const char* game_boundary(const char* begin, const char* position, const char* end)
+	{
+		if (position <= begin)
+			return begin;
+
+		for (const char* c = position; c < end; c++)
+		{
+			if (*c != '[' || c[-1] != '\n')
+				continue;
+
+			const char* previous = c - 1;
+			if (previous > begin && previous[-1] == '\r')
+				previous--;
+			if (previous > begin && previous[-1] == '\n')
+				return c;
+		}
+
+		return end;
+	}
+
+	//Packs the input representation of the board into the shard position.
+	inline void pack_position(Board& board, ShardPosition& position)
+	{
+		float spatial[SPATIAL_INPUT_SIZE] = {};
+		std::memset(position.scalars, 0, sizeof(position.scalars));
+		board.input_planes(spatial, position.scalars);
+
+		for (int plane = 0; plane < SPATIAL_PLANES; plane++)
+		{
+			uint64_t bits = 0;
+			for (int square = 0; square < 64; square++)
+			{
+				if (spatial[plane * 64 + square] != 0.0f)
+					bits |= 1ULL << square;
+			}
+			position.planes[plane] = bits;
+		}
+	}
+
+	struct ChunkStats
+	{
+		long games = 0;
+		long skipped = 0;
+		long errors = 0;
+		long positions = 0;
+	};
+
+	//Replays all games of a chunk of the PGN file and writes their positions.
+	inline bool process_chunk(const char* begin, const char* end, ShardWriter& writer, ChunkStats& stats)
+	{
+		MemoryBuffer memory(begin, end);
+		std::istream in(&memory);
+		PGNReader reader(in);
+		PGNGame game;
+		Board board;
+		ShardPosition position{};
+
+		while (reader.next(game))
+		{
+			auto variant = game.tags.find("Variant");
+			if ((variant != game.tags.end() && variant->second != "Crazyhouse" && variant->second != "crazyhouse") || game.score(WHITE) < 0.0)
+			{
+				stats.skipped++;
+				continue;
+			}
+
+			game.set_up(board);
+			for (const std::string& san : game.moves)
+			{
+				Move move = san_to_move(board, san);
+				if (move.from() == NO_SQUARE)
+				{
+					stats.errors++;
+					break;
+				}
+
+				pack_position(board, position);
+				position.policy = move.hash();
+				position.value = static_cast<int8_t>(2.0 * game.score(board.p.turn()) - 1.0);
+				if (!writer.write(position))
+					return false;
+				stats.positions++;
+
+				board.push(move);
+			}
+
+			stats.games++;
+		}
+
+		return true;
+	}
+}
+
+#endif
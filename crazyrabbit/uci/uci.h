@@ -27,7 +27,8 @@ public:
     nodes          ,
     mate           ,
     move_time      ,
-    infinite
+    infinite       ,
+    perft
   };
   enum class state
   {
@@ -72,6 +73,7 @@ public:
   boost::signals2::signal<void()>                                                              receive_stop        ;
   boost::signals2::signal<void()>                                                              receive_ponder_hit  ;
   boost::signals2::signal<void()>                                                              receive_quit        ;
+  boost::signals2::signal<void(const std::size_t& simulations)>                                receive_bench       ;
 
   // Engine to UI.
   static void send_id                                (const std::string& name = "", const std::string& author = "")
@@ -324,10 +326,12 @@ public:
             iss >> commands[command::nodes          ];
           else if (token == "mate"       )
             iss >> commands[command::mate           ];
-          else if (token == "move_time"  )
+          else if (token == "movetime"   )
             iss >> commands[command::move_time      ];
           else if (token == "infinite"   )
             commands[command::infinite];
+          else if (token == "perft"      )
+            iss >> commands[command::perft          ];
         receive_go(commands);
       }
       else if (token == "stop"      )
@@ -343,6 +347,12 @@ public:
         receive_quit();
         running = false;
       }
+      else if (token == "bench"     )
+      {
+        std::size_t simulations = 0;
+        iss >> simulations;
+        receive_bench(simulations);
+      }
       else
       {
         std::cout << "Unrecognized command: " << line << std::endl;
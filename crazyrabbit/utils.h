@@ -26,6 +26,7 @@
 #include <chrono>
 #include <format>
 #include "surge/types.h"
+#include "surge/position.h"
 #include "dirichlet/dirichlet.h"
 #include "robin_hood/robin_hood.h"
 
@@ -35,100 +36,124 @@ namespace crazyrabbit
     // ------------------------------ GAME RELATED ------------------------------
 
     constexpr auto ACTION_SIZE = 5184;
+    constexpr auto SPATIAL_PLANES = 15;
+    constexpr auto SPATIAL_INPUT_SIZE = SPATIAL_PLANES * 64;
+    constexpr auto SCALAR_INPUT_SIZE = 19;
     constexpr auto REPETITIONS_NORM = 500.0f;
     constexpr auto POCKET_COUNT_NORM = 32.0f;
     constexpr auto HALFMOVES_NORM = 40.0f;
 
-    // ------------------------------ EVAL RELATED ------------------------------
+    // ---------------------------- OPENINGS RELATED ----------------------------
 
-    typedef uint16_t AttackInfo;
-
-    constexpr int attackers_index = 11;
-    constexpr AttackInfo clear_attackers = 0b0000011111111111;
-    constexpr AttackInfo attack_mask[NPIECE_TYPES] = { 0b0000010000000000,
-                                                   0b0000001000000000,
-                                                   0b0000000100000000,
-                                                   0b0000000010000000,
-                                                   0b0000000001000000,
-                                                   0b0000000000100000 };
-    constexpr AttackInfo attacks_mask = 0b0000011111100000;
-
-    constexpr AttackInfo drop_mask[NPIECE_TYPES] = { 0b0000000000010000,
-                                                   0b0000000000001000,
-                                                   0b0000000000000100,
-                                                   0b0000000000000010,
-                                                   0b0000000000000001,
-                                                   0b0000000000000000 };
-    constexpr AttackInfo drops_mask = 0b0000000000011111;
-
-    constexpr void add_attack_info(AttackInfo& info, PieceType piece)
-    {
-        AttackInfo num_attackers = info >> attackers_index;
-        info = (info & clear_attackers) | (++num_attackers << attackers_index) | attack_mask[piece];
-    }
+    constexpr char book_magic[4] = { 'C', 'R', 'B', 'K' };
+    constexpr uint32_t book_version = 1;
+    constexpr uint64_t book_seed = 0x2545F4914F6CDD1DULL; // seed of the weighted random selection of book moves
 
-    constexpr void add_drop_info(AttackInfo& info, PieceType piece)
+    //Opening book entry. A book file is a BookHeader followed by the entries sorted by key, in little-endian byte order.
+    struct BookEntry
     {
-        info |= drop_mask[piece];
-    }
+        uint64_t key;       // full zobrist hash of the position
+        uint32_t weight;    // how often the move should be chosen relative to the other moves in the position
+        uint16_t move;      // encoded move, as returned by Move::hash()
+        uint16_t reserved;
+    };
 
-    constexpr bool can_attack(AttackInfo& info, PieceType piece)
+    struct BookHeader
     {
-        return info & attack_mask[piece];
-    }
+        char magic[4];
+        uint32_t version;
+        uint64_t num_entries;
+    };
 
-    constexpr bool can_drop(AttackInfo& info, PieceType piece)
-    {
-        return info & drop_mask[piece];
-    }
+    // ------------------------------ EVAL RELATED ------------------------------
+
+    constexpr uint64_t pawn_cache_size = 1ULL << 14; // number of entries, must be a power of two
 
-    constexpr int attacks_num(AttackInfo& info)
+    constexpr int attack_levels = 16; // squares attacked by more pieces than this are counted as attacked this many times
+
+    //Attack and drop information of one side, kept as bitboards.
+    struct AttackMap
     {
-        return static_cast<int>(info >> attackers_index);
-    }
+        // squares attacked by at least one piece of each type
+        Bitboard by_type[NPIECE_TYPES];
+        // at_least[i] holds the squares attacked by more than i pieces
+        Bitboard at_least[attack_levels];
+        // squares where a piece of each type can be dropped
+        Bitboard drops[NPIECE_TYPES];
+        // the number of attacks summed over all squares
+        int total;
+        // the number of used levels in at_least
+        int levels;
+
+        inline void clear()
+        {
+            for (size_t i = 0; i < NPIECE_TYPES; i++)
+                by_type[i] = drops[i] = 0ULL;
+            for (int i = 0; i < attack_levels; i++)
+                at_least[i] = 0ULL;
+            total = 0;
+            levels = 0;
+        }
+
+        //Adds the attacks of one or more pieces of the given type, where no square is attacked twice by the given bitboard.
+        inline void add(PieceType piece, Bitboard attacked)
+        {
+            if (!attacked)
+                return;
+
+            by_type[piece] |= attacked;
+            total += pop_count(attacked);
+
+            // carry the attacks up the levels
+            if (levels < attack_levels)
+                levels++;
+            for (int i = levels - 1; i > 0; i--)
+                at_least[i] |= at_least[i - 1] & attacked;
+            at_least[0] |= attacked;
+        }
+
+        inline Bitboard attacked() const { return at_least[0]; }
+        inline bool can_attack(Square s, PieceType piece) const { return by_type[piece] & SQUARE_BB[s]; }
+        inline bool can_drop(Square s, PieceType piece) const { return drops[piece] & SQUARE_BB[s]; }
 
-    inline void print_attack_info(AttackInfo& info)
+        inline int attacks_num(Square s) const
+        {
+            int num = 0;
+            Bitboard b = SQUARE_BB[s];
+            while (num < levels && (at_least[num] & b))
+                num++;
+            return num;
+        }
+    };
+
+    inline void print_attack_info(const AttackMap& info, Square s)
     {
-        int num_attacks = info >> attackers_index;
+        int num_attacks = info.attacks_num(s);
         if (num_attacks)
         {
             std::cout << num_attacks << " attacks by ";
             for (int i = 0; i < NPIECE_TYPES; i++)
             {
-                if (info & attack_mask[i])
+                if (info.can_attack(s, static_cast<PieceType>(i)))
                     std::cout << PIECE_STR[i];
             }
         } else
         {
-            std::cout << "no attacks, ";
+            std::cout << "no attacks";
         }
 
-        if (info & drops_mask)
+        bool drops = false;
+        for (int i = PAWN; i <= QUEEN; i++)
         {
-            std::cout << ", drops: ";
-        } else
-        {
-            std::cout << ", no drops";
-            return;
+            if (info.can_drop(s, static_cast<PieceType>(i)))
+            {
+                std::cout << ((drops) ? "" : ", drops: ") << PIECE_STR[i];
+                drops = true;
+            }
         }
 
-        if (info & drop_mask[PAWN])
-            std::cout << "P";
-        if (info & drop_mask[PAWN])
-            std::cout << "N";
-        if (info & drop_mask[PAWN])
-            std::cout << "B";
-        if (info & drop_mask[PAWN])
-            std::cout << "R";
-        if (info & drop_mask[PAWN])
-            std::cout << "Q";
-
-        std::cout << ", 0b";
-
-        for (int i = 15; i >= 0; i--)
-        {
-            std::cout << ((info & (1 << i)) ? 1 : 0);
-        }
+        if (!drops)
+            std::cout << ", no drops";
     }
 
     typedef uint8_t EvalMask;
@@ -138,6 +163,7 @@ namespace crazyrabbit
     constexpr EvalMask king_safety_mask = 0b00000100;
     constexpr EvalMask piece_placement_mask = 0b00001000;
     constexpr EvalMask board_control_mask = 0b00010000;
+    constexpr EvalMask all_eval_masks = 0b00011111;
 
     typedef uint8_t PolicyMask;
 
@@ -145,6 +171,7 @@ namespace crazyrabbit
     constexpr PolicyMask checking_moves_mask = 0b00000010;
     constexpr PolicyMask forking_moves_mask = 0b00000100;
     constexpr PolicyMask capturing_moves_mask = 0b00001000;
+    constexpr PolicyMask all_policy_masks = 0b00001111;
 
     struct ModMask
     {
@@ -714,16 +741,56 @@ namespace crazyrabbit
 
     // --------------------- initialisation functions --------------------------
 
+    // scale of the integer weights that Position accumulates incrementally (hundredths of a pawn)
+    constexpr double incremental_eval_scale = 100.0;
+
+    //Initializes the integer weights of the material and piece-square terms that are accumulated in Position.
+    inline void init_incremental_weights()
+    {
+        const double* square_score_w[NPIECE_TYPES] = { pawn_square_score_w, knight_square_score_w, bishop_square_score_w, rook_square_score_w, queen_square_score_w, king_square_score_w };
+        const double* square_score_b[NPIECE_TYPES] = { pawn_square_score_b, knight_square_score_b, bishop_square_score_b, rook_square_score_b, queen_square_score_b, king_square_score_b };
+
+        for (size_t piece = 0; piece < NPIECES; piece++)
+        {
+            eval_weights::material_table[piece] = 0;
+            eval_weights::hand_table[piece] = 0;
+            for (size_t square = 0; square < NSQUARES; square++)
+                eval_weights::psq_table[piece][square] = 0;
+        }
+
+        for (int pt = PAWN; pt <= KING; pt++)
+        {
+            Piece white = make_piece(WHITE, static_cast<PieceType>(pt));
+            Piece black = make_piece(BLACK, static_cast<PieceType>(pt));
+
+            eval_weights::material_table[white] = static_cast<int>(std::lround(material_value[pt] * incremental_eval_scale));
+            eval_weights::material_table[black] = -eval_weights::material_table[white];
+            eval_weights::hand_table[white] = static_cast<int>(std::lround(material_value_hand[pt] * incremental_eval_scale));
+            eval_weights::hand_table[black] = -eval_weights::hand_table[white];
+
+            for (size_t square = 0; square < NSQUARES; square++)
+            {
+                eval_weights::psq_table[white][square] = static_cast<int>(std::lround(square_score_w[pt][square] * incremental_eval_scale));
+                eval_weights::psq_table[black][square] = -static_cast<int>(std::lround(square_score_b[pt][square] * incremental_eval_scale));
+            }
+        }
+    }
+
     inline void initialise_eval_tables()
     {
         init_diamond_distances();
         init_cross_distances();
+        init_incremental_weights();
     }
 
     // ------------------------- MATE SEARCH RELATED ----------------------------
 
     constexpr int default_max_depth = 3;
 
+    // ------------------------------ PERFT RELATED -----------------------------
+
+    constexpr size_t default_perft_hash_size = 64; // in MB
+
     // ---------------------------- MCTS RELATED --------------------------------
 
     constexpr int cpuct = 1;
@@ -743,13 +810,71 @@ namespace crazyrabbit
     constexpr double check_factor = 0.5;
     constexpr double EPS = 1e-8;
     constexpr int moves_per_game = 50;
-    constexpr int move_thresh = 40;
-    constexpr double original_time_amount = 0.7;
     constexpr double increment_amount = 0.7;
-    constexpr double time_proportion = 0.2; //0.05;
     constexpr double eval_factor = 0.25;
+    constexpr size_t widening_min_children = 4;
+    constexpr double widening_factor = 2.0;
+    constexpr double transposition_q_delta = 0.01;
+    constexpr size_t default_hash_size = 256; // in MB
+    constexpr double prune_target = 0.75; // fraction of the memory budget that is left after pruning the tree
+
+    // ---------------------------- TIME RELATED --------------------------------
+
+    constexpr int min_moves_left = 20; // the least number of moves the remaining time is planned for
+    constexpr double moves_left_per_ply = 0.25; // how much the planned number of moves shrinks with each ply
+    constexpr long long move_overhead = 50; // in milliseconds, kept for the communication with the GUI
+    constexpr double max_time_fraction = 0.25; // the largest part of the remaining time a single move can use
+    constexpr double max_time_factor = 3.0; // the most time a move can use as a multiple of its planned time
+    constexpr double time_extension = 0.5; // part of the planned time added to the budget of a critical move
+    constexpr double best_move_change_window = 0.25; // part of the budget in which a change of the best move makes the move critical
+    constexpr double q_drop_thresh = 0.05; // drop of the best move's Q-value that makes the move critical
+    constexpr double saved_time_share = 0.5; // part of the saved time a critical move can use
+    constexpr long long nps_min_time = 20; // in milliseconds, how long a move must be searched before its simulation rate is trusted
+    constexpr double nps_smoothing = 0.3; // weight of the last move in the measured simulation rate
+    constexpr long long deadline_margin = 30; // in milliseconds, between the planned end of the search and the hard deadline
+    constexpr int fallback_interval = 32; // simulations between updates of the move played when the hard deadline passes
+
+    // ---------------------------- BENCH RELATED -------------------------------
+
+    constexpr int default_bench_sims = 800; // simulations per position
+    constexpr uint32_t bench_seed = 0x2545F491U; // seed of the Dirichlet noise and the tie breaks during the bench
+
+    //Positions searched by the bench, from the opening to the early middlegame, most of them with pieces in the pockets.
+    inline const std::vector<std::string> bench_positions = {
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR[] w KQkq - 0 1",
+        "r1bqk2r/pp1n1ppp/2n1p3/2bpP3/8/2NB1N2/PPP2PPP/R1BQK2R[Pp] w KQkq - 2 8",
+        "r1bq1b1r/ppp3pp/2n1k3/3np3/2B5/5Q2/PPPP1PPP/RNB1K2R[PPpn] w KQ - 2 8",
+        "r3kb1r/pp1n1ppp/2p1pn2/q7/2BP4/2N2Q1P/PPPB1PP1/R3KB1R[Ppn] w KQkq - 0 10",
+        "r1b1k1nr/ppppqppp/8/8/2BBP3/8/PPP2PPP/RNB1K2R[PNpnq] w KQkq - 2 9",
+        "r1bqk2r/ppp1nppp/2n1p3/4P1B1/2BpP3/5N2/PP1N1PPP/R2QK2R[pb] w KQkq - 5 10",
+        "r1bqk2r/ppp2ppp/2n5/4p3/1b6/2NP4/PPP1NPPP/R1BQ1RK1[PNpb] w kq - 2 9",
+        "r1bqk2r/pppp1ppp/2n1p3/4P3/1b1Pn3/2NB1N2/PPP2PPP/R1BQK2R[] b KQkq - 0 1"
+    };
 
-    typedef robin_hood::unordered_map<std::string, move_vector<Move>> MD_t;
+    // ---------------------------- NNET RELATED --------------------------------
+
+    constexpr long long synthetic_latency = 0; // in microseconds
+    constexpr double synthetic_value_range = 0.9;
+    constexpr uint64_t synthetic_side_key = 0x9E3779B97F4A7C15ULL;
+
+    //Mixes the bits of the given key (splitmix64 finalizer).
+    inline uint64_t mix_hash(uint64_t key)
+    {
+        key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+        return key ^ (key >> 31);
+    }
+
+    enum class NNetBackendType
+    {
+        TensorFlow,
+        Synthetic,
+        AOT,
+        NUM
+    };
+
+    // node map, so references to nodes stay valid while new nodes are inserted during a simulation
+    typedef robin_hood::unordered_node_map<uint64_t, move_vector<Move>> MD_t;
 
     enum class BestMoveStrat
     {
@@ -819,9 +944,10 @@ namespace crazyrabbit
         ~Dirichlet() { delete d; }
 
     public:
+        //One generator per thread, so that searches can run in parallel.
         static Dirichlet& get_instance()
         {
-            static Dirichlet instance;
+            static thread_local Dirichlet instance;
             return instance;
         }
 
@@ -830,6 +956,13 @@ namespace crazyrabbit
 
         //Returns a Dirichlet noise sample.
         inline std::vector<double> get_noise() { return (d->operator())(gen); }
+
+        //Restarts the generator of the calling thread from the given seed, also clearing the state kept by the distributions.
+        inline void seed(const uint32_t seed)
+        {
+            gen.seed(seed);
+            d->set_params(d->get_params());
+        }
     };
 
     class Elo
@@ -903,6 +1036,54 @@ namespace crazyrabbit
         inline double LOS() const { return 100 * (0.5 + 0.5 * std::erf((static_cast<double>(m_wins) - static_cast<double>(m_losses)) / std::sqrt(2.0 * (static_cast<double>(m_wins) + static_cast<double>(m_losses))))); }
     };
 
+    //Sequential probability ratio test between two Elo hypotheses, H0: elo = elo0 and H1: elo = elo1.
+    //Uses the normal approximation of the log-likelihood ratio of the game scores.
+    class SPRT
+    {
+    private:
+        double m_lower;
+        double m_upper;
+        double m_score0;
+        double m_score1;
+
+    public:
+        SPRT(double elo0, double elo1, double alpha, double beta)
+        {
+            m_lower = std::log(beta / (1.0 - alpha));
+            m_upper = std::log((1.0 - beta) / alpha);
+            m_score0 = 1.0 / (1.0 + std::pow(10.0, -elo0 / 400.0));
+            m_score1 = 1.0 / (1.0 + std::pow(10.0, -elo1 / 400.0));
+        }
+
+        inline double lower_bound() const { return m_lower; }
+        inline double upper_bound() const { return m_upper; }
+
+        inline double LLR(int wins, int losses, int draws) const
+        {
+            double n = wins + losses + draws;
+            if (n == 0.0)
+                return 0.0;
+
+            double mu = (wins + draws / 2.0) / n;
+            double var = (wins * std::pow(1.0 - mu, 2.0) + losses * std::pow(0.0 - mu, 2.0) + draws * std::pow(0.5 - mu, 2.0)) / n;
+            if (var <= 0.0)
+                return 0.0;
+
+            return n * (m_score1 - m_score0) * (2.0 * mu - m_score0 - m_score1) / (2.0 * var);
+        }
+
+        //Returns 1 if H1 is accepted, -1 if H0 is accepted and 0 if the test needs more games.
+        inline int status(int wins, int losses, int draws) const
+        {
+            double llr = LLR(wins, losses, draws);
+            if (llr >= m_upper)
+                return 1;
+            if (llr <= m_lower)
+                return -1;
+            return 0;
+        }
+    };
+
     class PGN_writer
     {
     public:
@@ -966,12 +1147,7 @@ namespace crazyrabbit
                     pgn_file << move_counter << ". ";
                 }
 
-                pgn_file << move;
-
-                if (move_index == num_moves)
-                    pgn_file << "# ";
-                else
-                    pgn_file << " ";
+                pgn_file << move << " ";
 
                 if (move_index == num_moves)
                     pgn_file << result << "\n\n";
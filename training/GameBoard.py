@@ -176,25 +176,27 @@ class GameBoard(chess.variant.CrazyhouseBoard):
 
 
     def inputRepresentation(self):
-        input_rep = np.zeros((34, 64))
+        # planes that vary across the board, the constant ones are passed as scalars and broadcast inside the network
+        spatial = np.zeros((15, 64))
+        scalars = np.zeros(19)
 
         # pieces positions for each player
         for player in [True, False]:
             for piece in range(1, 7):
-                input_rep[piece - 1 if player else 6 + (piece - 1), list(self.pieces(piece, player))] = 1
+                spatial[piece - 1 if player else 6 + (piece - 1), list(self.pieces(piece, player))] = 1
 
         # how often the board position has occured
         s, _ = self.fen().split(None, 1)
         if s not in self.state_repetitions:
             s, _ = self.mirror().fen().split(None, 1)
 
-        input_rep[12, list(range(64))] = self.state_repetitions[s] / 500
-        input_rep[13, list(range(64))] = self.state_repetitions[s] / 500
+        scalars[0] = self.state_repetitions[s] / 500
+        scalars[1] = self.state_repetitions[s] / 500
 
         # pocket counts
         for player in [True, False]:
             for piece in range(1, 6):
-                input_rep[14 + (piece - 1) if player else 19 + (piece - 1), list(range(64))] = self.pockets[player].count(piece) / 32
+                scalars[2 + (piece - 1) if player else 7 + (piece - 1)] = self.pockets[player].count(piece) / 32
 
         # promoted pieces (pawns)
         promoted_white = []
@@ -209,24 +211,24 @@ class GameBoard(chess.variant.CrazyhouseBoard):
                         promoted_black.append(square)
 
         for player in [True, False]:
-            input_rep[24 if player else 25, promoted_white if player else promoted_black] = 1
+            spatial[12 if player else 13, promoted_white if player else promoted_black] = 1
 
         # en-passant square
         if (self.ep_square):
-            input_rep[26][self.ep_square] = 1;
+            spatial[14][self.ep_square] = 1;
 
         # color
-        input_rep[27, list(range(64))] = 1 if self.turn else 0
+        scalars[12] = 1 if self.turn else 0
 
         # total move count
-        input_rep[28, list(range(64))] = self.fullmove_number / 500
+        scalars[13] = self.fullmove_number / 500
 
         # castling rights
         for player in [True, False]:
-            input_rep[29 if player else 31, list(range(64))] = 1 if self.has_kingside_castling_rights(player) else 0
-            input_rep[30 if player else 32, list(range(64))] = 1 if self.has_queenside_castling_rights(player) else 0
+            scalars[14 if player else 16] = 1 if self.has_kingside_castling_rights(player) else 0
+            scalars[15 if player else 17] = 1 if self.has_queenside_castling_rights(player) else 0
 
         # no-progress count (halfmove count)
-        input_rep[33, list(range(64))] = self.halfmove_clock / 40
+        scalars[18] = self.halfmove_clock / 40
 
-        return input_rep
+        return spatial, scalars
@@ -37,8 +37,19 @@ class NNet():
     def __init__(self):
         # Neural Net
         # Inputs
-        self.input_boards = Input(shape=(34,64))
-        inputs = Reshape((34, 8, 8))(self.input_boards)
+        # 15 spatial planes (pieces, promoted pawns, en-passant) and 19 scalars that are constant across the board
+        self.input_spatial = Input(shape=(15,64), name='spatial')
+        self.input_scalars = Input(shape=(19,), name='scalars')
+
+        # broadcast the scalars to full planes and restore the original 34 plane order
+        scalar_planes = Permute((2, 1))(RepeatVector(64)(self.input_scalars))
+        planes = Concatenate(axis=1)([
+            Lambda(lambda x: x[:, :12])(self.input_spatial),
+            Lambda(lambda x: x[:, :12])(scalar_planes),
+            Lambda(lambda x: x[:, 12:])(self.input_spatial),
+            Lambda(lambda x: x[:, 12:])(scalar_planes)
+        ])
+        inputs = Reshape((34, 8, 8))(planes)
 
         conv0 = Conv2D(args['num_channels'], kernel_size=3, strides=1, padding="same", data_format="channels_first", use_bias=False, kernel_regularizer=tf.keras.regularizers.l2(0.0001))(inputs)
         bn0 = BatchNormalization()(conv0)
@@ -82,23 +93,29 @@ class NNet():
         self.pi = policy_head
         self.v = value_head
 
-        self.model = Model(inputs=self.input_boards, outputs=[self.pi, self.v])
+        self.model = Model(inputs=[self.input_spatial, self.input_scalars], outputs=[self.pi, self.v])
         self.model.compile(loss=[policy_loss_fn, value_loss_fn], optimizer=SGD(learning_rate=0.00001, momentum=0.95, nesterov=True))
 
     def train(self, examples):
-        input_boards, target_pis, target_vs = list(zip(*examples))
-        input_boards = np.asarray(input_boards)
+        input_spatial, input_scalars, target_pis, target_vs = list(zip(*examples))
+        input_spatial = np.asarray(input_spatial)
+        input_scalars = np.asarray(input_scalars)
         target_pis = np.asarray(target_pis)
         target_vs = np.asarray(target_vs)
-        self.model.fit(x = input_boards, y = [target_pis, target_vs], batch_size = args['batch_size'], epochs = args['epochs'])
+        self.model.fit(x = [input_spatial, input_scalars], y = [target_pis, target_vs], batch_size = args['batch_size'], epochs = args['epochs'])
+
+    def train_sequence(self, sequence):
+        # sequence yields batches of ([spatial, scalars], [pi, v]), like the ShardSequence of the training shards
+        self.model.fit(sequence, epochs = args['epochs'])
 
     def predict(self, board):
         # preparing input
-        input_rep = board.inputRepresentation()
-        input_rep = input_rep[np.newaxis, :, :]
+        spatial, scalars = board.inputRepresentation()
+        spatial = spatial[np.newaxis, :, :]
+        scalars = scalars[np.newaxis, :]
 
         # run
-        pi, v = self.model.predict(input_rep)
+        pi, v = self.model.predict([spatial, scalars])
         return pi[0], v[0]
 
     def save_checkpoint(self, folder='checkpoint', filename='checkpoint.pth.tar'):
@@ -0,0 +1,77 @@
+import glob
+import os
+
+import numpy as np
+import tensorflow as tf
+
+ACTION_SIZE = 5184
+SHARD_MAGIC = b'CRSD'
+SHARD_VERSION = 1
+
+# layout of the shards written by crazyrabbit/tools/pgn_shards.cpp
+HEADER_DTYPE = np.dtype([
+    ('magic', 'S4'),
+    ('version', '<u4'),
+    ('num_positions', '<u8'),
+    ('spatial_planes', '<u4'),
+    ('scalars', '<u4')
+])
+
+def position_dtype(spatial_planes, scalars):
+    return np.dtype([
+        ('planes', '<u8', (spatial_planes,)),
+        ('scalars', '<f4', (scalars,)),
+        ('policy', '<u2'),
+        ('value', 'i1'),
+        ('reserved', 'i1')
+    ])
+
+def open_shard(path):
+    # memory maps the positions of a shard, they are only read when accessed
+    header = np.fromfile(path, dtype=HEADER_DTYPE, count=1)
+    if len(header) != 1 or header['magic'][0] != SHARD_MAGIC or header['version'][0] != SHARD_VERSION:
+        raise ValueError(path + " is not a CrazyRabbit training shard")
+
+    dtype = position_dtype(int(header['spatial_planes'][0]), int(header['scalars'][0]))
+    return np.memmap(path, dtype=dtype, mode='r', offset=HEADER_DTYPE.itemsize, shape=(int(header['num_positions'][0]),))
+
+def unpack(positions):
+    # returns the network inputs and targets of the given shard positions, in the format of GameBoard.inputRepresentation
+    planes = np.ascontiguousarray(positions['planes'])
+    spatial = np.unpackbits(planes.view(np.uint8), axis=-1, bitorder='little').reshape(len(positions), planes.shape[1], 64).astype(np.float32)
+    scalars = np.array(positions['scalars'], dtype=np.float32)
+    pi = np.zeros((len(positions), ACTION_SIZE), dtype=np.float32)
+    pi[np.arange(len(positions)), positions['policy']] = 1.0
+    v = positions['value'].astype(np.float32)
+    return spatial, scalars, pi, v
+
+def shard_paths(path):
+    # a single shard or all the shards in a directory
+    if os.path.isdir(path):
+        return sorted(glob.glob(os.path.join(path, '*.bin')))
+    return [path]
+
+class ShardSequence(tf.keras.utils.Sequence):
+    # feeds the positions of the shards to keras in shuffled batches, only unpacking one batch at a time
+
+    def __init__(self, paths, batch_size, max_positions=None):
+        self.shards = [open_shard(path) for path in paths]
+        self.index = np.concatenate([np.stack([np.full(len(shard), i), np.arange(len(shard))], axis=1) for i, shard in enumerate(self.shards)])
+        if max_positions is not None:
+            self.index = self.index[:max_positions]
+        self.batch_size = batch_size
+        self.on_epoch_end()
+
+    def __len__(self):
+        return (len(self.index) + self.batch_size - 1) // self.batch_size
+
+    def __getitem__(self, batch):
+        entries = self.index[batch * self.batch_size:(batch + 1) * self.batch_size]
+        # sorted reads are mostly sequential in the mapped files
+        entries = entries[np.lexsort((entries[:, 1], entries[:, 0]))]
+        positions = np.concatenate([self.shards[shard][entries[entries[:, 0] == shard, 1]] for shard in np.unique(entries[:, 0])])
+        spatial, scalars, pi, v = unpack(positions)
+        return [spatial, scalars], [pi, v]
+
+    def on_epoch_end(self):
+        np.random.shuffle(self.index)
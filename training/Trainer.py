@@ -11,8 +11,9 @@ from tqdm import tqdm
 import chess
 import chess.pgn
 
-from NNet import NNet
+from NNet import NNet, args
 from GameBoard import GameBoard
+from ShardReader import ShardSequence, shard_paths
 
 log = logging.getLogger(__name__)
 
@@ -59,9 +60,9 @@ class Trainer():
                     action = board.encodeAction(move)
                     pi = np.zeros(ACTION_SIZE)
                     pi[action] = 1.0
-                    input_rep = board.inputRepresentation()
+                    spatial, scalars = board.inputRepresentation()
 
-                    train_set.append((input_rep, pi, v))
+                    train_set.append((spatial, scalars, pi, v))
 
                     board.push(move)
 
@@ -89,3 +90,19 @@ class Trainer():
         filename = "human_data_" + str(num_train_games)
         nnet.save_checkpoint(filename=filename)
         log.info("Done!")
+
+    def train_with_shards(self, shards_path, num_train_positions):
+        # train on the binary shards written by crazyrabbit/tools/pgn_shards.cpp, which are read batch by batch
+        paths = shard_paths(shards_path)
+        log.info("Loading " + str(len(paths)) + " shards...")
+        sequence = ShardSequence(paths, args['batch_size'], num_train_positions)
+
+        nnet = NNet()
+        log.info("Started training...")
+        nnet.train_sequence(sequence)
+        log.info("Trained on " + str(len(sequence.index)) + " positions in total.")
+
+        # save the current neural network
+        filename = "human_data_positions_" + str(len(sequence.index))
+        nnet.save_checkpoint(filename=filename)
+        log.info("Done!")
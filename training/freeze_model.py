@@ -0,0 +1,64 @@
+import os
+import sys
+import logging
+import coloredlogs
+import tensorflow as tf
+from tensorflow.python.framework.convert_to_constants import convert_variables_to_constants_v2
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+
+log = logging.getLogger(__name__)
+
+coloredlogs.install(level='INFO')
+
+# batch sizes the model is ahead-of-time compiled for (must match aot/BUILD and the AOTBackend in crazyrabbit.h)
+BATCH_SIZES = [1, 8, 32, 64]
+
+INPUT_NAMES = ['spatial', 'scalars']
+INPUT_SHAPES = [(15, 64), (19,)]
+OUTPUT_NAMES = ['pi', 'v']
+
+def freeze(model, batch_size):
+    # trace the model with a fixed batch size so tfcompile gets static shapes
+    fn = tf.function(lambda spatial, scalars: model([spatial, scalars], training=False))
+    concrete_fn = fn.get_concrete_function(*[tf.TensorSpec((batch_size,) + shape, tf.float32, name=name) for name, shape in zip(INPUT_NAMES, INPUT_SHAPES)])
+    frozen_fn = convert_variables_to_constants_v2(concrete_fn)
+    return frozen_fn
+
+def write_config(frozen_fn, batch_size, path):
+    with open(path, 'w') as f:
+        for name, tensor in zip(INPUT_NAMES, frozen_fn.inputs):
+            f.write('feed {\n')
+            f.write('  id {{ node_name: "{}" }}\n'.format(tensor.op.name))
+            f.write('  shape {\n')
+            for dim in tensor.shape:
+                f.write('    dim {{ size: {} }}\n'.format(dim))
+            f.write('  }\n')
+            f.write('  name: "{}"\n'.format(name))
+            f.write('}\n')
+
+        for name, tensor in zip(OUTPUT_NAMES, frozen_fn.outputs):
+            f.write('fetch {\n')
+            f.write('  id {{ node_name: "{}" }}\n'.format(tensor.op.name))
+            f.write('  name: "{}"\n'.format(name))
+            f.write('}\n')
+
+def main():
+    model_path = sys.argv[1] if len(sys.argv) > 1 else 'model'
+    out_path = sys.argv[2] if len(sys.argv) > 2 else 'aot'
+
+    log.info("Loading model from %s...", model_path)
+    model = tf.keras.models.load_model(model_path, compile=False)
+
+    for batch_size in BATCH_SIZES:
+        frozen_fn = freeze(model, batch_size)
+        name = 'crazyrabbit_b{}'.format(batch_size)
+
+        tf.io.write_graph(frozen_fn.graph.as_graph_def(), out_path, name + '.pb', as_text=False)
+        write_config(frozen_fn, batch_size, os.path.join(out_path, name + '.config.pbtxt'))
+
+        log.info("Wrote %s graph and tfcompile config.", name)
+
+
+if __name__ == "__main__":
+    main()
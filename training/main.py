@@ -10,21 +10,27 @@ log = logging.getLogger(__name__)
 coloredlogs.install(level='INFO')  # Change this to DEBUG to see more info.
 
 def main():
-    num_games = input("Insert number of games to train with: ")
+    file_name = input("Insert path to .pgn file with games, or to the training shards: ")
+
+    if file_name.endswith(".pgn"):
+        num = input("Insert number of games to train with: ")
+    else:
+        num = input("Insert number of positions to train with: ")
 
     try:
-        num_games = int(num_games)
+        num = int(num)
     except:
-        print("Please insert only the number of games.")
+        print("Please insert only the number.")
         exit(0)
 
-    file_name = input("Insert path to .pgn file with games: ")
-
     log.info("Starting %s...", Trainer.__name__)
 
     t = Trainer()
 
-    t.train_with_games(file_name, num_games)
+    if file_name.endswith(".pgn"):
+        t.train_with_games(file_name, num)
+    else:
+        t.train_with_shards(file_name, num)
 
 
 if __name__ == "__main__":